@@ -0,0 +1,377 @@
+// Throughput benchmark for the delivery path, producer threads deliver
+// through the DSS API into a Lua state that polls in a loop.
+// Reports events/s, CPU time per event and the latency percentiles (as
+// measured by darksidesync itself, see 'latency').
+//
+// Build (Linux, against Lua 5.1, adjust LUAINC to where its headers are installed);
+//   LUAINC=/usr/include/lua5.1
+//   SRC="../darksidesync.c ../delivery.c ../locking.c ../udpsocket.c ../waithandle.c"
+//   SRC="$SRC ../fdsignal.c ../utiltable.c ../pool.c ../histogram.c ../event.c ../ticket.c"
+//   gcc -O2 -D_GNU_SOURCE -I.. -I$LUAINC -o dss_bench dss_bench.c $SRC -llua5.1 -lpthread -ldl
+//   ./dss_bench -p 4 -n 100000
+// Options;
+//   -p <n>     number of producer threads (default 1)
+//   -n <n>     number of events per producer (default 100000)
+//   -r         producers wait for a result from Lua (return callback)
+//   -u <port>  send UDP notifications to this port, the Lua loop waits for
+//              them, instead of polling in a busy loop
+//   -f         use the file descriptor notification (see 'setfd'), the Lua
+//              loop waits for it to become readable, instead of polling in a
+//              busy loop. Combine with '-c' to compare against '-u'
+//   -c         coalesce notifications (see 'setnotifymode')
+//   -i         deliver through 'reserve/commit', with an inline payload
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <lua.h>
+#include <lauxlib.h>
+#include <lualib.h>
+#include "darksidesync_api.h"
+
+extern int luaopen_darksidesync(lua_State *L);
+
+static void* libid = &libid;		// ID of the synthetic utility
+static void* utilid = NULL;
+static pDSS_api_1v1_t api = NULL;
+static int producers = 1;
+static int events = 100000;
+static int wantreturn = 0;
+static int udpport = 0;
+static int usefd = 0;
+static int coalesce = 0;
+static int inlined = 0;
+static int udpsock = -1;
+static int notifyfd = -1;
+static long errors = 0;
+
+// data for an event for which a result is expected
+typedef struct benchdata {
+	long value;
+	long result;
+} benchdata;
+
+static double now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double cputime()
+{
+	struct rusage ru;
+	getrusage(RUSAGE_SELF, &ru);
+	return ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6 + ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+}
+
+/*
+** ===============================================================
+** Synthetic utility
+** ===============================================================
+*/
+static void cancel(void* id)
+{
+	api->unreg(id);
+	utilid = NULL;
+}
+
+// pushes the Lua callback and the value, pData is the value itself if no
+// result is expected (no allocations, to measure DSS only)
+static int decode(lua_State *L, void* pData, void* id)
+{
+	(void)id;
+	if (L == NULL) return 0;	// cancelled, nothing to release
+	lua_getfield(L, LUA_REGISTRYINDEX, "bench.callback");
+	if (wantreturn || inlined)
+		lua_pushinteger(L, ((benchdata*)pData)->value);
+	else
+		lua_pushinteger(L, (lua_Integer)(intptr_t)pData);
+	return 2;
+}
+
+static int result(lua_State *L, void* pData, void* id, int garbage)
+{
+	benchdata* d = (benchdata*)pData;
+	(void)id;
+	if (L != NULL && !garbage && lua_gettop(L) >= 1)
+		d->result = (long)lua_tointeger(L, 1);
+	else
+		d->result = -1;
+	return 0;
+}
+
+static void* producer(void* arg)
+{
+	long id = (long)(intptr_t)arg;
+	long errs = 0;
+	int i, r;
+	benchdata d;
+	benchdata* p;
+
+	for (i = 0; i < events; i++)
+	{
+		if (inlined)
+		{
+			p = (benchdata*)api->reserve(utilid, DSS_PRIORITY_DEFAULT, sizeof(benchdata), decode, (wantreturn ? result : NULL), &r);
+			if (p == NULL)
+			{
+				errs++;
+				continue;
+			}
+			p->value = id * events + i;
+			r = api->commit(p);	// with a return callback, 'p' is released by now
+			if (r < DSS_SUCCESS) errs++;
+		}
+		else if (wantreturn)
+		{
+			d.value = id * events + i;
+			r = api->deliver(utilid, decode, result, &d);
+			if (r < DSS_SUCCESS || d.result != d.value + 1) errs++;
+		}
+		else
+		{
+			r = api->deliver(utilid, decode, NULL, (void*)(intptr_t)i);
+			if (r < DSS_SUCCESS) errs++;
+		}
+	}
+	__sync_fetch_and_add(&errors, errs);
+	return NULL;
+}
+
+/*
+** ===============================================================
+** Lua side
+** ===============================================================
+*/
+// waits for a notification, or yields if notifications are off
+// NOTE: the file descriptor is not read, darksidesync clears it once the
+// queue has been found empty
+static int L_wait(lua_State *L)
+{
+	char buf[64];
+	struct pollfd p[2];
+	int n = 0;
+	(void)L;
+
+	if (udpsock == -1 && notifyfd == -1)
+	{
+		sched_yield();
+		return 0;
+	}
+	if (udpsock != -1)
+	{
+		p[n].fd = udpsock;
+		p[n++].events = POLLIN;
+	}
+	if (notifyfd != -1)
+	{
+		p[n].fd = notifyfd;
+		p[n++].events = POLLIN;
+	}
+	if (poll(p, n, 100) > 0 && udpsock != -1)
+		while (recv(udpsock, buf, sizeof(buf), MSG_DONTWAIT) >= 0) {}
+	return 0;
+}
+
+static const char* benchloop =
+	"local dss, total, wantreturn = ...\n"
+	"local handled = 0\n"
+	"local callback\n"
+	"if wantreturn then\n"
+	"  callback = function(ret, value) ret(value + 1) end\n"
+	"else\n"
+	"  callback = function(value) end\n"
+	"end\n"
+	"debug.getregistry()['bench.callback'] = callback\n"
+	"bench.ready()\n"
+	"while handled < total do\n"
+	"  local count, items = dss.pollmany(256)\n"
+	"  if count == -1 then\n"
+	"    bench.wait()\n"
+	"  else\n"
+	"    for i = 1, #items, 2 do\n"
+	"      items[i](unpack(items[i + 1]))\n"
+	"    end\n"
+	"    handled = handled + #items / 2\n"
+	"  end\n"
+	"end\n"
+	"return dss.latency(), dss.stats()\n";
+
+static pthread_t* threads;
+static int started = 0;		// number of producer threads started
+static double start;
+static double startcpu;
+
+// starts the producers, once the Lua side is set up
+static int L_ready(lua_State *L)
+{
+	long i;
+	(void)L;
+	start = now();
+	startcpu = cputime();
+	for (i = 0; i < producers; i++)
+		if (pthread_create(&threads[i], NULL, producer, (void*)(intptr_t)i) == 0) started++;
+	return 0;
+}
+
+static int openudp()
+{
+	struct sockaddr_in a;
+	memset(&a, 0, sizeof(a));
+	a.sin_family = AF_INET;
+	a.sin_port = htons(udpport);
+	a.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	udpsock = socket(AF_INET, SOCK_DGRAM, 0);
+	if (udpsock == -1 || bind(udpsock, (struct sockaddr*)&a, sizeof(a)) != 0) return 1;
+	return 0;
+}
+
+static void printstage(lua_State *L, const char* stage)
+{
+	lua_getfield(L, -1, stage);
+	lua_getfield(L, -1, "p50");
+	lua_getfield(L, -2, "p99");
+	lua_getfield(L, -3, "p999");
+	lua_getfield(L, -4, "max");
+	printf("  %-8s p50 %8ld us  p99 %8ld us  p999 %8ld us  max %8ld us\n", stage,
+		(long)lua_tointeger(L, -4), (long)lua_tointeger(L, -3), (long)lua_tointeger(L, -2), (long)lua_tointeger(L, -1));
+	lua_pop(L, 5);
+}
+
+int main(int argc, char** argv)
+{
+	lua_State *L;
+	double elapsed, cpu;
+	long total;
+	int err, i, c;
+
+	while ((c = getopt(argc, argv, "p:n:ru:fci")) != -1)
+	{
+		switch (c)
+		{
+			case 'p': producers = atoi(optarg); break;
+			case 'n': events = atoi(optarg); break;
+			case 'r': wantreturn = 1; break;
+			case 'u': udpport = atoi(optarg); break;
+			case 'f': usefd = 1; break;
+			case 'c': coalesce = 1; break;
+			case 'i': inlined = 1; break;
+			default:
+				fprintf(stderr, "usage: %s [-p producers] [-n events] [-r] [-u port] [-f] [-c] [-i]\n", argv[0]);
+				return 1;
+		}
+	}
+	if (producers <= 0 || events <= 0) return 1;
+	total = (long)producers * events;
+	threads = (pthread_t*)malloc(producers * sizeof(pthread_t));
+	if (threads == NULL) return 1;
+	if (udpport != 0 && openudp() != 0)
+	{
+		fprintf(stderr, "could not bind UDP port %d\n", udpport);
+		return 1;
+	}
+
+	// setup Lua, load darksidesync and register the utility
+	L = luaL_newstate();
+	luaL_openlibs(L);
+	lua_pushcfunction(L, luaopen_darksidesync);
+	lua_call(L, 0, 1);
+	lua_setglobal(L, "darksidesync");
+	lua_getfield(L, LUA_REGISTRYINDEX, DSS_REGISTRY_NAME);
+	lua_getfield(L, -1, DSS_API_1v1_KEY);
+	api = (pDSS_api_1v1_t)lua_touserdata(L, -1);
+	lua_pop(L, 2);
+	utilid = api->reg(L, libid, cancel, &err);
+	if (utilid == NULL)
+	{
+		fprintf(stderr, "registering failed; %d\n", err);
+		return 1;
+	}
+	lua_getglobal(L, "darksidesync");
+	if (udpport != 0)
+	{
+		lua_getfield(L, -1, "setport");
+		lua_pushinteger(L, udpport);
+		lua_call(L, 1, 0);
+	}
+	if (usefd)
+	{
+		lua_getfield(L, -1, "setfd");
+		lua_pushboolean(L, 1);
+		lua_call(L, 1, 0);
+		lua_getfield(L, -1, "getfd");
+		lua_call(L, 0, 1);
+		notifyfd = (int)lua_tointeger(L, -1);
+		lua_pop(L, 1);
+		if (notifyfd == -1)
+		{
+			fprintf(stderr, "could not create the notification file descriptor\n");
+			return 1;
+		}
+	}
+	if (coalesce)
+	{
+		lua_getfield(L, -1, "setnotifymode");
+		lua_pushstring(L, "coalesced");
+		lua_call(L, 1, 0);
+	}
+	lua_pop(L, 1);
+	lua_newtable(L);
+	lua_pushcfunction(L, L_wait);
+	lua_setfield(L, -2, "wait");
+	lua_pushcfunction(L, L_ready);
+	lua_setfield(L, -2, "ready");
+	lua_setglobal(L, "bench");
+
+	// run the Lua loop
+	if (luaL_loadstring(L, benchloop) != 0)
+	{
+		fprintf(stderr, "%s\n", lua_tostring(L, -1));
+		return 1;
+	}
+	lua_getglobal(L, "darksidesync");
+	lua_pushinteger(L, total);
+	lua_pushboolean(L, wantreturn);
+	if (lua_pcall(L, 3, 2, 0) != 0)
+	{
+		fprintf(stderr, "%s\n", lua_tostring(L, -1));
+		// closing cancels the utility, releasing any producers waiting for Lua
+		lua_close(L);
+		for (i = 0; i < started; i++) pthread_join(threads[i], NULL);
+		free(threads);
+		return 1;
+	}
+	for (i = 0; i < started; i++) pthread_join(threads[i], NULL);
+	elapsed = now() - start;
+	cpu = cputime() - startcpu;
+
+	printf("producers %d, events %ld, return %s, inline %s, notification %s%s\n", producers, total,
+		(wantreturn ? "yes" : "no"), (inlined ? "yes" : "no"),
+		(udpport != 0 ? (usefd ? "udp+fd" : "udp") : (usefd ? "fd" : "off")),
+		((udpport != 0 || usefd) && coalesce ? " coalesced" : ""));
+	printf("  %.0f events/s, %.3f s, cpu %.0f ns/event, errors %ld\n", total / elapsed, elapsed,
+		cpu * 1e9 / total, errors);
+	lua_getfield(L, -1, "peakqueued");
+	printf("  peak queue size %ld\n", (long)lua_tointeger(L, -1));
+	lua_pop(L, 2);
+	printstage(L, "queued");
+	if (wantreturn)
+	{
+		printstage(L, "handled");
+		printstage(L, "blocked");
+	}
+	lua_close(L);
+	free(threads);
+	return (errors == 0 ? 0 : 1);
+}
@@ -71,22 +71,34 @@ This section covers the darksidesync API from the Lua-side
 @section Lua-API
 */
 
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
 #include <lauxlib.h>
 #include "udpsocket.h"
 #include "locking.h"
 #include "delivery.h"
+#include "utiltable.h"
+#include "pool.h"
+#include "event.h"
+#include "ticket.h"
 #include "darksidesync.h"
 
 static putilRecord volatile UtilStart = NULL;		// Holds first utility in the list
 static void* volatile DSS_initialized = NULL;		// while its NULL, the first mutex is uninitialized
-static DSS_mutex_t dsslock;							// lock for all shared DSS access
+static DSS_mutex_t dsslock;							// lock for the DSS statics (state counter)
+static DSS_rwlock_t utillock;						// lock for the utility list, take before a global record lock
 static int statecount = 0;							// counter for number of lua states using this lib
+static pglobalRecord GroupStart = NULL;				// list of shared consumer groups (see 'join'), protected by dsslock
 //static DSS_mutex_t statelock;						// lock to protect the state counter
 static DSS_api_1v0_t DSS_api_1v0;					// API struct for version 1.0
+static DSS_api_1v1_t DSS_api_1v1;					// API struct for version 1.1
+static DSS_api_1v2_t DSS_api_1v2;					// API struct for version 1.2
 
 // forward definitions
 static void setUDPPort (pglobalRecord g, int newPort);
+static int setFDSignal (pglobalRecord g, int enable);
 
 #ifdef _DEBUG
 //can be found here  http://www.lua.org/pil/24.2.3.html
@@ -142,6 +154,53 @@ static int DSS_hasstateglobals(lua_State *L)
 	return 1;
 }
 
+// Initializes a new global record
+// Returns: DSS_SUCCESS, DSS_ERR_OUT_OF_MEMORY
+static int DSS_initglobals(pglobalRecord g)
+{
+	int i;
+
+	// now setup UDP port and status
+	g->udpport = 0;
+	g->socket = udpsocket_new(g->udpport);
+	g->fdsignal.readfd = -1;
+	g->fdsignal.writefd = -1;
+	g->notifymode = DSS_NOTIFY_EACH;
+	g->NotifyArmed = 1;
+	g->DSS_status = DSS_STATUS_STOPPED;
+
+	// setup the lock for this LuaState
+	if (DSS_mutex_init(&(g->lock)) != 0) return DSS_ERR_OUT_OF_MEMORY;
+
+	g->QueueCount = 0;
+	g->MaxQueue = 0;
+	g->Policy = DSS_POLICY_REJECT;
+	g->HighWater = 0;
+	g->LowWater = 0;
+	g->Congested = 0;
+	g->BlockedStart = NULL;
+	memset(&(g->Stats), 0, sizeof(dssStats));
+	for (i = 0; i < DSS_PRIORITY_LEVELS; i++)
+	{
+		g->Active[i] = NULL;
+		g->Credits[i] = 0;
+	}
+	for (i = 0; i < DSS_KEY_BUCKETS; i++) g->KeyIndex[i] = NULL;
+	g->DecodingStart = NULL;
+	g->UserdataStart = NULL;
+	g->pGroup = NULL;
+	g->pMemberNext = NULL;
+	g->GroupName = NULL;
+	g->pGroupNext = NULL;
+	g->Members = NULL;
+	g->pNotifyNext = NULL;
+	delivery_initinbox(g);
+
+	// setup the pool of queue items
+	if (pool_init(g, DSS_POOL_DEFAULTSIZE) != 0) return DSS_ERR_OUT_OF_MEMORY;
+	return DSS_SUCCESS;
+}
+
 // Creates a new global record and stores it in the registry
 // will overwrite existing if present!!
 // Returns: created globalrecord or NULL on failure
@@ -157,26 +216,10 @@ static pglobalRecord DSS_newstateglobals(lua_State *L, int* errcode)
 
 	// create a new one
 	g = (pglobalRecord)lua_newuserdata(L, sizeof(globalRecord));
-	if (g == NULL) *errcode = DSS_ERR_OUT_OF_MEMORY;	// alloc failed
-
-	if (*errcode == DSS_SUCCESS) 
-	{
-		// now setup UDP port and status
-		g->udpport = 0;
-		g->socket = udpsocket_new(g->udpport);
-		g->DSS_status = DSS_STATUS_STOPPED;
-
-		// setup data queue
-		//if (DSS_mutexInitx(&(g->lock)) != 0) *errcode = DSS_ERR_INIT_MUTEX_FAILED;
-	}
-
-	if (*errcode == DSS_SUCCESS)
-	{
-		g->QueueCount = 0;
-		g->QueueEnd = NULL;
-		g->QueueStart = NULL;
-		g->UserdataStart = NULL;
-	}
+	if (g == NULL) 
+		*errcode = DSS_ERR_OUT_OF_MEMORY;	// alloc failed
+	else
+		*errcode = DSS_initglobals(g);
 
 	if (*errcode != DSS_SUCCESS)	// we had an error
 	{
@@ -249,33 +292,146 @@ static pglobalRecord DSS_getvalidglobals(lua_State *L)
 	return g;
 }
 
+// Looks up a utility of a LuaState by its libid, including the utilities
+// it registered with the group it joined (see 'join')
+// NOTE: caller must hold the utillock
+static putilRecord DSS_findutil(pglobalRecord g, void* libid)
+{
+	putilRecord util = utiltable_find(g, g, libid);
+	if (util == NULL && g->pGroup != NULL) util = utiltable_find(g->pGroup, g, libid);
+	return util;
+}
+
+// Returns the number of items queued for a LuaState, including the items
+// of the group it joined (see 'join')
+static long DSS_queuecount(pglobalRecord g)
+{
+	long count = DSS_atomic_get(&(g->QueueCount));
+	if (g->pGroup != NULL) count += DSS_atomic_get(&(g->pGroup->QueueCount));
+	return count;
+}
+
+// Cancels all utilities registered by a LuaState, in reverse order, including
+// the ones registered with the group it joined (see 'join')
+static void DSS_cancelutilities(pglobalRecord g)
+{
+	putilRecord listend;
+	putilRecord util;
+
+	while (1)
+	{
+		DSS_rwlock_readlock(&utillock);
+		listend = NULL;
+		util = UtilStart;
+		while (util != NULL)
+		{
+			if (util->pOwner == g) listend = util;
+			util = util->pNext;
+		}
+		DSS_rwlock_readunlock(&utillock);	// must unlock to let the cancel function succeed
+
+		if (listend == NULL) break;		// we're done
+		listend->pCancel(listend->utilid);		// call this utility's cancel method
+	}
+}
+
+// Leaves the group joined by a LuaState (see 'join'), items of the group 
+// still waiting for a 'return' callback in this LuaState are cancelled. 
+// The last member to leave destroys the group.
+// NOTE: the utilities the LuaState registered with the group must have been
+//       cancelled already (see DSS_cancelutilities), as their cancel functions
+//       belong to it.
+static void DSS_leavegroup(pglobalRecord g)
+{
+	pglobalRecord group = g->pGroup;
+	pglobalRecord* link;
+	pQueueItem pqi;
+	pQueueItem next;
+	pQueueItem cancel = NULL;
+	BOOL last;
+
+	// take the items handed to this LuaState, nobody polls for it anymore
+	DSS_mutex_lock(&(group->lock));
+	pqi = group->UserdataStart;
+	while (pqi != NULL)
+	{
+		next = pqi->pNext;
+		if (pqi->udata->pOwner == g)
+		{
+			DSS_STATS_INC(pqi->pUtil, Cancelled);
+			delivery_takereturn(pqi);
+			pqi->pNext = cancel;
+			cancel = pqi;
+		}
+		pqi = next;
+	}
+	DSS_mutex_unlock(&(group->lock));
+
+	// cancel them unlocked, still a member so the group is still around
+	while (cancel != NULL)
+	{
+		pqi = cancel;
+		cancel = pqi->pNext;
+		pqi->pNext = NULL;
+		delivery_return(pqi, NULL, FALSE);
+	}
+
+	DSS_mutex_lock(&dsslock);
+	DSS_mutex_lock(&(group->lock));
+	// remove it from the members
+	link = &(group->Members);
+	while (*link != g) link = &((*link)->pMemberNext);
+	*link = g->pMemberNext;
+	if (group->pNotifyNext == g) group->pNotifyNext = g->pMemberNext;
+	g->pMemberNext = NULL;
+	g->pGroup = NULL;
+	last = (group->Members == NULL);
+	if (last)
+	{
+		// stopping, registering and delivering will fail from here on
+		group->DSS_status = DSS_STATUS_STOPPING;
+		delivery_wakeblocked(group);
+		// remove it from the list, so it cannot be joined anymore
+		link = &GroupStart;
+		while (*link != group) link = &((*link)->pGroupNext);
+		*link = group->pGroupNext;
+	}
+	DSS_mutex_unlock(&(group->lock));
+	DSS_mutex_unlock(&dsslock);
+	if (!last) return;
+
+	// nobody can poll it anymore, and its utilities were cancelled by their
+	// owners (the members), so destroy it
+	group->DSS_status = DSS_STATUS_STOPPED;
+	DSS_mutex_destroy(&(group->lock));
+	pool_destroy(group);	// all items have been cancelled and returned by now
+	free(group->GroupName);
+	free(group);
+}
+
 // Garbage collect function for the global userdata
 // DSS is exiting from this LuaState, so clean it all up
 static int DSS_clearstateglobals(lua_State *L)
 {
 	pglobalRecord g;
-	putilRecord listend;
 
-	DSS_mutex_lock(&dsslock);
 	g = (pglobalRecord)lua_touserdata(L, 1);		// first param is userdata to destroy
+	DSS_mutex_lock(&(g->lock));
 
 #ifdef _DEBUG
 	OutputDebugStringA("DSS: Unloading DSS ...\n");
 #endif
 	// Set status to stopping, registering and delivering will fail from here on
 	g->DSS_status = DSS_STATUS_STOPPING;
+	delivery_wakeblocked(g);	// blocked producers will fail now
+	DSS_mutex_unlock(&(g->lock));
 	
-	// cancel all utilities, in reverse order
-	while (UtilStart != NULL)
-	{
-		listend = UtilStart;
-		while (listend->pNext != NULL) listend = listend->pNext;
-
-		DSS_mutex_unlock(&dsslock);		// must unlock to let the cancel function succeed
-		listend->pCancel(listend);		// call this utility's cancel method
-		DSS_mutex_lock(&dsslock);		// lock again to get the next one
-	}
+	// cancel all utilities of this LuaState (including the ones registered
+	// with its group), and leave the group
+	DSS_cancelutilities(g);
+	if (g->pGroup != NULL) DSS_leavegroup(g);
 	
+	DSS_mutex_lock(&(g->lock));
 	// update status again, we're done stopping
 	g->DSS_status = DSS_STATUS_STOPPED;
 
@@ -283,10 +439,15 @@ static int DSS_clearstateglobals(lua_State *L)
 	lua_pushnil(L);
 	lua_setfield(L, LUA_REGISTRYINDEX, DSS_REGISTRY_NAME);
 
-	// Close socket and destroy mutex
+	// Close socket, file descriptor signal and destroy mutex
 	setUDPPort(g, 0);  // set port to 0, will close socket
+	setFDSignal(g, 0);
+	DSS_mutex_unlock(&(g->lock));
+	DSS_mutex_destroy(&(g->lock));
+	pool_destroy(g);	// all items have been cancelled and returned by now
 
 	// Reduce state count and close network if none left
+	DSS_mutex_lock(&dsslock);
 	statecount = statecount - 1;
 	if (statecount == 0)
 	{
@@ -299,63 +460,13 @@ static int DSS_clearstateglobals(lua_State *L)
 	return 0;
 }
 
-/*
-** ===============================================================
-** Queue management functions
-** ===============================================================
-*/
-
-// Pop item from the queue
-// Returns queueItem, or NULL if none available
-// utilid is id of utility for which to return, or NULL to
-// just return the oldest item, independent of a utilid
-static pQueueItem queuePopUnlocked(pglobalRecord g, putilRecord utilid)
-{
-	pQueueItem qi = NULL;
-
-	if (g->QueueStart != NULL)
-	{
-
-		if (utilid == NULL)
-		{
-			// just grab the oldest from the queue
-			qi = g->QueueStart;
-		}
-		else
-		{
-			// traverse backwards to find the last one with a corresponding utilid
-			qi = g->QueueStart;
-			while (qi != NULL && qi->utilid != utilid)
-			{
-				qi = qi->pPrevious;
-			}
-		}
-
-		if (qi != NULL) 
-		{
-			// dismiss item from linked list
-			if (qi == g->QueueStart) g->QueueStart = qi->pNext;
-			if (qi == g->QueueEnd) g->QueueEnd = qi->pPrevious;
-			if (qi->pPrevious != NULL) qi->pPrevious->pNext = qi->pNext;
-			if (qi->pNext != NULL) qi->pNext->pPrevious = qi->pPrevious;
-			// cleanup results
-			qi->pNext = NULL;
-			qi->pPrevious = NULL;
-			g->QueueCount -= 1;
-		}
-	}
-
-	return qi; //result;
-}
-
-
 /*
 ** ===============================================================
 ** UDP socket management functions
 ** ===============================================================
 */
 // Changes the UDP port number in use
-// uses the lock on the globals, will only be called from Lua
+// caller must hold the lock on the globals, will only be called from Lua
 static void setUDPPort (pglobalRecord g, int newPort)
 {
 	if (g->udpport != 0)
@@ -369,174 +480,717 @@ static void setUDPPort (pglobalRecord g, int newPort)
 	}
 }
 
+// Enables or disables the file descriptor signal
+// returns 1 on success, 0 if the signal could not be created
+// caller must hold the lock on the globals, will only be called from Lua
+static int setFDSignal (pglobalRecord g, int enable)
+{
+	if (enable)
+	{
+		if (g->fdsignal.readfd != -1) return 1;		// already enabled
+		g->fdsignal = fdsignal_new();
+		if (g->fdsignal.readfd == -1) return 0;
+		// signal right away if there is anything pending already
+		if (DSS_atomic_get(&(g->QueueCount)) > 0) fdsignal_send(g->fdsignal);
+	}
+	else if (g->fdsignal.readfd != -1)
+	{
+		fdsignal_close(g->fdsignal);
+		g->fdsignal.readfd = -1;
+		g->fdsignal.writefd = -1;
+	}
+	return 1;
+}
+
 /*
 ** ===============================================================
 ** C API
 ** ===============================================================
 */
-// check utildid against list, 1 if it exists, 0 if not
-static int DSS_validutil(putilRecord utilid)
+// Blocks a producer until the consumer makes room in the queue
+// @util; the utility record, MUST be valid, utillock must be held (shared)
+// @utilid; the ID of the utility
+// @count; the number of spots the producer needs
+// returns; the utility record revalidated after blocking (the utillock is
+// released while blocking), or NULL if the utility unregistered meanwhile
+// @err; DSS_SUCCESS, DSS_ERR_OUT_OF_MEMORY, DSS_ERR_INVALID_UTILID
+static putilRecord DSS_blockproducer(putilRecord util, void* utilid, int count, int* err)
 {
-	putilRecord id = UtilStart;	// start at top
-	if (utilid != id)
+	pglobalRecord g = util->pGlobals;
+	blockedProducer bp;
+	DSS_time_t start;
+
+	*err = DSS_SUCCESS;
+	bp.pWaitHandle = DSS_waithandle_acquire();
+	if (bp.pWaitHandle == NULL)
+	{
+		*err = DSS_ERR_OUT_OF_MEMORY;
+		return util;
+	}
+
+	DSS_mutex_lock(&(g->lock));
+	if (g->DSS_status != DSS_STATUS_STARTED || delivery_reserve(util, count) == DSS_LIMIT_NONE)
 	{
-		while ((id != NULL) && (id->pNext != utilid)) id = id->pNext;
-		if (id == NULL) return 0;	// not found
+		// stopping, or got the spots while locking (drop them again), the caller retries
+		if (g->DSS_status == DSS_STATUS_STARTED)
+		{
+			DSS_atomic_add(&(util->QueueCount), -count);
+			DSS_atomic_add(&(g->QueueCount), -count);
+		}
+		DSS_mutex_unlock(&(g->lock));
+		DSS_waithandle_release(bp.pWaitHandle);
+		return util;
 	}
-	return 1; // found it
+	// register as blocked, the consumer will signal us once it takes items from the queue
+	bp.pNext = g->BlockedStart;
+	g->BlockedStart = &bp;
+	DSS_mutex_unlock(&(g->lock));
+
+	// let go of the utillock while blocked, so unregistering is possible
+	DSS_rwlock_readunlock(&utillock);
+	start = histogram_now();
+	DSS_waithandle_wait(bp.pWaitHandle);
+	DSS_waithandle_release(bp.pWaitHandle);
+	DSS_rwlock_readlock(&utillock);
+
+	util = utiltable_get(utilid);
+	if (util == NULL) 
+		*err = DSS_ERR_INVALID_UTILID;
+	else
+		histogram_record(&(util->Latency[DSS_LATENCY_BLOCKED]), histogram_now() - start);
+	return util;
 }
 
-// Call this to deliver data to the queue
-// @returns; DSS_SUCCESS, DSS_ERR_UDP_SEND_FAILED, 
-// DSS_ERR_OUT_OF_MEMORY, DSS_ERR_NOT_STARTED, DSS_ERR_INVALID_UTILID
-static int DSS_deliver_1v0 (putilRecord utilid, DSS_decoder_1v0_t pDecode, DSS_return_1v0_t pReturn, void* pData)
+// Looks up the utility and reserves spots in the queue, applying the 
+// overflow policy if full
+// @priority; priority level, or DSS_PRIORITY_DEFAULT for the default of the
+// utility (will be replaced by the actual level)
+// @count; number of spots to reserve, all or nothing. Set to 0 if none were
+// reserved, because of the key.
+// @key; coalescing key of the item, NULL for none. If an item with this key
+// is queued the new item will replace it, so it does not need a spot.
+// @candrop; TRUE if the items can be dropped by the 'dropnewest' policy, the
+// caller must then cancel them (DSS_ERR_ITEM_DROPPED), otherwise the queue
+// is reported as full
+// @err; DSS_SUCCESS, DSS_ERR_OUT_OF_MEMORY, DSS_ERR_NOT_STARTED, DSS_ERR_INVALID_UTILID,
+// DSS_ERR_QUEUE_FULL, DSS_ERR_ITEM_DROPPED, DSS_ERR_INVALID_PRIORITY
+// returns; the utility, or NULL on failure (the spots might still be reserved
+// with DSS_ERR_ITEM_DROPPED, if another item was dropped to make room)
+// NOTE: if the utility is returned, the utillock is still held (shared)
+static putilRecord DSS_reservespots(void* utilid, int* priority, int* count, void* key, BOOL candrop, int* err)
 {
 	pglobalRecord g;
-	int result = DSS_SUCCESS;	// report success by default
-	pQueueItem pqi;
-	pDSS_waithandle wh;
+	putilRecord util;
+	pQueueItem victim;
+	int limit = DSS_LIMIT_NONE;
+	int policy;
+
+	*err = DSS_SUCCESS;
+	// Shared lock only; producers do not block each other, the utility
+	// just cannot be unregistered while we're delivering
+	DSS_rwlock_readlock(&utillock);
+	util = utiltable_get(utilid);
+	if (util == NULL)
+	{
+		// invalid ID
+		DSS_rwlock_readunlock(&utillock);
+		*err = DSS_ERR_INVALID_UTILID;
+		return NULL;
+	}
 
-#ifdef _DEBUG
-	OutputDebugStringA("DSS: Start delivering data ...\n");
-#endif
+	if (*priority == DSS_PRIORITY_DEFAULT) *priority = util->Priority;
+	if (*priority < 0 || *priority >= DSS_PRIORITY_LEVELS)
+	{
+		DSS_rwlock_readunlock(&utillock);
+		*err = DSS_ERR_INVALID_PRIORITY;
+		return NULL;
+	}
 
-	DSS_mutex_lock(&dsslock);
-	if (DSS_validutil(utilid) == 0)
+	// Reserve the spots in the queue, apply the overflow policy if full
+	if (key != NULL && delivery_haskey(util, key)) *count = 0;	// it will replace the queued one
+	while (*count > 0 && (limit = delivery_reserve(util, *count)) != DSS_LIMIT_NONE)
 	{
-		// invalid ID
-		DSS_mutex_unlock(&dsslock);
-		return DSS_ERR_INVALID_UTILID;
+		g = util->pGlobals;
+		if (g->DSS_status != DSS_STATUS_STARTED) break;		// reported below
+		policy = (limit == DSS_LIMIT_UTIL ? util->Policy : g->Policy);
+		if (*count > (limit == DSS_LIMIT_UTIL ? util->MaxQueue : g->MaxQueue)) 
+			policy = DSS_POLICY_REJECT;	// will never fit
+
+		if (policy == DSS_POLICY_REJECT || (policy == DSS_POLICY_DROPNEWEST && !candrop))
+		{
+			DSS_rwlock_readunlock(&utillock);
+			*err = DSS_ERR_QUEUE_FULL;
+			return NULL;
+		}
+		else if (policy == DSS_POLICY_DROPNEWEST)
+		{
+			// the caller cancels the items being delivered
+			DSS_STATS_ADD(util, Cancelled, *count);
+			DSS_rwlock_readunlock(&utillock);
+			*err = DSS_ERR_ITEM_DROPPED;
+			return NULL;
+		}
+		else if (policy == DSS_POLICY_DROPOLDEST)
+		{
+			DSS_mutex_lock(&(g->lock));
+			victim = delivery_dropoldest(g, (limit == DSS_LIMIT_UTIL ? util : NULL));
+			DSS_mutex_unlock(&(g->lock));
+			if (victim != NULL)
+			{
+				// cancel it unlocked, its decoder must not block the queue
+				delivery_decodedetached(victim, NULL);
+				*err = DSS_ERR_ITEM_DROPPED;
+			}
+			else
+				DSS_yield();	// only reserved spots, let those producers finish
+		}
+		else
+		{
+			// DSS_POLICY_BLOCK
+			util = DSS_blockproducer(util, utilid, *count, err);
+			if (*err != DSS_SUCCESS)
+			{
+				if (*err == DSS_ERR_OUT_OF_MEMORY) DSS_STATS_INC(util, AllocFailed);
+				DSS_rwlock_readunlock(&utillock);
+				return NULL;
+			}
+		}
+	}
+
+	g = util->pGlobals;	
+	if (g->DSS_status != DSS_STATUS_STARTED)
+	{
+		// lib not started yet (or stopped already), exit
+		if (limit == DSS_LIMIT_NONE && *count > 0) delivery_unreserve(util, *count);
+		DSS_rwlock_readunlock(&utillock);
+		*err = DSS_ERR_NOT_STARTED;
+		return NULL;
 	}
+	return util;
+}
+
+// Reserves a spot in the queue and creates the item for a delivery
+// @priority; priority level, or DSS_PRIORITY_DEFAULT for the default of the utility
+// @key; coalescing key, NULL for none (see DSS_reservespots)
+// @payloadsize; size of the inline payload buffer, 0 for none (uses 'pData')
+// @ticket; ticket for an asynchronous delivery, or NULL to have the producer wait
+// @err; DSS_SUCCESS, DSS_ERR_OUT_OF_MEMORY, DSS_ERR_NOT_STARTED, DSS_ERR_INVALID_UTILID,
+// DSS_ERR_QUEUE_FULL, DSS_ERR_ITEM_DROPPED, DSS_ERR_INVALID_PRIORITY, DSS_ERR_NO_DECODE_PROVIDED
+// returns; the item, or NULL on failure (an item might still be returned with
+// DSS_ERR_ITEM_DROPPED, if another item was dropped to make room)
+// NOTE: if an item is returned, the utillock is still held (shared), the item
+//       MUST be passed to DSS_commit_internal or DSS_abort_internal
+static pQueueItem DSS_reserve_internal (void* utilid, int priority, void* key, DSS_decoder_1v0_t pDecode, DSS_return_1v0_t pReturn, void* pData, size_t payloadsize, pDSS_ticket ticket, int* err)
+{
+	putilRecord util;
+	int result;
+	int spots = 1;
+	pQueueItem pqi;
 
 	if (pDecode == NULL)
 	{
 		// No decode callback provided
-		DSS_mutex_unlock(&dsslock);
-		return DSS_ERR_NO_DECODE_PROVIDED;
+		*err = DSS_ERR_NO_DECODE_PROVIDED;
+		return NULL;
 	}
 
-	g = utilid->pGlobals;	
-	if (g->DSS_status != DSS_STATUS_STARTED)
+	// an inline payload has not been filled yet, so there is nothing to drop
+	util = DSS_reservespots(utilid, &priority, &spots, key, (payloadsize == 0), err);
+	if (util == NULL)
 	{
-		// lib not started yet (or stopped already), exit
-		DSS_mutex_unlock(&dsslock);
-		return DSS_ERR_NOT_STARTED;
+		// cancel the item being delivered, through its decoder
+		if (*err == DSS_ERR_ITEM_DROPPED) pDecode(NULL, pData, utilid);
+		return NULL;
+	}
+
+	// Go and create it
+	pqi = delivery_new(util, priority, pDecode, pReturn, pData, payloadsize, ticket, &result);
+	if (pqi == NULL)
+	{
+		if (result == DSS_ERR_OUT_OF_MEMORY) DSS_STATS_INC(util, AllocFailed);
+		if (spots > 0) delivery_unreserve(util, spots);
+		DSS_rwlock_readunlock(&utillock);
+		*err = result;
+		return NULL;
 	}
+	pqi->Key = key;
+	pqi->Reserved = (spots > 0);
+	return pqi;
+}
 
-	// Go and deliver it
-	pqi = delivery_new(utilid, pDecode, pReturn, pData, &result);
+// Releases an item created by DSS_reserve_internal, without delivering it
+// NOTE: releases the utillock
+static void DSS_abort_internal (pQueueItem pqi)
+{
+	putilRecord util = pqi->pUtil;
 
-	// get waithandle and unlock to let the delivery be processed
-	wh = pqi->pWaitHandle;
-	pqi = NULL;  // let go here, after the lock is released, we can no longer assume it valid
-	DSS_mutex_unlock(&dsslock);
+	if (pqi->pWaitHandle != NULL) DSS_waithandle_release(pqi->pWaitHandle);
+	pool_putitem(pqi->pGlobals, pqi);
+	delivery_unreserve(util, 1);
+	DSS_rwlock_readunlock(&utillock);
+}
+
+// Finishes a delivery of items enqueued; updates the statistics, sends the
+// notification (if required) and releases the utillock
+// @count; number of items delivered
+// @notify; FALSE if the items do not need a notification
+// @result; the result of the reservation, reported unless a notification fails
+// @returns; @result, DSS_ERR_UDP_SEND_FAILED, DSS_ERR_CONGESTED
+static int DSS_delivered_internal (putilRecord util, int count, BOOL notify, int result)
+{
+	pglobalRecord g = util->pGlobals;
+	int nresult;
+
+	DSS_STATS_ADD(util, Delivered, count);
+	if (notify && delivery_mustnotify(g))
+	{
+		// the socket may be replaced by 'setport', so lock while notifying
+		DSS_mutex_lock(&(g->lock));
+		delivery_notify(g, &nresult);
+		DSS_mutex_unlock(&(g->lock));
+		if (nresult == DSS_ERR_UDP_SEND_FAILED) DSS_STATS_INC(util, SendFailed);
+		if (result == DSS_SUCCESS) result = nresult;
+	}
+	if (result == DSS_SUCCESS && DSS_atomic_get(&(g->Congested)) != 0) result = DSS_ERR_CONGESTED;
+	DSS_rwlock_readunlock(&utillock);
+	return result;
+}
+
+// Delivers an item created by DSS_reserve_internal to the queue, and waits for
+// the item to be completed if it has a 'return' callback
+// @result; the result of the reservation, reported unless a notification fails
+// @returns; @result, DSS_ERR_UDP_SEND_FAILED, DSS_ERR_CONGESTED
+// NOTE: releases the utillock
+static int DSS_commit_internal (pQueueItem pqi, int result)
+{
+	putilRecord util = pqi->pUtil;
+	void* utilid = pqi->utilid;
+	pDSS_waithandle wh = pqi->pWaitHandle;
+	BOOL coalesced = FALSE;
+	DSS_time_t start;
+
+	// deliver it (lock-free, unless it has a coalescing key)
+	if (pqi->Key == NULL)
+		delivery_enqueue(pqi);
+	else if (delivery_enqueuekeyed(pqi))
+		coalesced = TRUE;	// replaced a queued item, that one was notified already
+	pqi = NULL;  // let go here, after enqueuing, we can no longer assume it valid
+	result = DSS_delivered_internal(util, 1, !coalesced, result);
 
 	if (wh != NULL)
 	{
 		// A waithandle was created, so we must go and wait for the queued item to be completed
+		start = histogram_now();
 		DSS_waithandle_wait(wh);	// blocks until released
-		DSS_waithandle_delete(wh);	// destroy waithandle
+		DSS_waithandle_release(wh);	// hand it back to the cache of this thread
+
+		// record the time blocked, if the utility is still around
+		start = histogram_now() - start;
+		DSS_rwlock_readlock(&utillock);
+		util = utiltable_get(utilid);
+		if (util != NULL) histogram_record(&(util->Latency[DSS_LATENCY_BLOCKED]), start);
+		DSS_rwlock_readunlock(&utillock);
 	}
+	return result;
+}
 
+// Call this to deliver data to the queue
+// @priority; priority level, or DSS_PRIORITY_DEFAULT for the default of the utility
+// @returns; DSS_SUCCESS, DSS_ERR_UDP_SEND_FAILED, 
+// DSS_ERR_OUT_OF_MEMORY, DSS_ERR_NOT_STARTED, DSS_ERR_INVALID_UTILID,
+// DSS_ERR_QUEUE_FULL, DSS_ERR_ITEM_DROPPED, DSS_ERR_CONGESTED, DSS_ERR_INVALID_PRIORITY
+static int DSS_deliver_internal (void* utilid, int priority, DSS_decoder_1v0_t pDecode, DSS_return_1v0_t pReturn, void* pData)
+{
+	int result;
+	pQueueItem pqi;
+
+#ifdef _DEBUG
+	OutputDebugStringA("DSS: Start delivering data ...\n");
+#endif
+	pqi = DSS_reserve_internal(utilid, priority, NULL, pDecode, pReturn, pData, 0, NULL, &result);
+	if (pqi != NULL) result = DSS_commit_internal(pqi, result);
 #ifdef _DEBUG
 	OutputDebugStringA("DSS: End delivering data ...\n");
 #endif
 	return result;	
 };
 
-// Gets the utilid based on a LuaState and libid
-// return NULL upon failure, see Errcode for details; DSS_SUCCESS,
-// DSS_ERR_NOT_STARTED or DSS_ERR_UNKNOWN_LIB
-static void* DSS_getutilid_1v0(lua_State *L, void* libid, int* errcode)
+// Call this to deliver data to the queue, with the default priority of the utility
+// @returns; see DSS_deliver_internal
+static int DSS_deliver_1v0 (void* utilid, DSS_decoder_1v0_t pDecode, DSS_return_1v0_t pReturn, void* pData)
 {
-	pglobalRecord g = DSS_getstateglobals(L, NULL);
-	putilRecord utilid = NULL;
+	return DSS_deliver_internal(utilid, DSS_PRIORITY_DEFAULT, pDecode, pReturn, pData);
+}
+
+// Call this to deliver data to the queue, with a priority
+// @returns; see DSS_deliver_internal
+static int DSS_deliverprio_1v1 (void* utilid, int priority, DSS_decoder_1v0_t pDecode, DSS_return_1v0_t pReturn, void* pData)
+{
+	return DSS_deliver_internal(utilid, priority, pDecode, pReturn, pData);
+}
+
+// Call this to deliver data to the queue, with a coalescing key. A queued item
+// of the utility with the same key is replaced (and cancelled)
+// @key; coalescing key, NULL for none
+// @returns; see DSS_deliver_internal
+static int DSS_deliverkeyed_1v1 (void* utilid, int priority, void* key, DSS_decoder_1v0_t pDecode, DSS_return_1v0_t pReturn, void* pData)
+{
+	int result;
+	pQueueItem pqi;
 
+	pqi = DSS_reserve_internal(utilid, priority, key, pDecode, pReturn, pData, 0, NULL, &result);
+	if (pqi == NULL) return result;
+	return DSS_commit_internal(pqi, result);
+}
+
+// Reserves an item with an inline payload buffer, to be filled and committed
+// returns; the payload buffer, or NULL on failure
+// @errcode; see DSS_reserve_internal
+// NOTE: the utillock is not held until the commit/abort, as the producer runs
+//       its own code in between. The item pins the utility instead, see 
+//       DSS_unpin and DSS_unregister_1v0.
+static void* DSS_reserve_1v1 (void* utilid, int priority, size_t size, DSS_decoder_1v0_t pDecode, DSS_return_1v0_t pReturn, int* errcode)
+{
+	pQueueItem pqi;
 	int le;	// local errorcode
 	if (errcode == NULL) errcode = &le;
-	*errcode = DSS_SUCCESS;
 
-	if (g != NULL)
-	{
-		DSS_mutex_lock(&dsslock);
-		if (g->DSS_status != DSS_STATUS_STARTED)
-		{
-			DSS_mutex_unlock(&dsslock);
-			*errcode = DSS_ERR_NOT_STARTED;
-			return NULL;
-		}
+	if (size == 0) size = 1;	// 0 means no inline payload
+	pqi = DSS_reserve_internal(utilid, priority, NULL, pDecode, pReturn, NULL, size, NULL, errcode);
+	if (pqi == NULL) return NULL;
+	DSS_atomic_add(&(pqi->pUtil->Pinned), 1);
+	DSS_rwlock_readunlock(&utillock);
+	return pqi->pData;
+}
 
-		// we've got a set of globals, now compare this to the utillist
-		utilid = UtilStart;
-		while (utilid != NULL)
-		{
-			if ((utilid->pGlobals == g) && (utilid->libid == libid))
-			{
-				//This utilid matches both the LuaState (globals) and the libid.
-				DSS_mutex_unlock(&dsslock);
-				return utilid;	// found it, return and exit.
-			}
+// Revalidates the utility of an item reserved by DSS_reserve_1v1, and takes
+// the utillock (shared) again
+// @cancel; TRUE to cancel the item through its decoder, if it cannot be delivered
+// returns; TRUE if the utility is still registered. If not, the item has been
+// released and the utillock is not held.
+static BOOL DSS_unpin(pQueueItem pqi, BOOL cancel)
+{
+	putilRecord util = pqi->pUtil;	// not released while pinned
 
-			// No match, try next one in the list
-			utilid = utilid->pNext;
-		}
-		DSS_mutex_unlock(&dsslock);
+	DSS_rwlock_readlock(&utillock);
+	if (utiltable_get(pqi->utilid) == util)
+	{
+		DSS_atomic_add(&(util->Pinned), -1);
+		return TRUE;
 	}
-	else
+
+	// unregistered meanwhile, DSS_unregister_1v0 waits for it to be unpinned
+	DSS_rwlock_readunlock(&utillock);
+	if (cancel)
 	{
-		// No Globals found
-		*errcode = DSS_ERR_NOT_STARTED;
-		return NULL;
+		DSS_STATS_INC(util, Cancelled);
+		pqi->pDecode(NULL, pqi->pData, pqi->utilid);
 	}
-	// we had globals, failed anyway, so no valid utilid
-	*errcode = DSS_ERR_UNKNOWN_LIB;
-	return NULL;	// failed
+	if (pqi->pWaitHandle != NULL) DSS_waithandle_release(pqi->pWaitHandle);
+	pool_putitem(pqi->pGlobals, pqi);
+	delivery_unreserve(util, 1);
+	DSS_atomic_add(&(util->Pinned), -1);	// do not touch 'util' anymore from here
+	return FALSE;
 }
 
-// register a library to use DSS 
-// @arg1; the globals record the utility is added to
-// @arg2; pointer to the cancel method of the utility, will be called
-// @arg3; integer to take the errorcode to return
-// when DSS decides to terminate the collaboration with the utility
-// Returns: unique ID for the utility that must be used for all subsequent
-// calls to DSS, or NULL if it failed.
-// Failure reasons; DSS_ERR_NOT_STARTED, DSS_ERR_NO_CANCEL_PROVIDED, 
-//                  DSS_ERR_ALREADY_REGISTERED, DSS_ERR_OUT_OF_MEMORY
-// NOTE: if the lib was already registered, it will return the existing ID, 
-//       but it will ignore all provided parameters (nothing will be changed)
-static putilRecord DSS_register_1v0(lua_State *L, void* libid, DSS_cancel_1v0_t pCancel, int* errcode)
+// Delivers a reserved item with an inline payload buffer to the queue
+// @returns; see DSS_commit_internal, and DSS_ERR_INVALID_UTILID if the utility 
+// unregistered after the reservation
+static int DSS_commit_1v1 (void* payload)
 {
-	putilRecord util;
-	putilRecord last;
-	pglobalRecord g; 
+	pQueueItem pqi = DSS_PAYLOAD_ITEM(payload);
+	if (!DSS_unpin(pqi, TRUE)) return DSS_ERR_INVALID_UTILID;
+	pqi->tDelivered = histogram_now();	// queued from now
+	return DSS_commit_internal(pqi, DSS_SUCCESS);
+}
+
+// Releases a reserved item with an inline payload buffer, without delivering it
+static void DSS_abort_1v1 (void* payload)
+{
+	pQueueItem pqi = DSS_PAYLOAD_ITEM(payload);
+	if (DSS_unpin(pqi, FALSE)) DSS_abort_internal(pqi);
+}
+
+// Delivers a typed event, the values are encoded in an inline payload, and
+// decoded by DSS itself, calling the Lua handler set for the utility
+// @returns; see DSS_deliver_internal, and DSS_ERR_INVALID_EVENT, or 
+// DSS_ERR_NO_DECODE_PROVIDED if no handler was set
+static int DSS_deliverevent_1v1 (void* utilid, int priority, const char* format, ...)
+{
+	int result;
+	size_t size;
+	pQueueItem pqi;
+	va_list args;
+
+	if (format == NULL) return DSS_ERR_INVALID_EVENT;
+	va_start(args, format);
+	size = event_size(format, args);
+	va_end(args);
+	if (size == 0) return DSS_ERR_INVALID_EVENT;
+
+	pqi = DSS_reserve_internal(utilid, priority, NULL, event_decode, NULL, NULL, size, NULL, &result);
+	if (pqi == NULL) return result;
+	if (!pqi->pUtil->HasHandler)
+	{
+		// no Lua handler to deliver to
+		DSS_abort_internal(pqi);
+		return DSS_ERR_NO_DECODE_PROVIDED;
+	}
+	va_start(args, format);
+	event_encode(pqi->pData, pqi->pUtil->libid, format, args);
+	va_end(args);
+	return DSS_commit_internal(pqi, result);
+}
 
+// Delivers an item without waiting for it to be completed, the ticket 
+// returned completes when it is done
+// returns; the ticket, or NULL on failure
+// @errcode; see DSS_deliver_internal
+static void* DSS_deliverasync_1v1 (void* utilid, int priority, DSS_decoder_1v0_t pDecode, DSS_return_1v0_t pReturn, DSS_complete_1v1_t pComplete, void* pData, int* errcode)
+{
+	pDSS_ticket ticket;
+	pQueueItem pqi;
 	int le;	// local errorcode
 	if (errcode == NULL) errcode = &le;
-	*errcode = DSS_SUCCESS;
 
-#ifdef _DEBUG
-	OutputDebugStringA("DSS: Start registering lib ...\n");
-#endif
-	if (pCancel == NULL)
+	ticket = ticket_new(pComplete);
+	if (ticket == NULL)
 	{
-		*errcode = DSS_ERR_NO_CANCEL_PROVIDED;
-		return NULL; 
+		*errcode = DSS_ERR_OUT_OF_MEMORY;
+		return NULL;
 	}
-
-	util = (putilRecord)DSS_getutilid_1v0(L, libid, NULL);
-	if (util != NULL)
+	pqi = DSS_reserve_internal(utilid, priority, NULL, pDecode, pReturn, pData, 0, ticket, errcode);
+	if (pqi == NULL)
 	{
-		// We got an ID returned, so this lib is already registered
-		*errcode = DSS_ERR_ALREADY_REGISTERED;
-		return util;	// don't change anything, but return existing id
+		// not delivered, so the item never referenced the ticket
+		ticket_release(ticket);
+		ticket_release(ticket);
+		return NULL;
 	}
+	*errcode = DSS_commit_internal(pqi, *errcode);	// won't wait, there is no waithandle
+	return ticket;
+}
 
-	DSS_mutex_lock(&dsslock);
+// Waits for the ticket of an asynchronous delivery to complete
+// @timeout; milliseconds, 0 to check only, < 0 to wait until completed
+// returns; the ticket state, DSS_TICKET_xxx
+static int DSS_waitticket_1v1 (void* ticket, int timeout)
+{
+	return ticket_wait((pDSS_ticket)ticket, timeout);
+}
+
+// Releases the ticket of an asynchronous delivery
+static void DSS_releaseticket_1v1 (void* ticket)
+{
+	ticket_release((pDSS_ticket)ticket);
+}
+
+// Delivers an item, and waits a limited time for it to be completed
+// @timeout; milliseconds, < 0 to wait until completed
+// @returns; see DSS_deliver_internal, and DSS_ERR_TIMEOUT
+// NOTE: the wait uses the waithandle of a ticket, not the cached one of the
+//       thread, since the item may still signal it after a timeout.
+static int DSS_delivertimeout_1v1 (void* utilid, int priority, DSS_decoder_1v0_t pDecode, DSS_return_1v0_t pReturn, void* pData, int timeout)
+{
+	int result;
+	pDSS_ticket ticket;
+	pQueueItem pqi;
+	putilRecord util;
+	DSS_time_t start;
+
+	// nothing to wait for, or no limit; a regular delivery
+	if (pReturn == NULL || timeout < 0) return DSS_deliver_internal(utilid, priority, pDecode, pReturn, pData);
+
+	ticket = ticket_new(NULL);
+	if (ticket == NULL) return DSS_ERR_OUT_OF_MEMORY;
+	pqi = DSS_reserve_internal(utilid, priority, NULL, pDecode, pReturn, pData, 0, ticket, &result);
+	if (pqi == NULL)
+	{
+		// not delivered, so the item never referenced the ticket
+		ticket_release(ticket);
+		ticket_release(ticket);
+		return result;
+	}
+	result = DSS_commit_internal(pqi, result);	// won't wait, there is no waithandle
+
+	start = histogram_now();
+	if (ticket_wait(ticket, timeout) == DSS_TICKET_PENDING && ticket_abandon(ticket))
+		result = DSS_ERR_TIMEOUT;	// DSS won't touch 'pData' anymore
+
+	// record the time blocked, if the utility is still around
+	start = histogram_now() - start;
+	DSS_rwlock_readlock(&utillock);
+	util = utiltable_get(utilid);
+	if (util != NULL) 
+	{
+		histogram_record(&(util->Latency[DSS_LATENCY_BLOCKED]), start);
+		// a queued item abandoned, no longer counts against the limits
+		if (result == DSS_ERR_TIMEOUT) delivery_abandon(util, ticket);
+	}
+	DSS_rwlock_readunlock(&utillock);
+	ticket_release(ticket);
+	return result;
+}
+
+// Delivers a batch of items to the queue, all or nothing. The utility is 
+// validated, and the spots reserved, once. The items are added to the queue
+// in a single step, with at most one notification.
+// @priority; priority level, or DSS_PRIORITY_DEFAULT for the default of the utility
+// @returns; see DSS_deliver_internal, and DSS_ERR_NO_DECODE_PROVIDED if any item lacks
+// a decoder. With DSS_ERR_ITEM_DROPPED the items might have been cancelled 
+// (with the 'dropnewest' policy).
+static int DSS_deliverbatch_1v2 (void* utilid, int priority, DSS_batchitem_1v2_t* items, int count)
+{
+	putilRecord util;
+	pQueueItem first = NULL;
+	pQueueItem last = NULL;
+	pQueueItem pqi;
+	int result, err, i;
+
+	if (items == NULL || count <= 0) return DSS_SUCCESS;	// nothing to deliver
+	for (i = 0; i < count; i++) 
+		if (items[i].pDecode == NULL) return DSS_ERR_NO_DECODE_PROVIDED;
+
+	util = DSS_reservespots(utilid, &priority, &count, NULL, TRUE, &result);
+	if (util == NULL)
+	{
+		// cancel the items being delivered, through their decoders
+		if (result == DSS_ERR_ITEM_DROPPED) 
+			for (i = 0; i < count; i++) items[i].pDecode(NULL, items[i].pData, utilid);
+		return result;
+	}
+
+	// create the items, and chain them
+	for (i = 0; i < count; i++)
+	{
+		pqi = delivery_new(util, priority, items[i].pDecode, NULL, items[i].pData, 0, NULL, &err);
+		if (pqi == NULL)
+		{
+			// undo all
+			if (err == DSS_ERR_OUT_OF_MEMORY) DSS_STATS_INC(util, AllocFailed);
+			while (first != NULL)
+			{
+				pqi = first;
+				first = first->pNext;
+				pool_putitem(util->pGlobals, pqi);
+			}
+			delivery_unreserve(util, count);
+			DSS_rwlock_readunlock(&utillock);
+			return err;
+		}
+		if (last == NULL) first = pqi; else last->pNext = pqi;
+		last = pqi;
+	}
+
+	// deliver them (lock-free)
+	delivery_enqueuemany(first, last);
+	return DSS_delivered_internal(util, count, TRUE, result);
+}
+
+// Sets the batch decoder of a utility, items delivered with decoder 'pDecode'
+// will be decoded in batches
+// @pBatchDecode; the batch decoder, or NULL to remove it
+// @returns; DSS_SUCCESS, DSS_ERR_INVALID_UTILID, DSS_ERR_NO_DECODE_PROVIDED
+static int DSS_setbatchdecoder_1v2 (void* utilid, DSS_decoder_1v0_t pDecode, DSS_batchdecoder_1v2_t pBatchDecode)
+{
+	putilRecord util;
+
+	if (pBatchDecode != NULL && pDecode == NULL) return DSS_ERR_NO_DECODE_PROVIDED;
+	DSS_rwlock_readlock(&utillock);
+	util = utiltable_get(utilid);
+	if (util == NULL)
+	{
+		// invalid ID
+		DSS_rwlock_readunlock(&utillock);
+		return DSS_ERR_INVALID_UTILID;
+	}
+	// both are read while detaching items, so set them under the lock
+	DSS_mutex_lock(&(util->pGlobals->lock));
+	util->BatchItemDecode = (pBatchDecode == NULL ? NULL : pDecode);
+	util->BatchDecode = pBatchDecode;
+	DSS_mutex_unlock(&(util->pGlobals->lock));
+	DSS_rwlock_readunlock(&utillock);
+	return DSS_SUCCESS;
+}
+
+// Gets the utilid based on a LuaState and libid
+// return NULL upon failure, see Errcode for details; DSS_SUCCESS,
+// DSS_ERR_NOT_STARTED or DSS_ERR_UNKNOWN_LIB
+static void* DSS_getutilid_1v0(lua_State *L, void* libid, int* errcode)
+{
+	pglobalRecord g = DSS_getstateglobals(L, NULL);
+	putilRecord util = NULL;
+	void* utilid = NULL;
+
+	int le;	// local errorcode
+	if (errcode == NULL) errcode = &le;
+	*errcode = DSS_SUCCESS;
+
+	if (g != NULL)
+	{
+		DSS_rwlock_readlock(&utillock);
+		if (g->DSS_status != DSS_STATUS_STARTED)
+		{
+			DSS_rwlock_readunlock(&utillock);
+			*errcode = DSS_ERR_NOT_STARTED;
+			return NULL;
+		}
+
+		// we've got a set of globals, now look it up in the index
+		util = DSS_findutil(g, libid);
+		if (util != NULL) utilid = util->utilid;
+		DSS_rwlock_readunlock(&utillock);
+		if (utilid != NULL) return utilid;	// found it, return and exit.
+	}
+	else
+	{
+		// No Globals found
+		*errcode = DSS_ERR_NOT_STARTED;
+		return NULL;
+	}
+	// we had globals, failed anyway, so no valid utilid
+	*errcode = DSS_ERR_UNKNOWN_LIB;
+	return NULL;	// failed
+}
+
+// register a library to use DSS 
+// @arg1; the globals record the utility is added to
+// @arg2; pointer to the cancel method of the utility, will be called
+// @arg3; integer to take the errorcode to return
+// when DSS decides to terminate the collaboration with the utility
+// Returns: unique ID for the utility that must be used for all subsequent
+// calls to DSS, or NULL if it failed.
+// Failure reasons; DSS_ERR_NOT_STARTED, DSS_ERR_NO_CANCEL_PROVIDED, 
+//                  DSS_ERR_ALREADY_REGISTERED, DSS_ERR_OUT_OF_MEMORY
+// NOTE: if the lib was already registered, it will return the existing ID, 
+//       but it will ignore all provided parameters (nothing will be changed)
+static void* DSS_register_1v0(lua_State *L, void* libid, DSS_cancel_1v0_t pCancel, int* errcode)
+{
+	putilRecord util;
+	putilRecord last;
+	pglobalRecord g; 
+	pglobalRecord owner;
+	int level;
+
+	int le;	// local errorcode
+	if (errcode == NULL) errcode = &le;
+	*errcode = DSS_SUCCESS;
+
+#ifdef _DEBUG
+	OutputDebugStringA("DSS: Start registering lib ...\n");
+#endif
+	if (pCancel == NULL)
+	{
+		*errcode = DSS_ERR_NO_CANCEL_PROVIDED;
+		return NULL; 
+	}
+
+	DSS_rwlock_writelock(&utillock);
 	g = DSS_getstateglobals(L, NULL); 
 	if (g == NULL)
 	{
 		*errcode = DSS_ERR_NOT_STARTED;
-		DSS_mutex_unlock(&dsslock);
+		DSS_rwlock_writeunlock(&utillock);
 		return NULL;
 	}
 
@@ -544,23 +1198,62 @@ static putilRecord DSS_register_1v0(lua_State *L, void* libid, DSS_cancel_1v0_t
 	{
 		// DSS isn't running
 		*errcode = DSS_ERR_NOT_STARTED;
-		DSS_mutex_unlock(&dsslock);
+		DSS_rwlock_writeunlock(&utillock);
 		return NULL; 
 	}
+	// in a group the items are queued with the group, register it there. Each
+	// member registers its own, as its cancel function belongs to its LuaState
+	owner = g;
+	if (g->pGroup != NULL) g = g->pGroup;
+
+	util = utiltable_find(g, owner, libid);
+	if (util != NULL)
+	{
+		// Found it, so this lib is already registered
+		*errcode = DSS_ERR_ALREADY_REGISTERED;
+		DSS_rwlock_writeunlock(&utillock);
+		return util->utilid;	// don't change anything, but return existing id
+	}
 
 	// create and fill utility record
 	util = (putilRecord)malloc(sizeof(utilRecord));
 	if (util == NULL) 
 	{
-		DSS_mutex_unlock(&dsslock);
+		DSS_rwlock_writeunlock(&utillock);
 		*errcode = DSS_ERR_OUT_OF_MEMORY;
 		return NULL; 
 	}
 	util->pCancel = pCancel;
 	util->pGlobals = g;
+	util->pOwner = owner;
 	util->libid = libid;
 	util->pNext = NULL;
 	util->pPrevious = NULL;
+	util->MaxQueue = 0;
+	util->Policy = DSS_POLICY_REJECT;
+	util->QueueCount = 0;
+	util->Pinned = 0;
+	util->Priority = DSS_PRIORITY_NORMAL;
+	util->HasHandler = FALSE;
+	util->BatchItemDecode = NULL;
+	util->BatchDecode = NULL;
+	memset(&(util->Stats), 0, sizeof(dssStats));
+	for (level = 0; level < DSS_LATENCY_STAGES; level++) histogram_reset(&(util->Latency[level]));
+	for (level = 0; level < DSS_PRIORITY_LEVELS; level++)
+	{
+		util->Queue[level].Start = NULL;
+		util->Queue[level].End = NULL;
+		util->pActiveNext[level] = NULL;
+		util->pActivePrevious[level] = NULL;
+	}
+	if (utiltable_add(util) == NULL)
+	{
+		// could not assign an ID
+		free(util);
+		DSS_rwlock_writeunlock(&utillock);
+		*errcode = DSS_ERR_OUT_OF_MEMORY;
+		return NULL; 
+	}
 
 	// Add record to end of list
 	last = UtilStart;
@@ -577,20 +1270,22 @@ static putilRecord DSS_register_1v0(lua_State *L, void* libid, DSS_cancel_1v0_t
 		util->pPrevious = last;
 	}
 
-	DSS_mutex_unlock(&dsslock);
+	DSS_rwlock_writeunlock(&utillock);
 #ifdef _DEBUG
 	OutputDebugStringA("DSS: Done registering lib ...\n");
 #endif
-	return util;
+	return util->utilid;
 }
 
 
 // unregisters a previously registered utility
 // cancels all items still in queue
 // returns DSS_SUCCESS, DSS_ERR_INVALID_UTILID
-static int DSS_unregister_1v0(putilRecord utilid)
+static int DSS_unregister_1v0(void* utilid)
 {
 	pglobalRecord g;
+	putilRecord util;
+	int level;
 	//pQueueItem nqi = NULL;
 	pQueueItem pqi = NULL;
 
@@ -598,20 +1293,24 @@ static int DSS_unregister_1v0(putilRecord utilid)
 	OutputDebugStringA("DSS: Start unregistering lib ...\n");
 #endif
 
-	DSS_mutex_lock(&dsslock);
+	// exclusive lock, so no deliveries are in progress
+	DSS_rwlock_writelock(&utillock);
 
-	if (DSS_validutil(utilid) == 0)
+	util = utiltable_get(utilid);
+	if (util == NULL)
 	{
 		// invalid ID
-		DSS_mutex_unlock(&dsslock);
+		DSS_rwlock_writeunlock(&utillock);
 		return DSS_ERR_INVALID_UTILID;
 	}
-	g = utilid->pGlobals;
+	g = util->pGlobals;
+	DSS_mutex_lock(&(g->lock));
 
-	// remove it from the list
-	if (UtilStart == utilid) UtilStart = utilid->pNext;
-	if (utilid->pNext != NULL) utilid->pNext->pPrevious = utilid->pPrevious;
-	if (utilid->pPrevious != NULL) utilid->pPrevious->pNext = utilid->pNext;
+	// remove it from the list and the table, the ID is no longer valid
+	if (UtilStart == util) UtilStart = util->pNext;
+	if (util->pNext != NULL) util->pNext->pPrevious = util->pPrevious;
+	if (util->pPrevious != NULL) util->pPrevious->pNext = util->pNext;
+	utiltable_remove(util);
 
 	// Cancel all items stored in userdatas
 	pqi = g->UserdataStart;
@@ -631,29 +1330,32 @@ static int DSS_unregister_1v0(putilRecord utilid)
 		}
 	}
 
-	// cancel all items still in the queue
-	pqi = g->QueueEnd;
+	// Flag items being decoded right now, they will be cancelled once decoded
+	pqi = g->DecodingStart;
 	while (pqi != NULL)
 	{
-		if (pqi->utilid == utilid)
-		{
-			// need to cancel this one, as it has our ID
-			delivery_cancel(pqi);
-			// restart as list has been modified...
-			pqi = g->QueueEnd;
-		}
-		else
-		{
-			// move to next item in list
-			pqi = pqi->pPrevious;
-		}
+		if (pqi->utilid == utilid) pqi->cancelled = TRUE;
+		pqi = pqi->pNext;
+	}
+
+	// cancel all items still in the queue, they're all in our own lists
+	delivery_collect(g);
+	for (level = 0; level < DSS_PRIORITY_LEVELS; level++)
+	{
+		while (util->Queue[level].End != NULL) delivery_cancel(util->Queue[level].End);
 	}
 
-	// free resources
-	free(utilid);
+	// release producers blocked on the queue, they'll find the ID invalid
+	delivery_wakeblocked(g);
 
 	// Unlock, we're done with the util list
-	DSS_mutex_unlock(&dsslock);
+	DSS_mutex_unlock(&(g->lock));
+	DSS_rwlock_writeunlock(&utillock);
+
+	// items reserved (see 'reserve') pin the utility, wait for their producers
+	// to find the ID invalid on commit/abort, before freeing resources
+	while (DSS_atomic_get(&(util->Pinned)) != 0) DSS_yield();
+	free(util);
 #ifdef _DEBUG
 	OutputDebugStringA("DSS: Done unregistering lib ...\n");
 #endif
@@ -667,7 +1369,8 @@ static int DSS_unregister_1v0(putilRecord utilid)
 */
 /***
 Sets the UDP port for notifications. For every item delivered in the 
-darksidesync queue a notification will be sent. The IP address the notification
+darksidesync queue a notification will be sent (see `setnotifymode` for sending less 
+notifications). The IP address the notification
 will be send to will always be `localhost` (loopback adapter).
 @function setport
 @param port UDP port number to use for notification packets. A value from 0 to 65535, where 0 will disable notifications.
@@ -679,9 +1382,9 @@ static int L_setport(lua_State *L)
 	if (lua_gettop(L) >= 1 && luaL_checkint(L,1) >= 0 && luaL_checkint(L,1) <= 65535)
 	{
 		pglobalRecord g = DSS_getvalidglobals(L); // won't return on error
-		DSS_mutex_lock(&dsslock);
+		DSS_mutex_lock(&(g->lock));
 		setUDPPort(g, luaL_checkint(L,1));
-		DSS_mutex_unlock(&dsslock);
+		DSS_mutex_unlock(&(g->lock));
 		// report success
 		lua_pushinteger(L, 1);
 		return 1;
@@ -702,9 +1405,179 @@ Returns the UDP port currently in use for notifications.
 static int L_getport (lua_State *L)
 {
 	pglobalRecord g = DSS_getvalidglobals(L); // won't return on error
-	DSS_mutex_lock(&dsslock);
+	DSS_mutex_lock(&(g->lock));
 	lua_pushinteger(L, g->udpport);
+	DSS_mutex_unlock(&(g->lock));
+	return 1;
+};
+
+
+/***
+Sets the notification mode. By default a notification is sent for every item
+delivered. In `"coalesced"` mode a single notification is sent when the queue
+goes from empty to non-empty. No further notifications will be sent until the queue has
+been drained; a call to `poll` or `pollmany` that finds the queue empty re-arms 
+the notification. So in this mode, upon a notification, the queue <strong>MUST</strong> be 
+polled until it returns -1 (empty). The number of notifications sent is then bounded by
+the rate at which the queue is being drained instead of the rate at which items are 
+being delivered.
+@function setnotifymode
+@param mode the notification mode to use, either `"each"` (default) or `"coalesced"`
+@return 1 if successfull
+@see getnotifymode
+@see setport
+*/
+static int L_setnotifymode(lua_State *L)
+{
+	static const char *const modes[] = {"each", "coalesced", NULL};
+	int mode = luaL_checkoption(L, 1, NULL, modes);
+	pglobalRecord g = DSS_getvalidglobals(L); // won't return on error
+
+	DSS_mutex_lock(&(g->lock));
+	g->notifymode = (mode == 1 ? DSS_NOTIFY_COALESCED : DSS_NOTIFY_EACH);
+	DSS_atomic_swap(&(g->NotifyArmed), 1);
+	DSS_mutex_unlock(&(g->lock));
+	// report success
+	lua_pushinteger(L, 1);
+	return 1;
+};
+
+/***
+Returns the notification mode currently in use.
+@function getnotifymode
+@return notification mode in use, either `"each"` or `"coalesced"`
+@see setnotifymode
+*/
+static int L_getnotifymode(lua_State *L)
+{
+	pglobalRecord g = DSS_getvalidglobals(L); // won't return on error
+	lua_pushstring(L, (g->notifymode == DSS_NOTIFY_COALESCED ? "coalesced" : "each"));
+	return 1;
+};
+
+/***
+Enables or disables the file descriptor notification. When enabled, a file descriptor 
+(an `eventfd`, or the read end of a pipe where that is unavailable) becomes readable when 
+items are delivered in the queue (honouring the `setnotifymode` setting), so it can be handed 
+directly to `socket.select`, luv or epoll based loops. Contrary to UDP notifications, the descriptor 
+should not be read from; it is cleared by darksidesync when a call to `poll` or `pollmany` finds the queue 
+empty. So upon readability, the queue <strong>MUST</strong> be polled until it returns -1 (empty).
+Can be used alongside UDP notifications. Not available on Windows.
+@function setfd
+@param enable boolean, `true` to enable, `false` to disable and close the descriptor
+@return file descriptor (or -1 when disabled) if successfull, or `nil + error msg` if it failed
+@see getfd
+@see setport
+*/
+static int L_setfd(lua_State *L)
+{
+	int enable = lua_toboolean(L, 1);
+	int result, fd;
+	pglobalRecord g = DSS_getvalidglobals(L); // won't return on error
+
+	DSS_mutex_lock(&(g->lock));
+	result = setFDSignal(g, enable);
+	fd = g->fdsignal.readfd;
+	DSS_mutex_unlock(&(g->lock));
+	if (result == 0)
+	{
+		lua_pushnil(L);
+		lua_pushstring(L, "Failed to create the file descriptor signal, or not supported on this platform");
+		return 2;
+	}
+	lua_pushinteger(L, fd);
+	return 1;
+};
+
+/***
+Returns the file descriptor in use for notifications.
+@function getfd
+@return file descriptor in use, or -1 if file descriptor notifications are disabled
+@see setfd
+*/
+static int L_getfd(lua_State *L)
+{
+	pglobalRecord g = DSS_getvalidglobals(L); // won't return on error
+	lua_pushinteger(L, g->fdsignal.readfd);
+	return 1;
+};
+
+/***
+Joins a shared consumer group, so multiple Lua states (one per OS thread for example) can share 
+the load of handling the events of a background library. The group is created when the first
+Lua state joins it. Background libraries that register (require them) after joining are 
+registered with the group, instead of with the Lua state. Each member registers its own 
+instance of such a library, as usual. Their items are queued once, and
+taken by whichever member polls first; `poll`, `pollargs`, `pollmany` and `dispatch` will
+take the items of the group once the own queue of the Lua state is empty. The 
+`waitingthread_callback` (and garbage collection) of an item is handled by the member that 
+polled it.
+
+Notifications for items of the group are sent to the members in turn, using their own 
+settings (see `setport`, `setfd` and `setnotifymode`). The queue limits, statistics totals 
+and latency histograms of the Lua state do not include the group, but `setlimit`, `stats` 
+etc. with the `libid` of a library of the group do work on the instance registered by the 
+Lua state with the group.
+
+A Lua state can join only a single group, it leaves the group when it is closed. Its instances
+of the libraries are cancelled then, the items they delivered that are still queued are 
+cancelled as well. When the last member leaves, the group is destroyed. Each member must
+load the background libraries, as each of them can get their items to decode.
+@function join
+@param name name of the group to join
+@return 1 if successfull, or `nil + error msg` if it failed
+@usage
+-- in each of the worker threads
+local dss = require("darksidesync")
+dss.join("workers")
+local lib = require("some.library")   -- load libraries after joining
+*/
+static int L_join(lua_State *L)
+{
+	pglobalRecord g = DSS_getvalidglobals(L); // won't return on error
+	const char* name = luaL_checkstring(L, 1);
+	pglobalRecord group;
+
+	if (g->pGroup != NULL)
+	{
+		lua_pushnil(L);
+		lua_pushstring(L, "Already joined a group");
+		return 2;
+	}
+
+	DSS_mutex_lock(&dsslock);
+	group = GroupStart;
+	while (group != NULL && strcmp(group->GroupName, name) != 0) group = group->pGroupNext;
+	if (group == NULL)
+	{
+		// first member, create it
+		group = (pglobalRecord)malloc(sizeof(globalRecord));
+		if (group != NULL && (DSS_initglobals(group) != DSS_SUCCESS || 
+			NULL == (group->GroupName = (char*)malloc(strlen(name) + 1))))
+		{
+			free(group);
+			group = NULL;
+		}
+		if (group == NULL)
+		{
+			DSS_mutex_unlock(&dsslock);
+			lua_pushnil(L);
+			lua_pushstring(L, "Out of memory: DSS failed to create the group");
+			return 2;
+		}
+		strcpy(group->GroupName, name);
+		group->DSS_status = DSS_STATUS_STARTED;
+		group->pGroupNext = GroupStart;
+		GroupStart = group;
+	}
+	DSS_mutex_lock(&(group->lock));
+	g->pMemberNext = group->Members;
+	group->Members = g;
+	g->pGroup = group;
+	DSS_mutex_unlock(&(group->lock));
 	DSS_mutex_unlock(&dsslock);
+
+	lua_pushinteger(L, 1);
 	return 1;
 };
 
@@ -714,11 +1587,21 @@ Gets the next item from the darksidesync queue.
 If you use the UDP notifications, you <strong>MUST</strong> also read from the UDP socket to
 clear the received packet from the socket buffer. 
 
+Every background library has its own queue, and within a priority level the libraries
+take turns, so a single busy library cannot monopolize the Lua state. When polling a single
+library (through `libid`), notifications are not re-armed when its queue is found empty, only
+a general `poll` or `pollmany` will do that.
+
+If the client library raises an error while decoding the item, the item is cancelled and
+the error is raised by `poll`.
+
 NOTE: some of the return values will be generated by
 the client library (that is using darksidesync to get its data delivered to the Lua state) and other
 return values will be inserted by darksidesync.
 @function poll
-@return (by DSS) queuesize of remaining items (or -1 if there was nothing on the queue to begin with)
+@param libid (optional) lightuserdata identifying a background library, only the items of that library will be polled
+@return (by DSS) queuesize of remaining items (or -1 if there was nothing on the queue to begin with), if `libid`
+was given, only the items of that library are counted. Or `nil + error msg` if the `libid` is unknown.
 @return (by client) Lua callback function to handle the data
 @return Table with arguments for the Lua callback, this contains (by client library) any other parameters as delivered by the async callback. Optionally, if the async thread requires a result to be returned, a `waitingthread_callback` function (by DSS) is inserted at position 1 (but only if the async callback expects Lua to deliver a result, in this case the async callback thread will be blocked until the `waitingthread_callback` is called)
 @usage
@@ -734,30 +1617,359 @@ local runcallbacks()
 end
 */
 
-// Lua function to get the next item from the queue, its decode
-// function will be called to do what needs to be done
-static int L_poll(lua_State *L)
+// Detaches items from the queue to be decoded (see delivery_detach). When 
+// its own queue is empty, the items are taken from the group the LuaState 
+// joined (see 'join').
+// @util; only detach items of this utility, or NULL for any item. When 
+// polling a single utility, notifications are not re-armed
+// returns; the first item detached, or NULL if the queue was empty
+static pQueueItem DSS_detach(pglobalRecord g, putilRecord util, int max, int* count)
+{
+	pQueueItem pqi;
+
+	if (util != NULL) g = util->pGlobals;	// the record holding its queue
+	DSS_mutex_lock(&(g->lock));
+	delivery_collect(g);
+	pqi = delivery_detach(g, util, max, count);
+	DSS_mutex_unlock(&(g->lock));
+	// NOTE: when polling a single utility, others might still have items
+	if (pqi != NULL || util != NULL) return pqi;
+
+	if (g->pGroup != NULL) pqi = DSS_detach(g->pGroup, NULL, max, count);
+	if (pqi == NULL)
+	{
+		// both queues are empty, re-arm notifications (will collect again)
+		DSS_mutex_lock(&(g->lock));
+		delivery_rearm(g);
+		pqi = delivery_detach(g, NULL, max, count);
+		DSS_mutex_unlock(&(g->lock));
+		// an item for the group might have been delivered before re-arming
+		if (pqi == NULL && g->pGroup != NULL) pqi = DSS_detach(g->pGroup, NULL, max, count);
+	}
+	return pqi;
+}
+
+// Gets the next item from the queue, its decode function will be called 
+// to do what needs to be done
+// @astable; if TRUE the callback arguments are returned in a table, otherwise
+// as separate results
+static int DSS_poll_internal(lua_State *L, BOOL astable)
 {
 	pglobalRecord g = DSS_getvalidglobals(L); // won't return on error
 	int result = 0;
+	int remaining = 0;
+	putilRecord util = NULL;
+	pQueueItem pqi = NULL;
 
+	if (!lua_isnoneornil(L, 1))
+	{
+		// only poll a single utility, keep it locked while taking the item
+		luaL_checktype(L, 1, LUA_TLIGHTUSERDATA);
+		DSS_rwlock_readlock(&utillock);
+		util = DSS_findutil(g, lua_touserdata(L, 1));
+		if (util == NULL)
+		{
+			DSS_rwlock_readunlock(&utillock);
+			lua_pushnil(L);
+			lua_pushstring(L, "Unknown libid, the library is not registered");
+			return 2;
+		}
+	}
 	lua_settop(L, 0);		// clear stack
 
-	DSS_mutex_lock(&dsslock);
-	if (g->QueueCount > 0)
+	pqi = DSS_detach(g, util, 1, &result);
+	if (util != NULL) 
+	{
+		remaining = DSS_atomic_get(&(util->QueueCount));
+		DSS_rwlock_readunlock(&utillock);
+	}
+
+	if (pqi == NULL)
 	{
-		// Go decode oldest item
-		result = delivery_decode(g->QueueStart, L);
+		// Nothing in queue
+		lua_pushinteger(L, -1);	// return -1 to indicate queue was empty when called
+		return 1;
 	}
+
+	// Go decode oldest item, outside the lock
+	lua_pushnil(L);								// placeholder for the count
+	if (astable)
+		result = delivery_decodedetached(pqi, L);
 	else
+		result = delivery_decodeargs(pqi, L);
+	if (result < 0) return lua_error(L);		// the decoder failed, the item was cancelled
+	if (util == NULL) remaining = DSS_queuecount(g);
+	lua_pushinteger(L, remaining);				// add count to results
+	lua_replace(L, 1);							// in 1st position
+	return result + 1;							// count, callback, cb arguments (or only count)
+}
+
+// Lua function to get the next item from the queue, see 'poll'
+static int L_poll(lua_State *L)
+{
+	return DSS_poll_internal(L, TRUE);
+};
+
+/***
+Gets the next item from the darksidesync queue, same as `poll`, but the arguments for the
+Lua callback are returned as separate results, instead of in a table. This creates no garbage,
+so it is the cheapest way to handle events at high rates.
+@function pollargs
+@param libid (optional) lightuserdata identifying a background library, only the items of that library will be polled
+@return (by DSS) queuesize of remaining items (or -1 if there was nothing on the queue to begin with), if `libid`
+was given, only the items of that library are counted. Or `nil + error msg` if the `libid` is unknown.
+@return (by client) Lua callback function to handle the data
+@return ... arguments for the Lua callback (see `poll` for its contents, including the `waitingthread_callback`)
+@see poll
+@usage
+local handle = function(count, callback, ...)
+  if count == -1 then return false end  -- queue was empty, nothing to do
+  if callback then callback(...) end    -- execute callback
+  return true
+end
+while handle(darksidesync.pollargs()) do end
+*/
+static int L_pollargs(lua_State *L)
+{
+	return DSS_poll_internal(L, FALSE);
+};
+
+
+/***
+Gets multiple items from the darksidesync queue in a single call.
+Up to `max` items are taken from the queue at once, decoded and returned
+in a single table. This is far cheaper than calling `poll` for each item
+when many items are queued. If the client library raises an error while decoding an item,
+that item and the items not decoded yet are cancelled, and the error is raised.
+If you use the UDP notifications, you <strong>MUST</strong> still read all
+the received packets from the socket buffer. 
+@function pollmany
+@param max (optional) maximum number of items to collect, if omitted (or 0) the entire queue will be collected
+@param libid (optional) lightuserdata identifying a background library, only the items of that library will be collected
+@return (by DSS) queuesize of remaining items (or -1 if there was nothing on the queue to begin with), if `libid`
+was given, only the items of that library are counted. Or `nil + error msg` if the `libid` is unknown.
+@return Table with the collected items, as a flat list of pairs; a Lua callback function (as returned
+by `poll`) followed by a table with arguments for that callback (as returned by `poll`). Items for which
+the client library had nothing to deliver will not be in the list, hence it may be empty.
+@see poll
+@usage
+local runcallbacks()
+  local count, items = darksidesync.pollmany(100)
+  if count == -1 then return end	-- queue was empty, nothing to do
+  for i = 1, #items, 2 do
+    items[i](unpack(items[i+1]))    -- execute callback
+  end
+  if count > 0 then
+    print("there is more to do; " .. tostring(count) .. " items are still in the queue.")
+  else
+    print("We're done for now.")
+  end
+end
+*/
+
+// Lua function to get a number of items from the queue, their decode
+// functions will be called to do what needs to be done
+static int L_pollmany(lua_State *L)
+{
+	pglobalRecord g = DSS_getvalidglobals(L); // won't return on error
+	int max = luaL_optint(L, 1, 0);
+	int count = 0;
+	int n = 0;
+	int result;
+	int remaining = 0;
+	putilRecord util = NULL;
+	pQueueItem pqi = NULL;
+	pQueueItem next = NULL;
+
+	if (!lua_isnoneornil(L, 2))
+	{
+		// only poll a single utility, keep it locked while taking the items
+		luaL_checktype(L, 2, LUA_TLIGHTUSERDATA);
+		DSS_rwlock_readlock(&utillock);
+		util = DSS_findutil(g, lua_touserdata(L, 2));
+		if (util == NULL)
+		{
+			DSS_rwlock_readunlock(&utillock);
+			lua_pushnil(L);
+			lua_pushstring(L, "Unknown libid, the library is not registered");
+			return 2;
+		}
+	}
+	lua_settop(L, 0);		// clear stack
+
+	// take all items at once
+	next = DSS_detach(g, util, max, &count);
+	if (util != NULL) 
+	{
+		remaining = DSS_atomic_get(&(util->QueueCount));
+		DSS_rwlock_readunlock(&utillock);
+	}
+
+	if (next == NULL)
 	{
 		// Nothing in queue
 		lua_pushinteger(L, -1);	// return -1 to indicate queue was empty when called
-		result = 1;
+		return 1;
 	}
 
-	DSS_mutex_unlock(&dsslock);
-	return result;
+	// decode them, outside the lock
+	lua_createtable(L, count * 2, 0);	// table for results, sized so storing cannot fail
+	while (count > 0)
+	{
+		pqi = next;
+		next = pqi->pNext;	// get it now, decoding will unlink pqi
+		count -= 1;
+		result = delivery_decodedetached(pqi, L);
+		if (result > 0)
+		{
+			// store callback and arguments table in results
+			lua_rawseti(L, 1, n + 2);
+			lua_rawseti(L, 1, n + 1);
+			n += 2;
+		}
+		else if (result < 0)
+		{
+			// the decoder failed, cancel the rest before raising the error
+			delivery_canceldetached(next, count);
+			return lua_error(L);
+		}
+	}
+	if (util == NULL) remaining = DSS_queuecount(g);
+	lua_pushinteger(L, remaining);			// add count to results
+	lua_insert(L, 1);						// move count to 1st position
+	return 2;
+};
+
+
+// Default error handler for 'dispatch', prints the error and a stack traceback
+static int L_errorhandler(lua_State *L)
+{
+	lua_settop(L, 1);
+	lua_pushstring(L, "DSS error: callback function had an error;\n");
+	if (lua_isstring(L, 1))
+		lua_pushvalue(L, 1);
+	else
+		lua_pushstring(L, luaL_typename(L, 1));
+	lua_concat(L, 2);
+	// add a traceback if the debug library is available
+	lua_getglobal(L, "debug");
+	if (lua_istable(L, -1))
+	{
+		lua_getfield(L, -1, "traceback");
+		if (lua_isfunction(L, -1))
+		{
+			lua_pushvalue(L, 2);
+			lua_pushinteger(L, 2);	// skip this handler
+			if (lua_pcall(L, 2, 1, 0) == 0 && lua_isstring(L, -1)) lua_replace(L, 2);
+		}
+	}
+	fprintf(stderr, "%s\n", lua_tostring(L, 2));
+	lua_settop(L, 2);
+	return 1;
+}
+
+/***
+Sets the error handler used by `dispatch`. It is called with the error message when a 
+callback fails, like the handler of an `xpcall`. The default handler prints the error and a 
+stack traceback to `stderr`.
+@function seterrorhandler
+@param handler the error handler function, or `nil` to restore the default handler
+@return 1 if successfull
+@see dispatch
+*/
+static int L_seterrorhandler(lua_State *L)
+{
+	DSS_getvalidglobals(L); // won't return on error
+	if (!lua_isnoneornil(L, 1)) luaL_checktype(L, 1, LUA_TFUNCTION);
+	lua_settop(L, 1);
+	lua_setfield(L, LUA_REGISTRYINDEX, DSS_ERRORHANDLER_KEY);
+	lua_pushinteger(L, 1);
+	return 1;
+};
+
+/***
+Handles items from the darksidesync queue, without the overhead of doing it from Lua. 
+Items are taken from the queue one at a time, and for each item the callback is 
+called with its arguments (as returned by `pollargs`, so including the 
+`waitingthread_callback` if the client library expects a result) in protected mode, 
+using the handler set by `seterrorhandler`. An error raised by the client library while
+decoding an item is passed to that handler as well, the item is cancelled. Stops when the queue is empty, or when
+either limit has been reached, after at least one item has been handled.
+When the queue is found empty, the notifications are re-armed (as `poll` does).
+If you use the UDP notifications, you <strong>MUST</strong> still read all
+the received packets from the socket buffer. 
+@function dispatch
+@param max (optional) maximum number of items to handle, if omitted (or 0) there is no limit
+@param budget (optional) time budget in milliseconds, if omitted (or 0) there is no limit. The
+budget is checked between items, so a long running callback will overrun it.
+@return number of callbacks called (items for which the client library had nothing 
+to deliver are not counted)
+@return queuesize of remaining items, or -1 if the queue was found empty
+@see pollargs
+@see seterrorhandler
+@usage
+-- handle events for at most 5 milliseconds, then return to the event loop
+local ran, remaining = darksidesync.dispatch(0, 5)
+if remaining > 0 then
+  print("there is more to do; " .. tostring(remaining) .. " items are still in the queue.")
+end
+*/
+static int L_dispatch(lua_State *L)
+{
+	pglobalRecord g = DSS_getvalidglobals(L); // won't return on error
+	int max = luaL_optint(L, 1, 0);
+	DSS_time_t budget = (DSS_time_t)(luaL_optnumber(L, 2, 0) * 1000);
+	DSS_time_t deadline = 0;
+	int ran = 0;
+	int handled = 0;
+	int remaining = 0;
+	int count;
+	int n;
+	pQueueItem pqi;
+
+	if (budget > 0) deadline = histogram_now() + budget;
+	lua_settop(L, 0);		// clear stack
+	lua_getfield(L, LUA_REGISTRYINDEX, DSS_ERRORHANDLER_KEY);
+	if (lua_isnil(L, 1))
+	{
+		lua_pop(L, 1);
+		lua_pushcfunction(L, L_errorhandler);
+	}
+
+	while (TRUE)
+	{
+		pqi = DSS_detach(g, NULL, 1, &count);
+		if (pqi == NULL)
+		{
+			remaining = -1;		// queue was found empty
+			break;
+		}
+
+		// decode outside the lock, and call the callback
+		n = delivery_decodeargs(pqi, L);
+		if (n > 0)
+		{
+			if (lua_pcall(L, n - 1, 0, 1) != 0) lua_pop(L, 1);	// drop the error
+			ran += 1;
+		}
+		else if (n < 0)
+		{
+			// the decoder failed, the item was cancelled; report it as well
+			lua_pushvalue(L, 1);
+			lua_insert(L, -2);
+			if (lua_pcall(L, 1, 0, 0) != 0) lua_pop(L, 1);	// drop the error
+		}
+		handled += 1;
+
+		if ((max > 0 && handled >= max) || (deadline != 0 && histogram_now() >= deadline))
+		{
+			remaining = DSS_queuecount(g);
+			break;
+		}
+	}
+	lua_pushinteger(L, ran);
+	lua_pushinteger(L, remaining);
+	return 2;
 };
 
 
@@ -770,9 +1982,541 @@ static int L_queuesize(lua_State *L)
 {
 	pglobalRecord g = DSS_getvalidglobals(L); // won't return on error
 	lua_settop(L, 0);		// clear stack
-	DSS_mutex_lock(&dsslock);
-	lua_pushinteger(L, g->QueueCount);
-	DSS_mutex_unlock(&dsslock);
+	lua_pushinteger(L, DSS_queuecount(g));
+	return 1;
+};
+
+// Policy names for the Lua side, in order of the DSS_POLICY_xxx values
+static const char *const DSS_policynames[] = {"block", "reject", "dropoldest", "dropnewest", NULL};
+
+/***
+Sets a limit on the number of items in the queue. When the limit is reached, the overflow 
+policy determines what happens to new deliveries;
+
+ - `"block"` the delivering thread blocks until there is room in the queue
+ - `"reject"` the delivery fails, the item is not queued (default)
+ - `"dropoldest"` the oldest item in the queue is cancelled to make room
+ - `"dropnewest"` the item being delivered is cancelled
+
+A limit can be set for the Lua state as a whole, and separately per background library (identified
+by its `libid`, a lightuserdata the library should provide). Both limits apply.
+@function setlimit
+@param max maximum number of items in the queue, 0 for unlimited (default)
+@param policy (optional) overflow policy; `"block"`, `"reject"` (default), `"dropoldest"` or `"dropnewest"`
+@param libid (optional) lightuserdata identifying the background library to set the limit for
+@return 1 if successfull, or `nil + error msg` if it failed
+@see getlimit
+@see setwatermarks
+*/
+static int L_setlimit(lua_State *L)
+{
+	int max = luaL_checkint(L, 1);
+	int policy = luaL_checkoption(L, 2, "reject", DSS_policynames);
+	pglobalRecord g = DSS_getvalidglobals(L); // won't return on error
+	pglobalRecord q = g;	// record holding the queue the limit applies to
+	luaL_argcheck(L, max >= 0, 1, "limit cannot be negative");
+
+	if (lua_isnoneornil(L, 3))
+	{
+		g->Policy = policy;
+		g->MaxQueue = max;
+	}
+	else
+	{
+		putilRecord util;
+		luaL_checktype(L, 3, LUA_TLIGHTUSERDATA);
+		DSS_rwlock_readlock(&utillock);
+		util = DSS_findutil(g, lua_touserdata(L, 3));
+		if (util != NULL)
+		{
+			util->Policy = policy;
+			util->MaxQueue = max;
+			q = util->pGlobals;	// the group record, for a utility of a group
+		}
+		DSS_rwlock_readunlock(&utillock);
+		if (util == NULL)
+		{
+			lua_pushnil(L);
+			lua_pushstring(L, "Unknown libid, the library is not registered");
+			return 2;
+		}
+	}
+
+	// the limit might have been raised, let blocked producers retry
+	DSS_mutex_lock(&(q->lock));
+	delivery_wakeblocked(q);
+	DSS_mutex_unlock(&(q->lock));
+	lua_pushinteger(L, 1);
+	return 1;
+};
+
+/***
+Returns the limit on the number of items in the queue.
+@function getlimit
+@param libid (optional) lightuserdata identifying the background library to get the limit for
+@return maximum number of items (0 is unlimited), or `nil + error msg` if it failed
+@return overflow policy
+@see setlimit
+*/
+static int L_getlimit(lua_State *L)
+{
+	int max, policy;
+	pglobalRecord g = DSS_getvalidglobals(L); // won't return on error
+
+	if (lua_isnoneornil(L, 1))
+	{
+		max = g->MaxQueue;
+		policy = g->Policy;
+	}
+	else
+	{
+		putilRecord util;
+		luaL_checktype(L, 1, LUA_TLIGHTUSERDATA);
+		DSS_rwlock_readlock(&utillock);
+		util = DSS_findutil(g, lua_touserdata(L, 1));
+		if (util != NULL)
+		{
+			max = util->MaxQueue;
+			policy = util->Policy;
+		}
+		DSS_rwlock_readunlock(&utillock);
+		if (util == NULL)
+		{
+			lua_pushnil(L);
+			lua_pushstring(L, "Unknown libid, the library is not registered");
+			return 2;
+		}
+	}
+	lua_pushinteger(L, max);
+	lua_pushstring(L, DSS_policynames[policy]);
+	return 2;
+};
+
+/***
+Sets the watermarks for congestion of the queue. When the queue size reaches the 
+high watermark the queue becomes congested, and deliveries will report this to the 
+background libraries (`DSS_ERR_CONGESTED`), so they can throttle. It remains congested
+until the queue size drops to the low watermark.
+@function setwatermarks
+@param high queue size at which the queue becomes congested, 0 to disable (default)
+@param low (optional) queue size at which the queue is no longer congested, defaults to half of `high`
+@return 1 if successfull
+@see getwatermarks
+@see setlimit
+*/
+static int L_setwatermarks(lua_State *L)
+{
+	int high = luaL_checkint(L, 1);
+	int low = luaL_optint(L, 2, high / 2);
+	pglobalRecord g = DSS_getvalidglobals(L); // won't return on error
+	luaL_argcheck(L, high >= 0, 1, "watermark cannot be negative");
+	luaL_argcheck(L, low >= 0 && (low < high || high == 0), 2, "low watermark must be below the high watermark");
+
+	DSS_mutex_lock(&(g->lock));
+	g->HighWater = high;
+	g->LowWater = low;
+	if (high == 0 || DSS_atomic_get(&(g->QueueCount)) <= low) DSS_atomic_swap(&(g->Congested), 0);
+	DSS_mutex_unlock(&(g->lock));
+	lua_pushinteger(L, 1);
+	return 1;
+};
+
+/***
+Returns the watermarks for congestion of the queue, and the current congestion status.
+@function getwatermarks
+@return high watermark (0 if disabled)
+@return low watermark
+@return boolean, `true` if the queue is currently congested
+@see setwatermarks
+*/
+static int L_getwatermarks(lua_State *L)
+{
+	pglobalRecord g = DSS_getvalidglobals(L); // won't return on error
+	lua_pushinteger(L, g->HighWater);
+	lua_pushinteger(L, g->LowWater);
+	lua_pushboolean(L, DSS_atomic_get(&(g->Congested)) != 0);
+	return 3;
+};
+
+// Priority level names for the Lua side, in order of the DSS_PRIORITY_xxx values
+static const char *const DSS_prioritynames[] = {"high", "normal", "low", NULL};
+
+/***
+Sets the default priority for the items delivered by a background library. Higher priority 
+items are polled first. Lower priority items will not starve; each time a priority level holding 
+items is passed over, it earns a credit, and after 8 credits it goes first. Libraries
+can also set the priority for each individual item delivered, in which case the default is not used.
+@function setpriority
+@param priority the default priority level; `"high"`, `"normal"` (default) or `"low"`
+@param libid lightuserdata identifying the background library to set the priority for
+@return 1 if successfull, or `nil + error msg` if it failed
+@see getpriority
+*/
+static int L_setpriority(lua_State *L)
+{
+	int priority = luaL_checkoption(L, 1, NULL, DSS_prioritynames);
+	pglobalRecord g = DSS_getvalidglobals(L); // won't return on error
+	putilRecord util;
+	luaL_checktype(L, 2, LUA_TLIGHTUSERDATA);
+
+	DSS_rwlock_readlock(&utillock);
+	util = DSS_findutil(g, lua_touserdata(L, 2));
+	if (util != NULL) util->Priority = priority;
+	DSS_rwlock_readunlock(&utillock);
+	if (util == NULL)
+	{
+		lua_pushnil(L);
+		lua_pushstring(L, "Unknown libid, the library is not registered");
+		return 2;
+	}
+	lua_pushinteger(L, 1);
+	return 1;
+};
+
+/***
+Returns the default priority for the items delivered by a background library.
+@function getpriority
+@param libid lightuserdata identifying the background library to get the priority for
+@return priority level; `"high"`, `"normal"` or `"low"`, or `nil + error msg` if it failed
+@see setpriority
+*/
+static int L_getpriority(lua_State *L)
+{
+	int priority = DSS_PRIORITY_NORMAL;
+	pglobalRecord g = DSS_getvalidglobals(L); // won't return on error
+	putilRecord util;
+	luaL_checktype(L, 1, LUA_TLIGHTUSERDATA);
+
+	DSS_rwlock_readlock(&utillock);
+	util = DSS_findutil(g, lua_touserdata(L, 1));
+	if (util != NULL) priority = util->Priority;
+	DSS_rwlock_readunlock(&utillock);
+	if (util == NULL)
+	{
+		lua_pushnil(L);
+		lua_pushstring(L, "Unknown libid, the library is not registered");
+		return 2;
+	}
+	lua_pushstring(L, DSS_prioritynames[priority]);
+	return 1;
+};
+
+/***
+Sets the Lua handler for the typed events delivered by a background library. Libraries can deliver
+simple values (numbers, booleans, strings) as typed events, without a decoder of their own. When such 
+an event is polled, the handler is returned as the callback, and the values as its arguments. 
+Without a handler, the library cannot deliver typed events, and events still queued when the
+handler is removed will be dropped.
+@function sethandler
+@param libid lightuserdata identifying the background library to set the handler for
+@param handler the handler function, or `nil` to remove it
+@return 1 if successfull, or `nil + error msg` if it failed
+@see poll
+*/
+static int L_sethandler(lua_State *L)
+{
+	pglobalRecord g = DSS_getvalidglobals(L); // won't return on error
+	putilRecord util;
+	luaL_checktype(L, 1, LUA_TLIGHTUSERDATA);
+	if (!lua_isnoneornil(L, 2)) luaL_checktype(L, 2, LUA_TFUNCTION);
+	lua_settop(L, 2);
+
+	// store it first, so it is available once deliveries are accepted
+	lua_getfield(L, LUA_REGISTRYINDEX, DSS_HANDLERS_KEY);
+	if (!lua_istable(L, -1))
+	{
+		lua_pop(L, 1);
+		lua_newtable(L);
+		lua_pushvalue(L, -1);
+		lua_setfield(L, LUA_REGISTRYINDEX, DSS_HANDLERS_KEY);
+	}
+	lua_pushvalue(L, 1);
+	lua_pushvalue(L, 2);
+	lua_rawset(L, -3);
+
+	DSS_rwlock_readlock(&utillock);
+	util = DSS_findutil(g, lua_touserdata(L, 1));
+	if (util != NULL) util->HasHandler = !lua_isnil(L, 2);
+	DSS_rwlock_readunlock(&utillock);
+	if (util == NULL)
+	{
+		// remove it again
+		lua_pushvalue(L, 1);
+		lua_pushnil(L);
+		lua_rawset(L, -3);
+		lua_pushnil(L);
+		lua_pushstring(L, "Unknown libid, the library is not registered");
+		return 2;
+	}
+	lua_pushinteger(L, 1);
+	return 1;
+};
+
+/***
+Sets the size of the pool of queue items. Delivered items are taken from this pool, 
+and returned to it once handled, so in steady state no memory is allocated. The pool 
+is immediately filled up to the new size. Default size is 64.
+@function setpoolsize
+@param size maximum number of free items to keep in the pool (0 to disable pooling)
+@return 1 if successfull
+@see poolstats
+*/
+static int L_setpoolsize(lua_State *L)
+{
+	int size = luaL_checkint(L, 1);
+	pglobalRecord g = DSS_getvalidglobals(L); // won't return on error
+	luaL_argcheck(L, size >= 0, 1, "pool size cannot be negative");
+	pool_setsize(g, size);
+	lua_pushinteger(L, 1);
+	return 1;
+};
+
+/***
+Returns statistics on the pool of queue items, and the per thread cache of waithandles
+(the latter is shared by all Lua states).
+@function poolstats
+@return table with fields `size` (max free items), `free` (free items in the pool), `hits` 
+(items taken from the pool), `misses` (items allocated), `handlehits` (waithandles reused) and 
+`handlemisses` (waithandles created)
+@see setpoolsize
+*/
+static int L_poolstats(lua_State *L)
+{
+	long hits, misses;
+	int size, count;
+	pglobalRecord g = DSS_getvalidglobals(L); // won't return on error
+
+	DSS_mutex_lock(&(g->PoolLock));
+	size = g->PoolSize;
+	count = g->PoolCount;
+	DSS_mutex_unlock(&(g->PoolLock));
+	lua_createtable(L, 0, 6);
+	lua_pushinteger(L, size);
+	lua_setfield(L, -2, "size");
+	lua_pushinteger(L, count);
+	lua_setfield(L, -2, "free");
+	lua_pushinteger(L, DSS_atomic_get(&(g->PoolHits)));
+	lua_setfield(L, -2, "hits");
+	lua_pushinteger(L, DSS_atomic_get(&(g->PoolMisses)));
+	lua_setfield(L, -2, "misses");
+	DSS_waithandle_cachestats(&hits, &misses);
+	lua_pushinteger(L, hits);
+	lua_setfield(L, -2, "handlehits");
+	lua_pushinteger(L, misses);
+	lua_setfield(L, -2, "handlemisses");
+	return 1;
+};
+
+// snapshot of the statistics of a utility, see L_stats
+typedef struct utilStats {
+	void* libid;
+	long queued;
+	dssStats stats;
+} utilStats;
+
+// pushes a table with the statistics onto the Lua stack
+static void DSS_pushstats(lua_State *L, dssStats* stats, long queued)
+{
+	lua_createtable(L, 0, 9);
+	lua_pushinteger(L, stats->Delivered);
+	lua_setfield(L, -2, "delivered");
+	lua_pushinteger(L, stats->Polled);
+	lua_setfield(L, -2, "polled");
+	lua_pushinteger(L, stats->Returned);
+	lua_setfield(L, -2, "returned");
+	lua_pushinteger(L, stats->Cancelled);
+	lua_setfield(L, -2, "cancelled");
+	lua_pushinteger(L, stats->SendFailed);
+	lua_setfield(L, -2, "sendfailed");
+	lua_pushinteger(L, stats->AllocFailed);
+	lua_setfield(L, -2, "allocfailed");
+	lua_pushinteger(L, queued);
+	lua_setfield(L, -2, "queued");
+	lua_pushinteger(L, stats->PeakQueue);
+	lua_setfield(L, -2, "peakqueued");
+	lua_pushinteger(L, stats->Waiting);
+	lua_setfield(L, -2, "waiting");
+}
+
+/***
+Returns runtime statistics of darksidesync, for the Lua state as a whole and per background library.
+The counters only ever go up (they are not reset), the gauges (`queued`, `peakqueued` and `waiting`) 
+reflect the current state. Statistics of a library are lost when it unregisters, the totals keep them.
+@function stats
+@return table with the totals for the Lua state, with fields; `delivered` (items delivered into the
+queue), `polled` (items taken from the queue), `returned` (items for which `waitingthread_callback` was
+called), `cancelled` (items dropped by an overflow policy, cancelled on unregistering, or garbage 
+collected while waiting for `waitingthread_callback`), `sendfailed` (failed notifications), `allocfailed`
+(deliveries failed on memory allocation), `queued` (current queue size), `peakqueued` (highest queue size
+seen) and `waiting` (items waiting for `waitingthread_callback`). Field `utilities` holds a table with
+the same statistics for each registered library, indexed by its `libid`.
+@see queuesize
+@see poolstats
+*/
+static int L_stats(lua_State *L)
+{
+	int i;
+	int count = 0;
+	utilStats* snapshot = NULL;
+	putilRecord util;
+	pglobalRecord g = DSS_getvalidglobals(L); // won't return on error
+
+	// take a snapshot of the utilities, no Lua calls (possible errors) while locked
+	DSS_rwlock_readlock(&utillock);
+	for (util = UtilStart; util != NULL; util = util->pNext)
+		if (util->pOwner == g) count++;
+	if (count > 0)
+	{
+		snapshot = (utilStats*)malloc(count * sizeof(utilStats));
+		if (snapshot == NULL)
+		{
+			DSS_rwlock_readunlock(&utillock);
+			return luaL_error(L, "Out of memory: DSS failed to collect the statistics");
+		}
+	}
+	i = 0;
+	for (util = UtilStart; util != NULL && i < count; util = util->pNext)
+	{
+		if (util->pOwner == g)
+		{
+			snapshot[i].libid = util->libid;
+			snapshot[i].queued = DSS_atomic_get(&(util->QueueCount));
+			snapshot[i].stats = util->Stats;
+			i++;
+		}
+	}
+	DSS_rwlock_readunlock(&utillock);
+
+	lua_settop(L, 0);
+	DSS_pushstats(L, &(g->Stats), DSS_atomic_get(&(g->QueueCount)));
+	lua_createtable(L, 0, count);
+	for (i = 0; i < count; i++)
+	{
+		lua_pushlightuserdata(L, snapshot[i].libid);
+		DSS_pushstats(L, &(snapshot[i].stats), snapshot[i].queued);
+		lua_rawset(L, -3);
+	}
+	free(snapshot);
+	lua_setfield(L, -2, "utilities");
+	return 1;
+};
+
+// Latency stage names for the Lua side, in order of the DSS_LATENCY_xxx values
+static const char *const DSS_latencynames[] = {"queued", "handled", "blocked", NULL};
+
+/***
+Returns latency histograms, in microseconds, for the stages an item goes through; `queued` (from
+delivery until polled), `handled` (from polled until `waitingthread_callback` was called) and `blocked`
+(time a background thread was blocked while delivering, either waiting for a result from Lua, or 
+for room in the queue, see `setlimit`). The histograms are kept per background library, without 
+a `libid` the histograms of all registered libraries are combined. The histogram buckets have a
+relative error of about 6%, the values reported are the upper bounds of the buckets.
+@function latency
+@param libid (optional) lightuserdata identifying the background library to get the latencies for
+@return table with a table for each stage, with fields `count` (number of values recorded), `p50`, 
+`p99`, `p999` (percentiles) and `max`. Or `nil + error msg` if it failed
+@see resetlatency
+@see stats
+*/
+static int L_latency(lua_State *L)
+{
+	int i;
+	putilRecord util;
+	histogram_t h[DSS_LATENCY_STAGES];
+	pglobalRecord g = DSS_getvalidglobals(L); // won't return on error
+	void* libid = NULL;
+
+	if (!lua_isnoneornil(L, 1))
+	{
+		luaL_checktype(L, 1, LUA_TLIGHTUSERDATA);
+		libid = lua_touserdata(L, 1);
+	}
+
+	// combine into a local copy, no Lua calls (possible errors) while locked
+	memset(h, 0, sizeof(h));
+	DSS_rwlock_readlock(&utillock);
+	if (libid != NULL)
+	{
+		util = DSS_findutil(g, libid);
+		if (util != NULL)
+			for (i = 0; i < DSS_LATENCY_STAGES; i++) histogram_merge(&(h[i]), &(util->Latency[i]));
+	}
+	else
+	{
+		for (util = UtilStart; util != NULL; util = util->pNext)
+			if (util->pOwner == g)
+				for (i = 0; i < DSS_LATENCY_STAGES; i++) histogram_merge(&(h[i]), &(util->Latency[i]));
+	}
+	DSS_rwlock_readunlock(&utillock);
+	if (libid != NULL && util == NULL)
+	{
+		lua_pushnil(L);
+		lua_pushstring(L, "Unknown libid, the library is not registered");
+		return 2;
+	}
+
+	lua_settop(L, 0);
+	lua_createtable(L, 0, DSS_LATENCY_STAGES);
+	for (i = 0; i < DSS_LATENCY_STAGES; i++)
+	{
+		lua_createtable(L, 0, 5);
+		lua_pushinteger(L, h[i].Count);
+		lua_setfield(L, -2, "count");
+		lua_pushnumber(L, (lua_Number)histogram_percentile(&(h[i]), 0.5));
+		lua_setfield(L, -2, "p50");
+		lua_pushnumber(L, (lua_Number)histogram_percentile(&(h[i]), 0.99));
+		lua_setfield(L, -2, "p99");
+		lua_pushnumber(L, (lua_Number)histogram_percentile(&(h[i]), 0.999));
+		lua_setfield(L, -2, "p999");
+		lua_pushnumber(L, (lua_Number)h[i].Max);
+		lua_setfield(L, -2, "max");
+		lua_setfield(L, -2, DSS_latencynames[i]);
+	}
+	return 1;
+};
+
+/***
+Clears the latency histograms.
+@function resetlatency
+@param libid (optional) lightuserdata identifying the background library to clear the histograms for, 
+if omitted, the histograms of all libraries are cleared
+@return 1 if successfull, or `nil + error msg` if it failed
+@see latency
+*/
+static int L_resetlatency(lua_State *L)
+{
+	int i;
+	putilRecord util;
+	pglobalRecord g = DSS_getvalidglobals(L); // won't return on error
+	void* libid = NULL;
+
+	if (!lua_isnoneornil(L, 1))
+	{
+		luaL_checktype(L, 1, LUA_TLIGHTUSERDATA);
+		libid = lua_touserdata(L, 1);
+	}
+
+	DSS_rwlock_readlock(&utillock);
+	if (libid != NULL)
+	{
+		util = DSS_findutil(g, libid);
+		if (util != NULL)
+			for (i = 0; i < DSS_LATENCY_STAGES; i++) histogram_reset(&(util->Latency[i]));
+	}
+	else
+	{
+		for (util = UtilStart; util != NULL; util = util->pNext)
+			if (util->pOwner == g)
+				for (i = 0; i < DSS_LATENCY_STAGES; i++) histogram_reset(&(util->Latency[i]));
+	}
+	DSS_rwlock_readunlock(&utillock);
+	if (libid != NULL && util == NULL)
+	{
+		lua_pushnil(L);
+		lua_pushstring(L, "Unknown libid, the library is not registered");
+		return 2;
+	}
+	lua_pushinteger(L, 1);
 	return 1;
 };
 
@@ -781,12 +2525,32 @@ static int L_return_internal(lua_State *L, BOOL garbage)
 {
 	int result = 0;
 	pQueueItem pqi = NULL;
-	pQueueItem* rqi = (pQueueItem*)luaL_checkudata(L, 1, DSS_QUEUEITEM_MT);	// first item must be our queue item
+	pqueueRef rqi = (pqueueRef)luaL_checkudata(L, 1, DSS_QUEUEITEM_MT);	// first item must be our queue item
+	pglobalRecord g = rqi->pGlobals;	// the record holding the item, might be a group
 
-	DSS_mutex_lock(&dsslock);
-	pqi = *rqi;
-	if (pqi != NULL)	result = delivery_return(pqi, L, garbage);
-	DSS_mutex_unlock(&dsslock);
+	// once cleared, the reference never gets set again. So if it is cleared, we're
+	// done, without touching the lock (it might have been destroyed already if 
+	// we're being garbage collected on LuaState shutdown)
+	if (DSS_getstateglobals(L, NULL) == NULL || rqi->pqi == NULL) return 0;
+
+	DSS_mutex_lock(&(g->lock));
+	pqi = rqi->pqi;
+	if (pqi != NULL)
+	{
+		// count it while the utility record is still guaranteed valid
+		if (garbage)
+			DSS_STATS_INC(pqi->pUtil, Cancelled);
+		else
+		{
+			DSS_STATS_INC(pqi->pUtil, Returned);
+			histogram_record(&(pqi->pUtil->Latency[DSS_LATENCY_HANDLED]), histogram_now() - pqi->tPolled);
+		}
+		delivery_takereturn(pqi);
+	}
+	DSS_mutex_unlock(&(g->lock));
+
+	// execute the return callback outside the lock
+	if (pqi != NULL) result = delivery_return(pqi, L, garbage);
 	return result;
 }
 
@@ -818,9 +2582,30 @@ static int L_return(lua_State *L)
 */
 static const struct luaL_Reg DarkSideSync[] = {
 	{"poll",L_poll},
+	{"pollmany",L_pollmany},
+	{"pollargs",L_pollargs},
+	{"dispatch",L_dispatch},
+	{"seterrorhandler",L_seterrorhandler},
+	{"join",L_join},
 	{"getport",L_getport},
 	{"setport",L_setport},
+	{"getnotifymode",L_getnotifymode},
+	{"setnotifymode",L_setnotifymode},
+	{"getfd",L_getfd},
+	{"setfd",L_setfd},
 	{"queuesize",L_queuesize},
+	{"setpoolsize",L_setpoolsize},
+	{"setlimit",L_setlimit},
+	{"getlimit",L_getlimit},
+	{"setwatermarks",L_setwatermarks},
+	{"getwatermarks",L_getwatermarks},
+	{"setpriority",L_setpriority},
+	{"getpriority",L_getpriority},
+	{"sethandler",L_sethandler},
+	{"poolstats",L_poolstats},
+	{"stats",L_stats},
+	{"latency",L_latency},
+	{"resetlatency",L_resetlatency},
 	{NULL,NULL}
 };
 
@@ -841,6 +2626,14 @@ OutputDebugStringA("DSS: LuaOpen started...\n");
 			// an error occured while initializing the 2 global mutexes
 			return luaL_error(L,"DSS had an error initializing its mutexes (utillock)");
 		}
+		if (DSS_rwlock_init(&utillock) != 0)
+		{
+			return luaL_error(L,"DSS had an error initializing its mutexes (utillock)");
+		}
+		if (DSS_waithandle_initcache() != 0)
+		{
+			return luaL_error(L,"DSS had an error initializing its waithandle cache");
+		}
 		DSS_initialized = &luaopen_darksidesync; //point to 'something', no longer NULL
 
 		// Initializes API structure for API 1.0 (static, so only once)
@@ -849,6 +2642,42 @@ OutputDebugStringA("DSS: LuaOpen started...\n");
 		DSS_api_1v0.getutilid = (DSS_getutilid_1v0_t)&DSS_getutilid_1v0;
 		DSS_api_1v0.deliver = (DSS_deliver_1v0_t)&DSS_deliver_1v0;
 		DSS_api_1v0.unreg = (DSS_unregister_1v0_t)&DSS_unregister_1v0;
+
+		// Initializes API structure for API 1.1 (static, so only once)
+		DSS_api_1v1.version = DSS_API_1v1_KEY;
+		DSS_api_1v1.reg = (DSS_register_1v0_t)&DSS_register_1v0;
+		DSS_api_1v1.getutilid = (DSS_getutilid_1v0_t)&DSS_getutilid_1v0;
+		DSS_api_1v1.deliver = (DSS_deliver_1v0_t)&DSS_deliver_1v0;
+		DSS_api_1v1.unreg = (DSS_unregister_1v0_t)&DSS_unregister_1v0;
+		DSS_api_1v1.deliverprio = (DSS_deliverprio_1v1_t)&DSS_deliverprio_1v1;
+		DSS_api_1v1.reserve = (DSS_reserve_1v1_t)&DSS_reserve_1v1;
+		DSS_api_1v1.commit = (DSS_commit_1v1_t)&DSS_commit_1v1;
+		DSS_api_1v1.abort = (DSS_abort_1v1_t)&DSS_abort_1v1;
+		DSS_api_1v1.deliverevent = (DSS_deliverevent_1v1_t)&DSS_deliverevent_1v1;
+		DSS_api_1v1.deliverasync = (DSS_deliverasync_1v1_t)&DSS_deliverasync_1v1;
+		DSS_api_1v1.waitticket = (DSS_waitticket_1v1_t)&DSS_waitticket_1v1;
+		DSS_api_1v1.releaseticket = (DSS_releaseticket_1v1_t)&DSS_releaseticket_1v1;
+		DSS_api_1v1.delivertimeout = (DSS_delivertimeout_1v1_t)&DSS_delivertimeout_1v1;
+		DSS_api_1v1.deliverkeyed = (DSS_deliverkeyed_1v1_t)&DSS_deliverkeyed_1v1;
+
+		// Initializes API structure for API 1.2 (static, so only once)
+		DSS_api_1v2.version = DSS_API_1v2_KEY;
+		DSS_api_1v2.reg = (DSS_register_1v0_t)&DSS_register_1v0;
+		DSS_api_1v2.getutilid = (DSS_getutilid_1v0_t)&DSS_getutilid_1v0;
+		DSS_api_1v2.deliver = (DSS_deliver_1v0_t)&DSS_deliver_1v0;
+		DSS_api_1v2.unreg = (DSS_unregister_1v0_t)&DSS_unregister_1v0;
+		DSS_api_1v2.deliverprio = (DSS_deliverprio_1v1_t)&DSS_deliverprio_1v1;
+		DSS_api_1v2.reserve = (DSS_reserve_1v1_t)&DSS_reserve_1v1;
+		DSS_api_1v2.commit = (DSS_commit_1v1_t)&DSS_commit_1v1;
+		DSS_api_1v2.abort = (DSS_abort_1v1_t)&DSS_abort_1v1;
+		DSS_api_1v2.deliverevent = (DSS_deliverevent_1v1_t)&DSS_deliverevent_1v1;
+		DSS_api_1v2.deliverasync = (DSS_deliverasync_1v1_t)&DSS_deliverasync_1v1;
+		DSS_api_1v2.waitticket = (DSS_waitticket_1v1_t)&DSS_waitticket_1v1;
+		DSS_api_1v2.releaseticket = (DSS_releaseticket_1v1_t)&DSS_releaseticket_1v1;
+		DSS_api_1v2.delivertimeout = (DSS_delivertimeout_1v1_t)&DSS_delivertimeout_1v1;
+		DSS_api_1v2.deliverkeyed = (DSS_deliverkeyed_1v1_t)&DSS_deliverkeyed_1v1;
+		DSS_api_1v2.deliverbatch = (DSS_deliverbatch_1v2_t)&DSS_deliverbatch_1v2;
+		DSS_api_1v2.setbatchdecoder = (DSS_setbatchdecoder_1v2_t)&DSS_setbatchdecoder_1v2;
 	}
 
 	// Create metatable for userdata's waiting for 'return' callback
@@ -863,6 +2692,10 @@ OutputDebugStringA("DSS: LuaOpen started...\n");
 	lua_pushcfunction(L, &L_return);
 	lua_settable(L, -3);
 
+	// Store the function decoding items in protected mode
+	lua_pushcfunction(L, &delivery_decodecall);
+	lua_setfield(L, LUA_REGISTRYINDEX, DSS_DECODER_KEY);
+
 	// Create a metatable to GC the global data upon exit
 	luaL_newmetatable(L, DSS_GLOBALS_MT);
 	lua_pushstring(L, "__gc");
@@ -895,6 +2728,12 @@ OutputDebugStringA("DSS: LuaOpen started...\n");
 	// add the DSS api version 1.0 to the DSS table
 	lua_pushlightuserdata(L,&DSS_api_1v0);
 	lua_setfield(L, 1, DSS_API_1v0_KEY);
+	// add the DSS api version 1.1 to the DSS table
+	lua_pushlightuserdata(L,&DSS_api_1v1);
+	lua_setfield(L, 1, DSS_API_1v1_KEY);
+	// add the DSS api version 1.2 to the DSS table
+	lua_pushlightuserdata(L,&DSS_api_1v2);
+	lua_setfield(L, 1, DSS_API_1v2_KEY);
 	// Push overall DSS table onto the Lua registry
 	lua_setfield(L, LUA_REGISTRYINDEX, DSS_REGISTRY_NAME);
 
@@ -7,6 +7,9 @@
 #include "udpsocket.h"
 #include "locking.h"
 #include "waithandle.h"
+#include "fdsignal.h"
+#include "histogram.h"
+#include "ticket.h"
 
 //////////////////////////////////////////////////////////////
 // symbol list												//
@@ -20,12 +23,37 @@
 #define DSS_STATUS_STOPPING -2
 #define DSS_STATUS_STOPPED -3
 
+// Symbols for notification modes
+#define DSS_NOTIFY_EACH 0			// notify for every item delivered
+#define DSS_NOTIFY_COALESCED 1		// notify only when the queue is no longer empty
+
+// Number of priority levels (see DSS_PRIORITY_xxx in darksidesync_api.h)
+#define DSS_PRIORITY_LEVELS 3
+// Number of times a priority level with items can be passed over, before it goes first
+#define DSS_PRIORITY_AGING 8
+
+// Number of buckets in the index of queued items with a coalescing key (power of 2)
+#define DSS_KEY_BUCKETS 256
+
+// Maximum number of items handed to a batch decoder in a single call (see 'setbatchdecoder')
+#define DSS_BATCH_MAX 256
+
+// Symbols for overflow policies, when a queue limit has been reached
+#define DSS_POLICY_BLOCK 0			// block the producer until there is room in the queue
+#define DSS_POLICY_REJECT 1			// reject the delivery, DSS_ERR_QUEUE_FULL
+#define DSS_POLICY_DROPOLDEST 2		// cancel the oldest queued item, DSS_ERR_ITEM_DROPPED
+#define DSS_POLICY_DROPNEWEST 3		// cancel the item being delivered, DSS_ERR_ITEM_DROPPED
+
 // Lua registry key for globaldata structure
 #define DSS_GLOBALS_KEY "DSS.globals"
 // Lua registry key for metatable of the global structure userdata
 #define DSS_GLOBALS_MT "DSS.globals.mt"
 // Lua registry key for metatable of queueItems waiting for 'return' callback
 #define DSS_QUEUEITEM_MT "DSS.queueitem.mt"
+// Lua registry key for the error handler used by 'dispatch'
+#define DSS_ERRORHANDLER_KEY "DSS.errorhandler"
+// Lua registry key for the function decoding items in protected mode (see delivery_decodecall)
+#define DSS_DECODER_KEY "DSS.decoder"
 
 // Define platform specific extern statement
 #ifdef WIN32
@@ -49,6 +77,38 @@
 typedef struct utilReg *putilRecord;
 typedef struct qItem *pQueueItem;
 typedef struct stateGlobals *pglobalRecord;
+typedef struct blockedProducer *pblockedProducer;
+typedef struct queueRef *pqueueRef;
+
+// structure for a list of queued items, first in first out
+typedef struct queueList {
+		pQueueItem Start;			// Holds first element in the list
+		pQueueItem End;				// Holds the last item in the list
+	} queueList;
+
+// structure with runtime statistics, kept per LuaState and per utility
+// NOTE: only updated through the DSS_STATS_xxx macros below
+typedef struct dssStats {
+		DSS_atomic_t Delivered;		// items delivered into the queue
+		DSS_atomic_t Polled;		// items taken from the queue to be decoded
+		DSS_atomic_t Returned;		// items for which 'waitingthread_callback' was called
+		DSS_atomic_t Cancelled;		// items cancelled (dropped, unregistered or garbage collected)
+		DSS_atomic_t SendFailed;	// failed notifications
+		DSS_atomic_t AllocFailed;	// failed memory allocations while delivering
+		DSS_atomic_t PeakQueue;		// highest queue size seen
+		DSS_atomic_t Waiting;		// items waiting for 'waitingthread_callback' (in the userdata list)
+	} dssStats;
+
+// Updates a statistics counter of a utility, and of its LuaState
+#define DSS_STATS_ADD(util, field, value) \
+	do { DSS_atomic_add(&((util)->Stats.field), (value)); DSS_atomic_add(&((util)->pGlobals->Stats.field), (value)); } while (0)
+#define DSS_STATS_INC(util, field) DSS_STATS_ADD(util, field, 1)
+
+// Stages for which latency histograms are kept per utility
+#define DSS_LATENCY_QUEUED 0	// delivered until polled
+#define DSS_LATENCY_HANDLED 1	// polled until 'waitingthread_callback' was called
+#define DSS_LATENCY_BLOCKED 2	// producer blocked in 'deliver'
+#define DSS_LATENCY_STAGES 3
 
 // structure for registering utilities
 typedef struct utilReg {
@@ -56,38 +116,124 @@ typedef struct utilReg {
 		putilRecord pNext;			// Next item in list
 		putilRecord pPrevious;		// Previous item in list
 		pglobalRecord pGlobals;		// pointer to the global data for this utility
+		pglobalRecord pOwner;		// LuaState that registered it, differs from 'pGlobals' for a group (see 'join')
 		void* libid;				// unique library specific ID
+		void* utilid;				// ID handed out to the utility (see utiltable.h)
+		putilRecord pHashNext;		// Next item in the same bucket of the hash index
+		int volatile MaxQueue;		// max number of queued items for this utility, 0 = unlimited
+		int volatile Policy;		// overflow policy when MaxQueue is reached
+		DSS_atomic_t QueueCount;	// Count of queued items of this utility
+		DSS_atomic_t Pinned;		// items reserved, not yet committed/aborted (see 'reserve')
+		int volatile Priority;		// default priority level for deliveries
+		BOOL volatile HasHandler;	// a Lua handler for typed events was set (see 'sethandler')
+		DSS_decoder_1v0_t BatchItemDecode;		// items delivered with this decoder are decoded in batches
+		DSS_batchdecoder_1v2_t BatchDecode;		// batch decoder, NULL for none (see 'setbatchdecoder')
+		dssStats Stats;				// runtime statistics of this utility
+		histogram_t Latency[DSS_LATENCY_STAGES];	// latency histograms, per stage
+		// Elements for the queue of this utility, protected by the lock of the global record
+		queueList Queue[DSS_PRIORITY_LEVELS];			// Queued items, a list per priority level
+		putilRecord pActiveNext[DSS_PRIORITY_LEVELS];		// Next utility in the ring of utilities with items at a level
+		putilRecord pActivePrevious[DSS_PRIORITY_LEVELS];	// Previous utility in the ring
 	} utilRecord;
 
+// structure of the userdata referencing an item waiting for a 'return' callback
+typedef struct queueRef {
+		pQueueItem pqi;				// the item, NULL once returned or cancelled
+		pglobalRecord pGlobals;		// record holding the item (a group, see 'join'), its lock protects 'pqi'
+		pglobalRecord pOwner;		// record of the LuaState holding the userdata
+	} queueRef;
+
+// structure for a producer blocked on a full queue (lives on the stack of the producer)
+typedef struct blockedProducer {
+		pDSS_waithandle pWaitHandle;	// Wait handle the producer is blocked on
+		pblockedProducer pNext;			// Next blocked producer
+	} blockedProducer;
+
 // Structure for storing data from an async callback in the queue
 // NOTE: while waiting for 'poll' to be called it will be in the queue,
 //       while waiting for 'return' callback, it will be in a userdata
 typedef struct qItem {
-		putilRecord utilid;			// unique ID to utility
+		void* utilid;				// unique ID to utility (handle, not a pointer to the record)
+		pglobalRecord pGlobals;		// global record of the LuaState this item was delivered to
+		putilRecord pUtil;			// record of the utility, only valid while the item is on the queue or userdata list
 		pDSS_waithandle pWaitHandle; // Wait handle to block thread while wait for return to be called
+		pDSS_ticket pTicket;		// Ticket to complete instead, for asynchronous deliveries (no wait handle then)
+		BOOL volatile cancelled;	// set when the utility unregistered while the item was being decoded
+		int priority;				// priority level, the queue list the item is in
+		void* Key;					// coalescing key (see 'deliverkeyed'), NULL for none
+		BOOL Reserved;				// a spot was reserved for the item (not for a keyed one expected to replace another)
+		pQueueItem pKeyNext;		// Next item in the same bucket of the key index
+		DSS_time_t tDelivered;		// time the item was created
+		DSS_time_t tPolled;			// time the item was taken from the queue
 		void* pData;				// Data to be decoded
+		size_t PayloadSize;			// capacity of the inline payload buffer following the item
 		pQueueItem pNext;			// Next item in queue/list
 		pQueueItem pPrevious;		// Previous item in queue/list
-		pQueueItem* udata;			// a userdata containing a pointer to this qItem
+		pqueueRef udata;			// a userdata containing a reference to this qItem
 		// API functions at the end, so casting of future versions can be done
 		DSS_decoder_1v0_t pDecode;	// Pointer to the decode function, if NULL then it was already called
 		DSS_return_1v0_t pReturn;	// Pointer to the return function
+		DSS_batchdecoder_1v2_t pBatchDecode;	// batch decoder, only set on the first item of a batch being decoded
+		pQueueItem pBatch;			// further items of the batch, linked through pNext (see delivery_detach)
 	} QueueItem;
 
+// Inline payload buffers (see 'reserve' in the API) directly follow the
+// queue item in memory, aligned for any type
+#define DSS_PAYLOAD_ALIGN 16
+#define DSS_PAYLOAD_OFFSET ((sizeof(QueueItem) + DSS_PAYLOAD_ALIGN - 1) & ~((size_t)DSS_PAYLOAD_ALIGN - 1))
+#define DSS_PAYLOAD(pqi) ((void*)((char*)(pqi) + DSS_PAYLOAD_OFFSET))
+#define DSS_PAYLOAD_ITEM(payload) ((pQueueItem)((char*)(payload) - DSS_PAYLOAD_OFFSET))
+
 // structure for state global variables to be stored outside of the LuaState
 // this is required to be able to access them from an async callback
 // (which cannot call into lua to collect global data there)
 typedef struct stateGlobals {
-		//DSS_mutex_t lock;					// lock to protect struct data
+		DSS_mutex_t lock;					// lock to protect struct data (queue, lists and socket)
 		int volatile udpport;				// 0 = no notification
 		udpsocket_t socket;				// structure with socket data
+		fdsignal_t fdsignal;				// file descriptor signal, readfd == -1 = not in use
+		int volatile notifymode;			// DSS_NOTIFY_EACH or DSS_NOTIFY_COALESCED
+		DSS_atomic_t NotifyArmed;			// 1 if the next delivery must notify (coalesced mode only)
 		int volatile DSS_status;			// Status of library
+		// Elements for the lock-free delivery inbox (multi-producer, single consumer)
+		// producers push items here, the consumer collects them into the queue
+		pQueueItem volatile InboxHead;		// Last item pushed by a producer
+		pQueueItem InboxTail;				// Next item to be collected into the queue (consumer only)
+		QueueItem InboxStub;				// Stub item, the inbox always holds at least 1 item
 		// Elements for the async data queue
-		pQueueItem volatile QueueStart;		// Holds first element in the queue
-		pQueueItem volatile QueueEnd;		// Holds the last item in the queue
-		int volatile QueueCount;			// Count of items in queue
+		putilRecord Active[DSS_PRIORITY_LEVELS];	// Per level, ring of utilities with queued items, points to the next one to serve
+		int Credits[DSS_PRIORITY_LEVELS];	// Aging credits per level, earned while passed over with items
+		DSS_atomic_t QueueCount;			// Count of items in queue, including the inbox (and reserved spots)
+		pQueueItem KeyIndex[DSS_KEY_BUCKETS];	// Queued items with a coalescing key (including the inbox), by utility and key
+		// Elements for limiting the queue
+		int volatile MaxQueue;				// max number of queued items, 0 = unlimited
+		int volatile Policy;				// overflow policy when MaxQueue is reached
+		int volatile HighWater;				// queuesize at which the queue becomes congested, 0 = disabled
+		int volatile LowWater;				// queuesize at which the queue is no longer congested
+		DSS_atomic_t Congested;				// 1 if congested, deliveries will report DSS_ERR_CONGESTED
+		pblockedProducer BlockedStart;		// Producers blocked on a full queue
+		// Elements for the list of items being decoded (outside the lock)
+		pQueueItem volatile DecodingStart;	// Holds first element in the list
 		// Elements for the userdata list
 		pQueueItem volatile UserdataStart;  // Holds first element in the list
+		// Elements for the pool of recycled queue items (see pool.c)
+		DSS_mutex_t PoolLock;				// lock to protect the pool, separate from 'lock' as producers use it
+		pQueueItem PoolStart;				// Holds first free item, chained through 'pNext'
+		int PoolCount;						// Count of free items in the pool
+		int volatile PoolSize;				// Max number of free items to keep
+		DSS_atomic_t PoolHits;				// Count of items taken from the pool
+		DSS_atomic_t PoolMisses;			// Count of items allocated because the pool was empty
+		// Elements for statistics
+		dssStats Stats;						// runtime statistics, totals of all utilities
+		// Elements for shared consumer groups (see 'join'), a group has a record of its 
+		// own, not related to any LuaState. The group list and memberships are protected
+		// by 'dsslock', the list of members also by the lock of the group.
+		pglobalRecord pGroup;				// member; the group joined, NULL for none
+		pglobalRecord pMemberNext;			// member; next member of the same group
+		char* GroupName;					// group; name of the group, NULL if not a group
+		pglobalRecord pGroupNext;			// group; next group in the list of groups
+		pglobalRecord Members;				// group; list of member LuaStates
+		pglobalRecord pNotifyNext;			// group; member to notify next (they take turns)
 	} globalRecord;
 
 
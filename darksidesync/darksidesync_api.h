@@ -2,6 +2,7 @@
 #ifndef darksidesync_api_h
 #define darksidesync_api_h
 
+#include <stddef.h>
 #include <lua.h>
 
 // Setup version information
@@ -10,6 +11,8 @@
 #define DSS_REGISTRY_NAME "DSS.DarkSideSync"    // key to registry to where DSS will store its API's
 #define DSS_VERSION_KEY "Version"               // key to version info within DSS table
 #define DSS_API_1v0_KEY "DSS API 1v0"           // key to struct with this API version (within DSS table), also used as version string in API struct
+#define DSS_API_1v1_KEY "DSS API 1v1"           // key to struct with this API version (within DSS table), also used as version string in API struct
+#define DSS_API_1v2_KEY "DSS API 1v2"           // key to struct with this API version (within DSS table), also used as version string in API struct
 
 //////////////////////////////////////////////////////////////
 // IMPORTANT USAGE NOTES !!!!                               //
@@ -95,10 +98,19 @@ typedef void (*DSS_cancel_1v0_t) (void* utilid);
 // @arg3; pointer to a return function (see DSS_decoder_t above)
 // @arg4; pointer to some piece of data.
 // @returns; DSS_SUCCESS, DSS_ERR_INVALID_UTILID, DSS_ERR_UDP_SEND_FAILED, 
-// DSS_ERR_OUT_OF_MEMORY, DSS_ERR_NOT_STARTED, DSS_ERR_NO_DECODE_PROVIDED
+// DSS_ERR_OUT_OF_MEMORY, DSS_ERR_NOT_STARTED, DSS_ERR_NO_DECODE_PROVIDED,
+// DSS_ERR_QUEUE_FULL, DSS_ERR_ITEM_DROPPED, DSS_ERR_CONGESTED
 // NOTE1: DSS_ERR_UDP_SEND_FAILED means that the data was still delivered to the
 //        queue, only the notification failed, for the other errors, it will not be
 //        queued (see return codes for warnings vs errors).
+//        DSS_ERR_CONGESTED means delivered, but the queue is above its high
+//        watermark, the producer should slow down.
+//        DSS_ERR_ITEM_DROPPED means that the queue was full and an item was 
+//        cancelled (through its decoder, with a NULL lua_State) to make room, which
+//        might be the item being delivered (depends on the policy set from Lua).
+//        DSS_ERR_QUEUE_FULL means the queue was full, the item was not queued. 
+//        Depending on the policy set from Lua, the call might also block until
+//        there is room in the queue.
 // NOTE2: edgecase due to synchronization, when delivering while DSS is stopping
 //        DSS_ERR_INVALID_UTILID may be returned, even if cancel() was not called
 //        yet, so this should always be checked
@@ -124,7 +136,9 @@ typedef void* (*DSS_getutilid_1v0_t) (lua_State *L, void* libid, int* errcode);
 //        static void* myLibID = &myLibID;    // pointer to itself
 // @arg3; pointer to the background workers cancel() method
 // @arg4; int pointer that will receive the error code, or DSS_SUCCESS if no error (param may be NULL)
-// @returns; unique ID (for the utility to use in other calls), or NULL and error
+// @returns; unique ID (for the utility to use in other calls), or NULL and error.
+//           The ID is an opaque handle, not a pointer. Once unregistered, the ID
+//           will be rejected (DSS_ERR_INVALID_UTILID), even if the slot is reused.
 // DSS_ERR_NOT_STARTED, DSS_ERR_NO_CANCEL_PROVIDED, DSS_ERR_OUT_OF_MEMORY, DSS_ERR_ALREADY_REGISTERED
 // NOTE: if the utility was already registered, it will return the existing ID, 
 //       but it will ignore all provided parameters (nothing will be changed)
@@ -146,6 +160,272 @@ typedef struct DSS_api_1v0_s {
         DSS_unregister_1v0_t unreg;
     } DSS_api_1v0_t;
 
+//////////////////////////////////////////////////////////////
+// C side prototypes, implemented by DSS, added in API 1.1  //
+//////////////////////////////////////////////////////////////
+
+// Priority levels for deliveries
+#define DSS_PRIORITY_DEFAULT -1     // use the default priority of the utility (set from Lua)
+#define DSS_PRIORITY_HIGH 0
+#define DSS_PRIORITY_NORMAL 1       // default
+#define DSS_PRIORITY_LOW 2
+
+// Same as 'deliver', but with a priority level for the item. Higher priority
+// items are polled first. Lower priority items are not starved, they will
+// be polled once they have been passed over too many times.
+// @arg1; ID of utility delivering (see register() function)
+// @arg2; priority, one of the DSS_PRIORITY_xxx values
+// @arg3; pointer to a decoder function (see DSS_decoder_t above)
+// @arg4; pointer to a return function (see DSS_decoder_t above)
+// @arg5; pointer to some piece of data.
+// @returns; same as 'deliver', and DSS_ERR_INVALID_PRIORITY
+typedef int (*DSS_deliverprio_1v1_t) (void* utilid, int priority, DSS_decoder_1v0_t pDecode, DSS_return_1v0_t pReturn, void* pData);
+
+// Reserves a spot in the queue, for an item with an inline payload buffer of 
+// 'size' bytes, owned by DSS. The producer fills the buffer in place, and then
+// delivers it using 'commit' (or releases it using 'abort'). The decoder
+// and return functions receive the buffer as 'pData'. DSS releases the buffer
+// together with the item, so the functions must NOT free it (but must release
+// anything the buffer refers to). This saves an allocation per delivery.
+// @arg1; ID of utility delivering (see register() function)
+// @arg2; priority, one of the DSS_PRIORITY_xxx values
+// @arg3; size of the payload buffer in bytes
+// @arg4; pointer to a decoder function (see DSS_decoder_t above)
+// @arg5; pointer to a return function (see DSS_decoder_t above)
+// @arg6; int pointer that will receive the error code, or DSS_SUCCESS if no error (param may be NULL)
+// @returns; pointer to the payload buffer (aligned for any type), or NULL and error.
+// Errors are the same as for 'deliverprio', except that the 'dropnewest' policy
+// results in DSS_ERR_QUEUE_FULL (there is nothing to cancel yet). If a buffer is 
+// returned, the error might still be DSS_ERR_ITEM_DROPPED (another item was dropped
+// to make room).
+// NOTE: between 'reserve' and 'commit/abort' unregistering the utility waits for
+//       the item to be committed or aborted, so fill the buffer right away, and do
+//       not unregister from the same thread in between.
+typedef void* (*DSS_reserve_1v1_t) (void* utilid, int priority, size_t size, DSS_decoder_1v0_t pDecode, DSS_return_1v0_t pReturn, int* errcode);
+
+// Delivers a reserved item (see 'reserve') to the queue. Must be called from
+// the same thread that reserved it.
+// @arg1; the payload buffer returned by 'reserve'
+// @returns; DSS_SUCCESS, DSS_ERR_UDP_SEND_FAILED, DSS_ERR_CONGESTED, or 
+// DSS_ERR_INVALID_UTILID if the utility was unregistered after the reservation. In
+// that case the item is cancelled (the decoder is called with a NULL lua_State).
+// NOTE: same as 'deliver', if a 'return' callback was provided, the thread will
+//       be blocked until the DSS process for this item is complete. The buffer
+//       has been released by then, so the 'return' callback must store any 
+//       results elsewhere.
+typedef int (*DSS_commit_1v1_t) (void* payload);
+
+// Releases a reserved item (see 'reserve'), without delivering it. Must be 
+// called from the same thread that reserved it. No callbacks are called.
+// @arg1; the payload buffer returned by 'reserve'
+typedef void (*DSS_abort_1v1_t) (void* payload);
+
+// Typed event value tags, a character per value in the format of 'deliverevent'
+// NOTE: the arguments MUST have exactly the type listed, so cast them if required
+#define DSS_EVENT_INTEGER 'i'       // long long
+#define DSS_EVENT_NUMBER 'n'        // double
+#define DSS_EVENT_BOOLEAN 'b'       // int
+#define DSS_EVENT_STRING 's'        // const char*, zero terminated (copied), NULL delivers nil
+#define DSS_EVENT_LSTRING 'l'       // 2 arguments; const char* and size_t length (copied)
+
+// Delivers a typed event, without a decoder of its own. The values are copied 
+// into the queue (see 'reserve', no allocations for small events), and when
+// polled DSS pushes them to Lua, as arguments for the handler set for the library
+// from Lua (see 'sethandler' on the Lua side). Events never wait for a result.
+// @arg1; ID of utility delivering (see register() function)
+// @arg2; priority, one of the DSS_PRIORITY_xxx values
+// @arg3; format, a DSS_EVENT_xxx character for each value that follows
+// @arg4+; the values
+// @returns; same as 'deliverprio', and DSS_ERR_INVALID_EVENT if the format is 
+// invalid, DSS_ERR_NO_DECODE_PROVIDED if no Lua handler was set
+// Example:
+//   api->deliverevent(utilid, DSS_PRIORITY_DEFAULT, "isb", (long long)42, "hello", 1);
+typedef int (*DSS_deliverevent_1v1_t) (void* utilid, int priority, const char* format, ...);
+
+// Ticket states, see 'deliverasync'
+#define DSS_TICKET_PENDING 0        // waiting for Lua
+#define DSS_TICKET_COMPLETED 1      // Lua called `waitingthread_callback` (without a 'return' callback; the item was polled)
+#define DSS_TICKET_CANCELLED 2      // the item was cancelled, there is no result from Lua
+
+// The backgroundworker may provide this function when delivering
+// asynchronously (see 'deliverasync'). It is called once the ticket completes,
+// after the 'return' callback (if that is called at all).
+// @arg1; the ticket
+// @arg2; the pData previously delivered
+// @arg3; the unique utility ID for which the call is being made
+// @arg4; ticket state, DSS_TICKET_COMPLETED or DSS_TICKET_CANCELLED
+// NOTE: it is called from the Lua thread, or the thread cancelling the item, 
+//       possibly while DSS holds its locks; it must not block or make any DSS 
+//       calls, except for releasing the ticket.
+typedef void (*DSS_complete_1v1_t) (void* ticket, void* pData, void* utilid, int state);
+
+// Same as 'deliverprio', but does not block the thread until Lua has handled
+// the item. It returns a ticket immediately, that completes when the item is
+// done. The 'return' callback is still called from Lua (so 'pData' must remain
+// valid until then, and should not be on the stack of the calling thread). 
+// The thread can check or wait for completion (see 'waitticket'), or have a
+// completion function called.
+// @arg1; ID of utility delivering (see register() function)
+// @arg2; priority, one of the DSS_PRIORITY_xxx values
+// @arg3; pointer to a decoder function (see DSS_decoder_t above)
+// @arg4; pointer to a return function (see DSS_decoder_t above), may be NULL
+// @arg5; pointer to a completion function (see DSS_complete_1v1_t above), may be NULL
+// @arg6; pointer to some piece of data.
+// @arg7; int pointer that will receive the error code, or DSS_SUCCESS if no error (param may be NULL)
+// @returns; the ticket, or NULL and error. Errors are the same as for 'deliverprio'.
+// If a ticket is returned, the error might still be a warning.
+// NOTE: the ticket MUST be released with 'releaseticket', when no longer needed.
+//       If the delivery fails no ticket is returned, and the completion function 
+//       is not called.
+typedef void* (*DSS_deliverasync_1v1_t) (void* utilid, int priority, DSS_decoder_1v0_t pDecode, DSS_return_1v0_t pReturn, DSS_complete_1v1_t pComplete, void* pData, int* errcode);
+
+// Waits for a ticket to complete (see 'deliverasync'). Only a single thread
+// may wait on a ticket at a time.
+// @arg1; the ticket
+// @arg2; maximum time to wait in milliseconds, 0 to check without waiting, 
+//        or < 0 to wait until completed
+// @returns; the ticket state, one of DSS_TICKET_xxx
+typedef int (*DSS_waitticket_1v1_t) (void* ticket, int timeout);
+
+// Releases a ticket (see 'deliverasync'), the ticket may be released before it
+// has completed (the completion function will still be called).
+// @arg1; the ticket
+typedef void (*DSS_releaseticket_1v1_t) (void* ticket);
+
+// Same as 'deliverprio', but with a 'return' callback the thread waits at most 
+// 'timeout' milliseconds for Lua to complete the item. Upon a timeout the item is
+// cancelled; if still queued it will be dropped when polled (it no longer
+// counts against the queue limits), and if Lua calls the 
+// `waitingthread_callback` later, the answer is discarded. In both cases neither
+// the decoder nor the 'return' callback will be called anymore, so the
+// thread must release any resources of 'pData' itself.
+// @arg1; ID of utility delivering (see register() function)
+// @arg2; priority, one of the DSS_PRIORITY_xxx values
+// @arg3; pointer to a decoder function (see DSS_decoder_t above)
+// @arg4; pointer to a return function (see DSS_decoder_t above)
+// @arg5; pointer to some piece of data.
+// @arg6; maximum time to wait in milliseconds, < 0 to wait until completed
+// @returns; same as 'deliverprio', and DSS_ERR_TIMEOUT
+// NOTE: the decoder or 'return' callback may be running when the timeout 
+//       expires, in that case the call returns once it is done (and the item
+//       might complete instead).
+typedef int (*DSS_delivertimeout_1v1_t) (void* utilid, int priority, DSS_decoder_1v0_t pDecode, DSS_return_1v0_t pReturn, void* pData, int timeout);
+
+// Same as 'deliverprio', but with a coalescing key. If an item of the utility 
+// with the same key is still queued, it is replaced by the new one, so Lua only
+// gets the latest. The new item takes the place (in the queue) of the old one,
+// and the old one is cancelled through its decoder (with a NULL lua_State). 
+// The queue holds at most one item per key, regardless of the delivery rate.
+// @arg1; ID of utility delivering (see register() function)
+// @arg2; priority, one of the DSS_PRIORITY_xxx values (a replacing item keeps 
+//        the priority of the item it replaces)
+// @arg3; coalescing key, any value identifying the items that replace each 
+//        other (eg. a node number cast to a pointer), NULL for no coalescing
+// @arg4; pointer to a decoder function (see DSS_decoder_t above)
+// @arg5; pointer to a return function (see DSS_decoder_t above)
+// @arg6; pointer to some piece of data.
+// @returns; same as 'deliverprio'
+// NOTE: an item replacing another does not take a spot in the queue, so it is
+//       never rejected (or blocked) by the queue limits.
+typedef int (*DSS_deliverkeyed_1v1_t) (void* utilid, int priority, void* key, DSS_decoder_1v0_t pDecode, DSS_return_1v0_t pReturn, void* pData);
+
+// Define structure to contain the API for version 1.1
+// NOTE: it starts with the 1.0 API, so it can be cast to that version
+typedef struct DSS_api_1v1_s *pDSS_api_1v1_t;
+typedef struct DSS_api_1v1_s {
+        const char* version;
+        DSS_register_1v0_t reg;
+        DSS_getutilid_1v0_t getutilid;
+        DSS_deliver_1v0_t deliver;
+        DSS_unregister_1v0_t unreg;
+        // added in 1.1
+        DSS_deliverprio_1v1_t deliverprio;
+        DSS_reserve_1v1_t reserve;
+        DSS_commit_1v1_t commit;
+        DSS_abort_1v1_t abort;
+        DSS_deliverevent_1v1_t deliverevent;
+        DSS_deliverasync_1v1_t deliverasync;
+        DSS_waitticket_1v1_t waitticket;
+        DSS_releaseticket_1v1_t releaseticket;
+        DSS_delivertimeout_1v1_t delivertimeout;
+        DSS_deliverkeyed_1v1_t deliverkeyed;
+    } DSS_api_1v1_t;
+
+
+//////////////////////////////////////////////////////////////
+// C side prototypes, implemented by DSS, added in API 1.2  //
+//////////////////////////////////////////////////////////////
+
+// An item in a batch delivery (see 'deliverbatch')
+typedef struct DSS_batchitem_1v2_s {
+        DSS_decoder_1v0_t pDecode;  // pointer to a decoder function (see DSS_decoder_t above)
+        void* pData;                // pointer to some piece of data
+    } DSS_batchitem_1v2_t;
+
+// Delivers a batch of items at once, eg. the events from a single network packet.
+// The utility is validated once, the items are added to the queue in a single
+// step (in order), and at most one notification is sent. All items are 
+// delivered, or none. Items in a batch do not wait for a result (there is no
+// 'return' callback).
+// @arg1; ID of utility delivering (see register() function)
+// @arg2; priority, one of the DSS_PRIORITY_xxx values
+// @arg3; array of items to deliver, may be reused once the call returns
+// @arg4; number of items in the array
+// @returns; same as 'deliverprio'. If the queue limit does not leave room for
+// the entire batch, the overflow policy applies to the batch as a whole; with 
+// 'dropnewest' all items are cancelled (DSS_ERR_ITEM_DROPPED), and a batch 
+// larger than the limit is rejected (DSS_ERR_QUEUE_FULL).
+typedef int (*DSS_deliverbatch_1v2_t) (void* utilid, int priority, DSS_batchitem_1v2_t* items, int count);
+
+// Batch decoder, decodes a number of queued items in a single call (see 'setbatchdecoder').
+// Works like the decoder (see DSS_decoder_t above), but gets the data of all
+// items, in order of delivery, so it can push a single Lua callback with a single
+// table holding all of them. Once called the items are complete, so it must 
+// release the resources of all of them. The array is only valid during the call.
+// @arg1; pointer to the lua_State, never NULL (cancelled items are cancelled 
+// through their own decoder)
+// @arg2; array with the data of the items
+// @arg3; number of items in the array, at least 1
+// @arg4; ID of utility (see register() function)
+// @returns; number of values on the stack, see DSS_decoder_t
+typedef int (*DSS_batchdecoder_1v2_t) (lua_State *L, void** pData, int count, void* utilid);
+
+// Sets a batch decoder for a utility. When polled, the queued items of the 
+// utility that were delivered with the given decoder are decoded together, 
+// through the batch decoder, so Lua gets one callback per batch instead of
+// one per item. Only items without a 'return' callback or ticket are batched,
+// other items are decoded as usual. For the limits of the Lua side 'pollmany' 
+// and 'dispatch' functions a batch counts as a single item.
+// @arg1; ID of utility (see register() function)
+// @arg2; the decoder of the items to batch, it is still used to cancel them
+// @arg3; the batch decoder, or NULL to remove it
+// @returns; DSS_SUCCESS, DSS_ERR_INVALID_UTILID, DSS_ERR_NO_DECODE_PROVIDED
+typedef int (*DSS_setbatchdecoder_1v2_t) (void* utilid, DSS_decoder_1v0_t pDecode, DSS_batchdecoder_1v2_t pBatchDecode);
+
+// Define structure to contain the API for version 1.2
+// NOTE: it starts with the 1.1 API, so it can be cast to that version
+typedef struct DSS_api_1v2_s *pDSS_api_1v2_t;
+typedef struct DSS_api_1v2_s {
+        const char* version;
+        DSS_register_1v0_t reg;
+        DSS_getutilid_1v0_t getutilid;
+        DSS_deliver_1v0_t deliver;
+        DSS_unregister_1v0_t unreg;
+        // added in 1.1
+        DSS_deliverprio_1v1_t deliverprio;
+        DSS_reserve_1v1_t reserve;
+        DSS_commit_1v1_t commit;
+        DSS_abort_1v1_t abort;
+        DSS_deliverevent_1v1_t deliverevent;
+        DSS_deliverasync_1v1_t deliverasync;
+        DSS_waitticket_1v1_t waitticket;
+        DSS_releaseticket_1v1_t releaseticket;
+        DSS_delivertimeout_1v1_t delivertimeout;
+        DSS_deliverkeyed_1v1_t deliverkeyed;
+        // added in 1.2
+        DSS_deliverbatch_1v2_t deliverbatch;
+        DSS_setbatchdecoder_1v2_t setbatchdecoder;
+    } DSS_api_1v2_t;
 
 //////////////////////////////////////////////////////////////
 // C side DSS return codes                                  //
@@ -155,7 +435,9 @@ typedef struct DSS_api_1v0_s {
 //          was not send, but the element was handled properly.
 #define DSS_SUCCESS -100                // success
 // Warnings > DSS_SUCCESS
-#define DSS_ERR_UDP_SEND_FAILED -99     // notification failed due to UDP/socket error
+#define DSS_ERR_UDP_SEND_FAILED -99     // notification failed due to UDP/socket or file descriptor error
+#define DSS_ERR_ITEM_DROPPED -98        // queue was full, an item was cancelled to make room
+#define DSS_ERR_CONGESTED -97           // queue is above its high watermark
 // Errors < DSS_SUCCESS
 #define DSS_ERR_INVALID_UTILID -101     // provided ID does not exist/invalid
 #define DSS_ERR_NOT_STARTED -102        // DSS hasn't been started, or was already stopping/stopped
@@ -165,4 +447,8 @@ typedef struct DSS_api_1v0_s {
 #define DSS_ERR_NO_GLOBALS -106         // LuaState does not have a global record
 #define DSS_ERR_UNKNOWN_LIB -107        // The library requesting its utildid is unregistered
 #define DSS_ERR_ALREADY_REGISTERED -108 // trying to register the same lib, in the same lua state again
+#define DSS_ERR_QUEUE_FULL -109         // queue limit reached, the item was not queued
+#define DSS_ERR_INVALID_PRIORITY -110   // the priority provided is not a valid priority level
+#define DSS_ERR_INVALID_EVENT -111      // the format of a typed event is invalid
+#define DSS_ERR_TIMEOUT -112            // Lua did not complete the item in time, it was cancelled
 #endif /* darksidesync_api_h */
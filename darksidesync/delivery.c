@@ -1,23 +1,28 @@
 #include "delivery.h"
+#include "pool.h"
 
 // New constructor
-// Creates a element for delivery and places it in the queue, waiting for a
-// poll to arrive. Creates the waithandle if required and sends the UDP
-// notification if set.
+// Creates a element for delivery, ready to be placed in the queue, waiting for a
+// poll to arrive. The element is taken from the pool of the LuaState, a waithandle
+// (if required) from the cache of the calling thread. The thread must hand the 
+// waithandle back using DSS_waithandle_release() after waiting on it.
 //
+// @payloadsize; if > 0, the item gets an inline payload buffer of this size, 
+//           which is used as 'pData' (the 'pData' argument is ignored)
+// @ticket;  ticket for an asynchronous delivery, completed when the item is
+//           done, instead of releasing a waiting thread (so no waithandle)
 // @returns; NULL if it failed
-// @err;     DSS_SUCCESS, DSS_ERR_UDP_SEND_FAILED, DSS_ERR_INVALID_UTILID,
+// @err;     DSS_SUCCESS, DSS_ERR_INVALID_UTILID,
 //           DSS_ERR_OUT_OF_MEMORY, DSS_ERR_NOT_STARTED
 //
 // Notes:
-//    * if it returns an element, the result may still be a warning (see return codes; errors vs warnings)
-//    * Utilid MUST be valid before calling
+//    * Utility record MUST be valid before calling
+//    * use delivery_enqueue to store the item, and delivery_notify to send the notification
 
-pQueueItem delivery_new(putilRecord utilid, DSS_decoder_1v0_t pDecode, DSS_return_1v0_t pReturn, void* pData, int* err)
+pQueueItem delivery_new(putilRecord util, int priority, DSS_decoder_1v0_t pDecode, DSS_return_1v0_t pReturn, void* pData, size_t payloadsize, pDSS_ticket ticket, int* err)
 {
 	pglobalRecord g;
 	int result;
-	char buff[20];
 	pDSS_waithandle wh = NULL;
 	pQueueItem pqi = NULL;
 
@@ -25,7 +30,7 @@ pQueueItem delivery_new(putilRecord utilid, DSS_decoder_1v0_t pDecode, DSS_retur
 	if (err == NULL) err = &result;
 	*err = DSS_SUCCESS;
 
-	g = utilid->pGlobals;	
+	g = util->pGlobals;	
 	if (g->DSS_status != DSS_STATUS_STARTED)
 	{
 		// lib not started yet (or stopped already), exit
@@ -33,172 +38,1077 @@ pQueueItem delivery_new(putilRecord utilid, DSS_decoder_1v0_t pDecode, DSS_retur
 		return NULL;
 	}
 
-	if (NULL == (pqi = (pQueueItem)malloc(sizeof(QueueItem))))
+	if (NULL == (pqi = pool_getitem(g, payloadsize)))
 	{
 		*err = DSS_ERR_OUT_OF_MEMORY;
 		return NULL;	// exit, memory alloc failed
 	}
 
-	if (pReturn != NULL)	// only create waithandle if a return function specified
+	if (pReturn != NULL && ticket == NULL)	// only get a waithandle if a return function specified
 	{
-		wh = DSS_waithandle_create();
+		wh = DSS_waithandle_acquire();	// the cached one of this thread, if available
 		if (wh == NULL)
 		{
 			// error, resource alloc failed
-			free(pqi);
+			pool_putitem(g, pqi);
 			*err = DSS_ERR_OUT_OF_MEMORY; 
 			return NULL; 
 		}
 	}
 
 	pqi->pWaitHandle = wh;
-	pqi->utilid = utilid;
+	pqi->pTicket = ticket;
+	pqi->utilid = util->utilid;
+	pqi->pGlobals = g;
+	pqi->pUtil = util;
+	pqi->priority = priority;
+	pqi->Key = NULL;
+	pqi->Reserved = TRUE;
+	pqi->pKeyNext = NULL;
+	pqi->tDelivered = histogram_now();
+	pqi->tPolled = 0;
+	pqi->cancelled = FALSE;
 	pqi->pDecode = pDecode;
 	pqi->pReturn = pReturn;
-	pqi->pData = pData;
+	pqi->pData = (payloadsize > 0 ? DSS_PAYLOAD(pqi) : pData);
 	pqi->pNext = NULL;
 	pqi->pPrevious = NULL;
 	pqi->udata = NULL;
+	pqi->pBatchDecode = NULL;
+	pqi->pBatch = NULL;
+
+	return pqi;	
+};
+
+// Completes the transaction of an item; releases the waiting thread, or
+// completes the ticket of an asynchronous delivery
+// @state; DSS_TICKET_COMPLETED or DSS_TICKET_CANCELLED
+static void delivery_complete(pQueueItem pqi, void* pData, int state)
+{
+	if (pqi->pWaitHandle != NULL)
+	{
+		DSS_waithandle_signal(pqi->pWaitHandle);
+		pqi->pWaitHandle = NULL;
+	}
+	if (pqi->pTicket != NULL)
+	{
+		ticket_complete(pqi->pTicket, pData, pqi->utilid, state);
+		pqi->pTicket = NULL;
+	}
+}
+
+/*
+** ===============================================================
+** Delivery inbox
+** ===============================================================
+*/
+// The inbox is an intrusive multi-producer/single-consumer queue (see
+// http://www.1024cores.net/home/lock-free-algorithms/queues/intrusive-mpsc-node-based-queue ).
+// Producers push items without locking, linking them through 'pNext'. The 
+// consumer (holding the lock) collects them in order and moves them into 
+// the regular (doubly linked) queue.
+// The inbox is never empty, it always holds at least the 'InboxStub' item.
+
+// Pushes a chain of items (linked through pNext) onto the inbox
+static void delivery_push(pglobalRecord g, pQueueItem first, pQueueItem last)
+{
+	pQueueItem prev;
+
+	DSS_atomic_setptr((void* volatile*)&(last->pNext), NULL);
+	prev = (pQueueItem)DSS_atomic_swapptr((void* volatile*)&(g->InboxHead), last);
+	// from here until the next line the chain is detached, see delivery_collect()
+	DSS_atomic_setptr((void* volatile*)&(prev->pNext), first);
+}
+
+// Initializes the inbox, should be called before any delivery is made
+void delivery_initinbox(pglobalRecord g)
+{
+	g->InboxStub.pNext = NULL;
+	g->InboxHead = &(g->InboxStub);
+	g->InboxTail = &(g->InboxStub);
+}
+
+// Reserves spots in the queue for new items, by counting them upfront, 
+// against the limits of the utility and the LuaState. Lock-free.
+// @count; number of spots to reserve, all or nothing
+// returns; DSS_LIMIT_NONE if reserved, or DSS_LIMIT_UTIL/DSS_LIMIT_STATE 
+// for the limit that was reached (nothing reserved then)
+// NOTE: the reservation must be used by delivery_enqueue, or undone 
+//       with delivery_unreserve
+int delivery_reserve(putilRecord util, int count)
+{
+	pglobalRecord g = util->pGlobals;
+	long total;
+	long ucount;
+
+	ucount = DSS_atomic_add(&(util->QueueCount), count);
+	if (util->MaxQueue > 0 && ucount > util->MaxQueue)
+	{
+		DSS_atomic_add(&(util->QueueCount), -count);
+		return DSS_LIMIT_UTIL;
+	}
+
+	total = DSS_atomic_add(&(g->QueueCount), count);
+	if (g->MaxQueue > 0 && total > g->MaxQueue)
+	{
+		DSS_atomic_add(&(g->QueueCount), -count);
+		DSS_atomic_add(&(util->QueueCount), -count);
+		return DSS_LIMIT_STATE;
+	}
+
+	if (g->HighWater > 0 && total >= g->HighWater) DSS_atomic_swap(&(g->Congested), 1);
+	DSS_atomic_max(&(util->Stats.PeakQueue), ucount);
+	DSS_atomic_max(&(g->Stats.PeakQueue), total);
+	return DSS_LIMIT_NONE;
+}
+
+// Undoes a reservation made with delivery_reserve
+// @count; number of spots reserved
+void delivery_unreserve(putilRecord util, int count)
+{
+	pglobalRecord g = util->pGlobals;
+
+	DSS_mutex_lock(&(g->lock));
+	DSS_atomic_add(&(util->QueueCount), -count);
+	DSS_atomic_add(&(g->QueueCount), -count);
+	delivery_wakeblocked(g);
+	DSS_mutex_unlock(&(g->lock));
+}
+
+// Stores a new item in the inbox. Lock-free, can be called by
+// any number of threads simultaneously.
+// NOTE: a spot must have been reserved using delivery_reserve
+// NOTE: after this call the item is owned by the queue, it may be
+//       polled and destroyed at any time, so do not access it anymore!
+void delivery_enqueue(pQueueItem pqi)
+{
+	delivery_push(pqi->pGlobals, pqi, pqi);
+}
+
+// Stores a chain of new items (linked through pNext) in the inbox, in a 
+// single step. Lock-free, see delivery_enqueue.
+// NOTE: a spot must have been reserved for each item
+void delivery_enqueuemany(pQueueItem first, pQueueItem last)
+{
+	delivery_push(first->pGlobals, first, last);
+}
+
+// Returns the bucket of the key index for a key of a utility
+static int delivery_keybucket(putilRecord util, void* key)
+{
+	size_t h = (size_t)key ^ ((size_t)util >> 4);
+	h = h ^ (h >> 7) ^ (h >> 15);
+	return (int)(h & (DSS_KEY_BUCKETS - 1));
+}
+
+// Removes an item from the key index
+// NOTE: caller must hold the lock
+static void delivery_unindex(pglobalRecord g, pQueueItem pqi)
+{
+	pQueueItem* link = &(g->KeyIndex[delivery_keybucket(pqi->pUtil, pqi->Key)]);
+
+	while (*link != NULL && *link != pqi) link = &((*link)->pKeyNext);
+	if (*link != NULL) *link = pqi->pKeyNext;
+	pqi->pKeyNext = NULL;
+}
+
+// Adds a utility to the ring of utilities with items at a level. It is
+// added just before the one to serve next, so it is served last.
+// NOTE: caller must hold the lock
+static void delivery_activate(pglobalRecord g, putilRecord util, int level)
+{
+	putilRecord next = g->Active[level];
 
-	if (g->QueueStart == NULL)
+	if (next == NULL)
 	{
-		// first item in queue
-		g->QueueStart = pqi;
-		g->QueueEnd = pqi;
+		// first one, a ring of its own
+		util->pActiveNext[level] = util;
+		util->pActivePrevious[level] = util;
+		g->Active[level] = util;
 	}
 	else
 	{
-		// append to queue
-		g->QueueEnd->pNext = pqi;
-		pqi->pPrevious = g->QueueEnd;
-		g->QueueEnd = pqi;
+		util->pActiveNext[level] = next;
+		util->pActivePrevious[level] = next->pActivePrevious[level];
+		next->pActivePrevious[level]->pActiveNext[level] = util;
+		next->pActivePrevious[level] = util;
 	}
+}
+
+// Removes a utility from the ring of utilities with items at a level
+// NOTE: caller must hold the lock
+static void delivery_deactivate(pglobalRecord g, putilRecord util, int level)
+{
+	if (util->pActiveNext[level] == util)
+	{
+		// last one, the ring is now empty
+		g->Active[level] = NULL;
+	}
+	else
+	{
+		if (g->Active[level] == util) g->Active[level] = util->pActiveNext[level];
+		util->pActivePrevious[level]->pActiveNext[level] = util->pActiveNext[level];
+		util->pActiveNext[level]->pActivePrevious[level] = util->pActivePrevious[level];
+	}
+	util->pActiveNext[level] = NULL;
+	util->pActivePrevious[level] = NULL;
+}
+
+// Appends an item to the queue list of its utility and priority level
+// NOTE: caller must hold the lock
+static void delivery_append(pglobalRecord g, pQueueItem pqi)
+{
+	queueList* list = &(pqi->pUtil->Queue[pqi->priority]);
+
+	pqi->pNext = NULL;
+	pqi->pPrevious = list->End;
+	if (list->End == NULL)
+	{
+		list->Start = pqi;
+		delivery_activate(g, pqi->pUtil, pqi->priority);
+	}
+	else
+		list->End->pNext = pqi;
+	list->End = pqi;
+}
+
+// Removes an item from the queue list of its utility and priority level
+// NOTE: caller must hold the lock
+static void delivery_unlink(pglobalRecord g, pQueueItem pqi)
+{
+	queueList* list = &(pqi->pUtil->Queue[pqi->priority]);
+
+	if (pqi->Key != NULL) delivery_unindex(g, pqi);
+	if (pqi == list->Start) list->Start = pqi->pNext;
+	if (pqi == list->End) list->End = pqi->pPrevious;
+	if (pqi->pPrevious != NULL) pqi->pPrevious->pNext = pqi->pNext;
+	if (pqi->pNext != NULL) pqi->pNext->pPrevious = pqi->pPrevious;
+	pqi->pNext = NULL;
+	pqi->pPrevious = NULL;
+	if (list->Start == NULL) delivery_deactivate(g, pqi->pUtil, pqi->priority);
+}
+
+// Checks whether the queue is empty (the inbox is not checked)
+// NOTE: caller must hold the lock
+BOOL delivery_isempty(pglobalRecord g)
+{
+	int level;
+	for (level = 0; level < DSS_PRIORITY_LEVELS; level++)
+		if (g->Active[level] != NULL) return FALSE;
+	return TRUE;
+}
+
+// Selects the priority level to take the next item from. Higher levels go
+// first, but a level with items earns a credit every time it is passed over.
+// Once it has DSS_PRIORITY_AGING credits it goes first, so lower levels 
+// cannot starve, regardless of the load on higher levels.
+// returns; the level, or -1 if the queue is empty
+// NOTE: caller must hold the lock
+static int delivery_nextlevel(pglobalRecord g)
+{
+	int level;
+	int next = -1;
 
-	g->QueueCount += 1;
+	// an aged level goes first
+	for (level = 1; level < DSS_PRIORITY_LEVELS && next == -1; level++)
+		if (g->Active[level] != NULL && g->Credits[level] >= DSS_PRIORITY_AGING) next = level;
+	// otherwise the highest level with items
+	for (level = 0; level < DSS_PRIORITY_LEVELS && next == -1; level++)
+		if (g->Active[level] != NULL) next = level;
+	if (next == -1) return -1;
 
-	sprintf(buff, " %d", g->QueueCount);	// convert to string
+	// update credits of the levels passed over
+	g->Credits[next] = 0;
+	for (level = next + 1; level < DSS_PRIORITY_LEVELS; level++)
+	{
+		if (g->Active[level] != NULL)
+			g->Credits[level] = g->Credits[level] + 1;
+		else
+			g->Credits[level] = 0;
+	}
+	return next;
+}
+
+// Takes the next item from the queue. Within a priority level the utilities
+// take turns, one item each, so a single utility cannot monopolize the queue.
+// @util; only take items of this utility, or NULL for any item. Items of a
+// single utility are taken by priority, without aging.
+// returns; the item (unlinked), or NULL if there are none
+// NOTE: caller must hold the lock
+static pQueueItem delivery_take(pglobalRecord g, putilRecord util)
+{
+	pQueueItem pqi;
+	int level;
+
+	if (util != NULL)
+	{
+		for (level = 0; level < DSS_PRIORITY_LEVELS; level++)
+		{
+			pqi = util->Queue[level].Start;
+			if (pqi != NULL)
+			{
+				delivery_unlink(g, pqi);
+				return pqi;
+			}
+		}
+		return NULL;
+	}
+
+	level = delivery_nextlevel(g);
+	if (level == -1) return NULL;	// queue is empty
+	util = g->Active[level];
+	pqi = util->Queue[level].Start;
+	// move on to the next utility, before unlinking might remove this one from the ring
+	g->Active[level] = util->pActiveNext[level];
+	delivery_unlink(g, pqi);
+	return pqi;
+}
+
+// Releases all producers blocked on a full queue, they will retry
+// NOTE: caller must hold the lock
+void delivery_wakeblocked(pglobalRecord g)
+{
+	pblockedProducer bp = g->BlockedStart;
+	pblockedProducer next;
+
+	g->BlockedStart = NULL;
+	while (bp != NULL)
+	{
+		next = bp->pNext;	// read before signalling, the record lives on the producers stack
+		DSS_waithandle_signal(bp->pWaitHandle);
+		bp = next;
+	}
+}
+
+// Updates the counts after items were taken from the queue (by detaching
+// or cancelling), clears the congestion and releases blocked producers.
+// Items with an abandoned ticket were uncounted already (see delivery_abandon).
+// NOTE: caller must hold the lock
+static void delivery_uncount(pglobalRecord g, pQueueItem first, int count)
+{
+	pQueueItem pqi = first;
+	int i;
+	int n = count;
+
+	for (i = 0; i < count; i++)
+	{
+		if (pqi->pTicket == NULL || DSS_atomic_swap(&(pqi->pTicket->Queued), 0) == 1)
+			DSS_atomic_add(&(pqi->pUtil->QueueCount), -1);
+		else
+			n = n - 1;
+		pqi = pqi->pNext;
+	}
+	if (DSS_atomic_add(&(g->QueueCount), -n) <= g->LowWater) DSS_atomic_swap(&(g->Congested), 0);
+	if (g->BlockedStart != NULL) delivery_wakeblocked(g);
+}
+
+// Releases the spot in the queue of an item, after its producer abandoned
+// the ticket (see ticket_abandon). The item stays queued until polled (it
+// is dropped then), but no longer counts against the limits. 
+// @util; the utility that delivered the item
+// NOTE: the spot is released only once, either here or by delivery_uncount
+void delivery_abandon(putilRecord util, pDSS_ticket ticket)
+{
+	pglobalRecord g = util->pGlobals;
+
+	if (DSS_atomic_swap(&(ticket->Queued), 0) == 0) return;	// taken from the queue already
+	DSS_mutex_lock(&(g->lock));
+	DSS_atomic_add(&(util->QueueCount), -1);
+	if (DSS_atomic_add(&(g->QueueCount), -1) <= g->LowWater) DSS_atomic_swap(&(g->Congested), 0);
+	if (g->BlockedStart != NULL) delivery_wakeblocked(g);
+	DSS_mutex_unlock(&(g->lock));
+}
+
+// Takes the oldest item of a utility from the queue, to make room for a new 
+// one. Items of the lowest priority level are dropped first. The item is 
+// counted as cancelled, but the caller must cancel it after releasing the 
+// lock, using delivery_decodedetached(pqi, NULL), so its decoder does not
+// run while holding the lock.
+// @util; only consider items of this utility, or NULL to take them from the 
+// utility with the most items queued (at the lowest level holding items)
+// returns; the item taken, or NULL if there were none (only reserved spots, 
+// for which the items are still being delivered)
+// NOTE: caller must hold the lock
+pQueueItem delivery_dropoldest(pglobalRecord g, putilRecord util)
+{
+	pQueueItem pqi;
+	putilRecord other;
+	int level;
+
+	delivery_collect(g);
+	// lowest priority goes first
+	for (level = DSS_PRIORITY_LEVELS - 1; level >= 0; level--)
+	{
+		if (util == NULL && g->Active[level] != NULL)
+		{
+			// find the biggest producer at this level
+			util = g->Active[level];
+			other = util->pActiveNext[level];
+			while (other != g->Active[level])
+			{
+				if (DSS_atomic_get(&(other->QueueCount)) > DSS_atomic_get(&(util->QueueCount))) util = other;
+				other = other->pActiveNext[level];
+			}
+		}
+		if (util != NULL && util->Queue[level].Start != NULL)
+		{
+			pqi = util->Queue[level].Start;
+			DSS_STATS_INC(pqi->pUtil, Cancelled);
+			delivery_unlink(g, pqi);
+			delivery_uncount(g, pqi, 1);
+			return pqi;
+		}
+	}
+	return NULL;
+}
+
+// Checks whether an item of a utility with a coalescing key is queued (or
+// in the inbox), so a new item with that key would replace it
+BOOL delivery_haskey(putilRecord util, void* key)
+{
+	pglobalRecord g = util->pGlobals;
+	pQueueItem pqi;
+
+	DSS_mutex_lock(&(g->lock));
+	pqi = g->KeyIndex[delivery_keybucket(util, key)];
+	while (pqi != NULL && (pqi->pUtil != util || pqi->Key != key)) pqi = pqi->pKeyNext;
+	DSS_mutex_unlock(&(g->lock));
+	return (pqi != NULL);
+}
+
+// Stores a new item with a coalescing key. If an item of the same utility
+// with the same key is still queued (or in the inbox), the new item replaces 
+// it in place; the old one keeps its position, but gets the contents of the
+// new one. The old contents are cancelled (through its decoder, after 
+// releasing the lock), and the reservation of the new item is undone.
+// returns; TRUE if an item was replaced, FALSE if the new item was queued
+// NOTE: a spot must have been reserved using delivery_reserve, unless the
+//       item was expected to replace another ('Reserved' is FALSE). If that
+//       one was taken in the meantime, the new item is counted anyway, so
+//       the limits might be exceeded by it.
+// NOTE: after this call the item is owned by the queue, do not access it anymore!
+// NOTE: items with an inline payload cannot be coalesced (their data lives in the item)
+BOOL delivery_enqueuekeyed(pQueueItem pqi)
+{
+	pglobalRecord g = pqi->pGlobals;
+	int bucket = delivery_keybucket(pqi->pUtil, pqi->Key);
+	pQueueItem old;
+	DSS_decoder_1v0_t pDecode;
+	DSS_return_1v0_t pReturn;
+	void* pData;
+	pDSS_waithandle wh;
+	pDSS_ticket ticket;
+
+	DSS_mutex_lock(&(g->lock));
+	old = g->KeyIndex[bucket];
+	while (old != NULL && (old->pUtil != pqi->pUtil || old->Key != pqi->Key)) old = old->pKeyNext;
+
+	if (old == NULL)
+	{
+		if (!pqi->Reserved)
+		{
+			// the item to replace was taken, count this one instead
+			DSS_atomic_max(&(pqi->pUtil->Stats.PeakQueue), DSS_atomic_add(&(pqi->pUtil->QueueCount), 1));
+			DSS_atomic_max(&(g->Stats.PeakQueue), DSS_atomic_add(&(g->QueueCount), 1));
+			pqi->Reserved = TRUE;
+		}
+		// first one with this key, index it and deliver it
+		pqi->pKeyNext = g->KeyIndex[bucket];
+		g->KeyIndex[bucket] = pqi;
+		delivery_push(g, pqi, pqi);
+		DSS_mutex_unlock(&(g->lock));
+		return FALSE;
+	}
+
+	// swap the contents, the old item is not being decoded (it is indexed)
+	pDecode = old->pDecode;
+	pReturn = old->pReturn;
+	pData = old->pData;
+	wh = old->pWaitHandle;
+	ticket = old->pTicket;
+	old->pDecode = pqi->pDecode;
+	old->pReturn = pqi->pReturn;
+	old->pData = pqi->pData;
+	old->pWaitHandle = pqi->pWaitHandle;
+	old->pTicket = pqi->pTicket;
+	pqi->pDecode = pDecode;
+	pqi->pReturn = pReturn;
+	pqi->pData = pData;
+	pqi->pWaitHandle = wh;
+	pqi->pTicket = ticket;
+
+	// drop the reservation of the new item, it holds the old contents now
+	DSS_STATS_INC(pqi->pUtil, Cancelled);
+	if (pqi->Reserved) delivery_uncount(g, pqi, 1);
+	DSS_mutex_unlock(&(g->lock));
+
+	// cancel the old contents, unlocked
+	delivery_decodedetached(pqi, NULL);
+	return TRUE;
+}
+
+// Moves the items in the inbox into the queue, in order of delivery.
+// Only items present when starting are collected, so a consumer cannot
+// get stuck here while producers keep delivering.
+// Caller must hold the lock protecting the queue.
+void delivery_collect(pglobalRecord g)
+{
+	pQueueItem stub = &(g->InboxStub);
+	pQueueItem last = (pQueueItem)DSS_atomic_getptr((void* volatile*)&(g->InboxHead));
+	pQueueItem tail = g->InboxTail;
+	pQueueItem next;
+
+	while (1)
+	{
+		next = (pQueueItem)DSS_atomic_getptr((void* volatile*)&(tail->pNext));
+		if (tail == stub)
+		{
+			if (tail == last) break;	// everything up to the stub was collected
+			if (next == NULL)
+			{
+				// a producer is halfway pushing its item, give it time to link it
+				DSS_yield();
+				continue;
+			}
+			tail = next;	// skip the stub
+			continue;
+		}
+		if (next == NULL)
+		{
+			if (DSS_atomic_getptr((void* volatile*)&(g->InboxHead)) != tail)
+			{
+				// a producer is halfway pushing its item, give it time to link it
+				DSS_yield();
+				continue;
+			}
+			// this is the last item, push the stub behind it, so it can be taken
+			delivery_push(g, stub, stub);
+			continue;
+		}
+
+		// append it to the queue
+		delivery_append(g, tail);
+
+		if (tail == last)
+		{
+			tail = next;
+			break;	// we're done
+		}
+		tail = next;
+	}
+	g->InboxTail = tail;
+}
+
+// Checks whether a new item requires a notification. In coalesced mode
+// only the first delivery after the consumer (re)armed the notification
+// gets to send one, so the notification rate is bounded by the rate at
+// which the consumer drains the queue.
+// NOTE: call after the item was stored with delivery_enqueue()
+BOOL delivery_mustnotify(pglobalRecord g)
+{
+	if (g->GroupName != NULL) return (g->Members != NULL);	// decided per member, see delivery_notifymember
+	if (g->udpport == 0 && g->fdsignal.readfd == -1) return FALSE;
+	if (g->notifymode != DSS_NOTIFY_COALESCED) return TRUE;
+	return (DSS_atomic_swap(&(g->NotifyArmed), 0) == 1);
+}
+
+// Re-arms notifications. Should be called by the consumer when it finds the
+// queue empty. Clears the file descriptor signal, and in coalesced mode 
+// re-arms the notification. The inbox is collected again afterwards, to 
+// catch deliveries made before re-arming, which did not notify. If any are
+// found, the notification is disarmed again as the consumer will continue.
+// Caller must hold the lock protecting the queue.
+void delivery_rearm(pglobalRecord g)
+{
+	if (g->fdsignal.readfd != -1) fdsignal_clear(g->fdsignal);
+	if (g->notifymode != DSS_NOTIFY_COALESCED) 
+	{
+		if (g->fdsignal.readfd != -1) delivery_collect(g);
+		return;
+	}
+
+	DSS_atomic_swap(&(g->NotifyArmed), 1);
+	delivery_collect(g);
+	if (!delivery_isempty(g)) DSS_atomic_swap(&(g->NotifyArmed), 0);
+}
+
+// Sends the notification for a new item delivered to a group (see 'join') to
+// one of its members. The members take turns, starting at the next in turn 
+// the first member that requires a notification (see delivery_mustnotify) gets it.
+// NOTE: caller must hold the lock of the group
+static void delivery_notifymember(pglobalRecord group, int* err)
+{
+	pglobalRecord m = (group->pNotifyNext != NULL ? group->pNotifyNext : group->Members);
+	pglobalRecord start = m;
+	pglobalRecord next;
+
+	*err = DSS_SUCCESS;
+	while (m != NULL)
+	{
+		next = (m->pMemberNext != NULL ? m->pMemberNext : group->Members);
+		if (delivery_mustnotify(m))
+		{
+			group->pNotifyNext = next;
+			// the socket of the member may be replaced by 'setport'
+			DSS_mutex_lock(&(m->lock));
+			delivery_notify(m, err);
+			DSS_mutex_unlock(&(m->lock));
+			return;
+		}
+		m = next;
+		if (m == start) return;		// none of them requires one
+	}
+}
+
+// Sends the notification for a new item; signals the file descriptor and/or
+// sends the UDP packet
+// @err;     DSS_SUCCESS, DSS_ERR_UDP_SEND_FAILED
+// NOTE: caller must hold the lock protecting the socket
+void delivery_notify(pglobalRecord g, int* err)
+{
+	char buff[20];
+
+	if (g->GroupName != NULL)
+	{
+		delivery_notifymember(g, err);
+		return;
+	}
+	*err = DSS_SUCCESS;
+	if (g->fdsignal.readfd != -1)
+	{
+		if (fdsignal_send(g->fdsignal) == 0) *err = DSS_ERR_UDP_SEND_FAILED;	// store failure to report
+	}
+	if (g->udpport == 0) return;
+
+	sprintf(buff, " %ld", DSS_atomic_get(&(g->QueueCount)));	// convert to string
 	
 	// Now send notification packet
-	if (g->udpport != 0)
+	if (udpsocket_send(g->socket, buff) == 0)
 	{
+		// sending failed, retry; close create new and do again
+		udpsocket_close(g->socket);
+		g->socket = udpsocket_new(g->udpport); 
 		if (udpsocket_send(g->socket, buff) == 0)
 		{
-			// sending failed, retry; close create new and do again
-			udpsocket_close(g->socket);
-			g->socket = udpsocket_new(g->udpport); 
-			if (udpsocket_send(g->socket, buff) == 0)
-			{
-				*err = DSS_ERR_UDP_SEND_FAILED;	// store failure to report
-			}
+			*err = DSS_ERR_UDP_SEND_FAILED;	// store failure to report
 		}
 	}
+}
 
-	return pqi;	
-};
 
+// Updates the statistics for an item taken from the queue to be decoded
+static void delivery_polled(pQueueItem pqi, DSS_time_t now)
+{
+	DSS_STATS_INC(pqi->pUtil, Polled);
+	pqi->tPolled = now;
+	histogram_record(&(pqi->pUtil->Latency[DSS_LATENCY_QUEUED]), now - pqi->tDelivered);
+}
 
-// Decoder
-// removes an item from the queue and deals with the POLL step.
-// the decode callback will be called to do what needs to be done
-// returns (on Lua stack): 
-// 1st: queuesize of remaining items or;
-//      -1 to indicate there was nothing in the queue to begin with
-// 2nd: lua callback function to handle the data
-// 3rd: table containing all callback arguments with;
-//    pos 1 : userdata waiting for the response (only if a 'return' call is still valid)
-//    pos 2+: any stuff left by decoder after the callback function (2nd above)
-//
-// Note: if lua_state == NULL then the item will be cancelled
-int delivery_decode(pQueueItem pqi, lua_State *L)
+// Checks whether an item is to be decoded by the batch decoder of its utility
+// (see 'setbatchdecoder'); delivered with the decoder set for it, and nobody
+// waits for the result
+// NOTE: caller must hold the lock
+static BOOL delivery_batchable(pQueueItem pqi)
+{
+	putilRecord util = pqi->pUtil;
+	return (util->BatchDecode != NULL && pqi->pDecode == util->BatchItemDecode && 
+		pqi->pReturn == NULL && pqi->pTicket == NULL);
+}
+
+// Makes an item taken from the queue the first of a batch; the items of the
+// same utility and priority level that directly follow it, and can be 
+// batched, are taken as well, and chained to it through 'pBatch'. Decoding 
+// the first item will decode them all (see delivery_decodebatch).
+// NOTE: caller must hold the lock
+static void delivery_takebatch(pglobalRecord g, pQueueItem first, DSS_time_t now)
 {
+	queueList* list = &(first->pUtil->Queue[first->priority]);
+	pQueueItem last = NULL;
+	pQueueItem pqi;
+	int count = 0;
+
+	first->pBatchDecode = first->pUtil->BatchDecode;
+	while (count < DSS_BATCH_MAX - 1 && list->Start != NULL && delivery_batchable(list->Start))
+	{
+		pqi = list->Start;
+		delivery_unlink(g, pqi);
+		delivery_polled(pqi, now);
+		if (last == NULL) first->pBatch = pqi; else last->pNext = pqi;
+		last = pqi;
+		count += 1;
+	}
+	if (count > 0) delivery_uncount(g, first->pBatch, count);
+}
+
+// Detach
+// Moves up to 'max' items from the queue onto the list of items being
+// decoded (max <= 0 takes the whole queue), in order of priority (see 
+// delivery_nextlevel) and taking turns between utilities (see delivery_take).
+// While on that list the items can be decoded without holding the lock (see 
+// delivery_decodedetached). Items for a batch decoder are detached as a 
+// batch, which counts as a single item (see delivery_takebatch).
+// returns; the first item detached, further ones follow through 'pNext', or
+// NULL if the queue was empty
+// @util; only detach items of this utility, or NULL for any item
+// @count; receives the number of items detached
+// NOTE: caller must hold the lock
+pQueueItem delivery_detach(pglobalRecord g, putilRecord util, int max, int* count)
+{
+	pQueueItem first = NULL;
+	pQueueItem last = NULL;
+	pQueueItem pqi;
+	DSS_time_t now = histogram_now();
+
+	*count = 0;
+	while (max <= 0 || *count < max)
+	{
+		// take it from the queue, and chain it
+		pqi = delivery_take(g, util);
+		if (pqi == NULL) break;		// queue is empty
+		delivery_polled(pqi, now);
+		if (delivery_batchable(pqi)) delivery_takebatch(g, pqi, now);
+		if (last == NULL)
+			first = pqi;
+		else
+		{
+			last->pNext = pqi;
+			pqi->pPrevious = last;
+		}
+		last = pqi;
+		*count += 1;
+	}
+	if (first == NULL) return NULL;
+	delivery_uncount(g, first, *count);
+
+	// put the chain in front of the decoding list
+	last->pNext = g->DecodingStart;
+	if (last->pNext != NULL) last->pNext->pPrevious = last;
+	g->DecodingStart = first;
+
+	return first;
+}
+
+// Destroys the further items of a batch (see delivery_takebatch), they are
+// complete once the batch was decoded (nobody waits for them)
+static void delivery_freebatch(pQueueItem first)
+{
+	pQueueItem pqi;
+	pQueueItem next = first->pBatch;
+
+	while (next != NULL)
+	{
+		pqi = next;
+		next = pqi->pNext;
+		pqi->pDecode = NULL;
+		pool_putitem(pqi->pGlobals, pqi);
+	}
+	first->pBatch = NULL;
+	first->pBatchDecode = NULL;
+}
+
+// Batch decoder
+// Executes the batch decoder for the first item of a batch (see delivery_takebatch),
+// with the data of all items in the batch. The further items are destroyed,
+// the first one is finished by the caller (see delivery_decodeargs).
+// returns; the result of the batch decoder
+// NOTE: must be called WITHOUT holding the lock (unless cancelling)
+static int delivery_decodebatch(pQueueItem first, lua_State *L)
+{
+	void* data[DSS_BATCH_MAX];
+	pQueueItem pqi;
+	int count = 1;
 	int result = 0;
-	pQueueItem* udata = NULL;
-	pglobalRecord g = pqi->utilid->pGlobals;
 
-	// Remove item from queue
-	if (pqi == g->QueueStart) g->QueueStart = pqi->pNext;
-	if (pqi == g->QueueEnd) g->QueueEnd = pqi->pPrevious;
-	if (pqi->pPrevious != NULL) pqi->pPrevious->pNext = pqi->pNext;
-	if (pqi->pNext != NULL) pqi->pNext->pPrevious = pqi->pPrevious;
-	// cleanup results
-	pqi->pNext = NULL;
-	pqi->pPrevious = NULL;
-	g->QueueCount -= 1;
+	data[0] = first->pData;
+	for (pqi = first->pBatch; pqi != NULL; pqi = pqi->pNext) data[count++] = pqi->pData;
+
+	if (L != NULL)
+		result = first->pBatchDecode(L, data, count, first->utilid);
+	else
+	{
+		// cancelling, each through its own decoder
+		first->pDecode(NULL, first->pData, first->utilid);
+		for (pqi = first->pBatch; pqi != NULL; pqi = pqi->pNext) pqi->pDecode(NULL, pqi->pData, pqi->utilid);
+	}
+
+	delivery_freebatch(first);
+	return result;
+}
+
+// Arguments of delivery_decodecall, passed as a lightuserdata
+typedef struct decodeCall {
+	pQueueItem pqi;			// the item to decode
+	BOOL astable;			// TRUE to return the callback arguments in a table
+	int result;				// the result of the decode callback, 0 if it was not called
+	pqueueRef udata;		// the userdata created, if any
+} decodeCall;
+
+// Lua function executing the decode step of delivery_decodeargs in protected 
+// mode, so an error raised by the decoder (or a memory error) cannot leave 
+// the item behind on the decoding list. It is stored in the registry (see 
+// DSS_DECODER_KEY), so getting it does not allocate.
+// The userdata created does not reference the item yet, so if it is 
+// collected after an error, it will not touch the item.
+int delivery_decodecall(lua_State *L)
+{
+	decodeCall* dc = (decodeCall*)lua_touserdata(L, 1);
+	pQueueItem pqi = dc->pqi;
+	pglobalRecord g = pqi->pGlobals;
+	int result, first, i;
+
+	lua_settop(L, 0);
 
 	// execute callback, set to NULL to indicate call is done
-	result = pqi->pDecode(L, pqi->pData, pqi->utilid);	
-	pqi->pDecode = NULL;				
+	if (pqi->pBatchDecode != NULL)
+		result = delivery_decodebatch(pqi, L);
+	else if (pqi->pTicket == NULL || ticket_claim(pqi->pTicket))
+		result = pqi->pDecode(L, pqi->pData, pqi->utilid);
+	else
+	{
+		// the producer stopped waiting, its data is no longer valid
+		result = 0;
+		DSS_atomic_add(&(g->Stats.Cancelled), 1);
+	}
+	pqi->pDecode = NULL;
+	dc->result = result;
+	if (result < 1) return 0;
 
-	if (result < 1 || L == NULL)	// if lua_state == NULL then we're cancelling
+	// remove any leftovers, keep only the results on the stack
+	first = lua_gettop(L) - result + 1;
+	if (first > 1)
 	{
-		// indicator transaction is complete, do NOT create the userdata and do not call return callback
-		pqi->pReturn = NULL;
-		if (pqi->pWaitHandle != NULL)
+		// move the results down in a single pass
+		for (i = 0; i < result; i++)
 		{
-			DSS_waithandle_signal(pqi->pWaitHandle);
-			pqi->pWaitHandle = NULL;
+			lua_pushvalue(L, first + i);
+			lua_replace(L, 1 + i);
 		}
-		lua_pushinteger(L, g->QueueCount);	// add count to results
-		free(pqi); // No need to clear userdata, wasn't created yet in this case
-		return 1;					// Only count is returned
+		lua_settop(L, result);
 	}
-    
-    // remove any leftovers, keep only the results on the stack
-    while (lua_gettop(L)>result) lua_remove(L, 1);
-    
+
 	lua_checkstack(L, 3);
 	if (pqi->pReturn != NULL)
 	{
 		// Create userdata to reference the queueitem, because we have a return callback
-		udata = (pQueueItem*)lua_newuserdata(L, sizeof(pQueueItem));
-		if (udata == NULL)
+		dc->udata = (pqueueRef)lua_newuserdata(L, sizeof(queueRef));
+		dc->udata->pqi = NULL;		// set by the caller, when done
+		dc->udata->pGlobals = g;
+		dc->udata->pOwner = g;
+		if (g->GroupName != NULL)
 		{
-			// memory allocation error, exit process here
-			pqi->pReturn(NULL, pqi->pData, pqi->utilid, FALSE); // call with lua_State == NULL to have it cancelled
-			DSS_waithandle_signal(pqi->pWaitHandle);
-			free(pqi);
-			lua_pushinteger(L, pqi->utilid->pGlobals->QueueCount);	// add count to results
-			// push an error to notify of failure???
-			return 1;					// Only count is returned
+			// polled from a group, the owner is the LuaState polling
+			lua_getfield(L, LUA_REGISTRYINDEX, DSS_GLOBALS_KEY);
+			dc->udata->pOwner = (pglobalRecord)lua_touserdata(L, -1);
+			lua_pop(L, 1);
 		}
-		// Set cross references
-		*udata = pqi;		// fill userdata with reference to queueitem
-		pqi->udata = udata;	// set reference to userdata in queueitem
 
 		// attach metatable
 		luaL_getmetatable(L, DSS_QUEUEITEM_MT);
 		lua_setmetatable(L, -2);
 
-		// store in userdata list
-		pqi->pNext = g->UserdataStart;
-		pqi->pPrevious = NULL;
-		if (pqi->pNext != NULL) pqi->pNext->pPrevious = pqi;
-		g->UserdataStart = pqi;
-
 		// Move userdata (on top) to 2nd position, directly after the lua callback function
-		if (lua_gettop(L) > 2 ) lua_insert(L, 2);
-		result = result + 1;		// 1 more result because we added the userdata
+		if (lua_gettop(L) > 2) lua_insert(L, 2);
 	}
-	lua_createtable(L, result - 1, 0);			// add a table
-	if (lua_gettop(L) > 2 ) lua_insert(L, 2);	// move it into 2nd pos
-	while (lua_gettop(L) > 2)					// migrate all callback arguments into the table
+
+	if (dc->astable)
 	{
-			lua_rawseti(L, 2, lua_gettop(L)-2);
+		lua_createtable(L, lua_gettop(L) - 1, 0);	// add a table
+		if (lua_gettop(L) > 2) lua_insert(L, 2);	// move it into 2nd pos
+		while (lua_gettop(L) > 2)					// migrate all callback arguments into the table
+		{
+			lua_rawseti(L, 2, lua_gettop(L) - 2);
+		}
 	}
-	lua_pushinteger(L, g->QueueCount);			// add count to results
-	lua_insert(L,1);							// move count to 1st position
-
-	return 3;									// count, callback, table cb arguments
+	return lua_gettop(L);
 }
 
-// Return destructor
-// Execute the return callback, cleanup and finish process
+// Detached decoder, arguments variant
+// deals with the POLL step for an item that has been moved to the decoding
+// list (see delivery_detach). The decode callback will be called (in protected
+// mode, see delivery_decodecall) to do what needs to be done. Anything on the 
+// Lua stack below the current top is left untouched.
+// returns (on Lua stack, on top of what was there before):
+// 1st: lua callback function to handle the data
+// 2nd: userdata waiting for the response (only if a 'return' call is still valid)
+// 3rd+: any stuff left by decoder after the callback function (1st above)
+// returns the number of values, or 0 if the transaction was completed by the 
+// decoder (nothing added to the stack), or -1 if the decoder raised an error.
+// In the last case the item is cancelled, and the error is left on the stack.
 //
-// Note: if lua_state == NULL then the item will be cancelled
-int delivery_return(pQueueItem pqi, lua_State *L, BOOL garbage)
+// NOTE: must be called WITHOUT holding the lock, the decode callback is executed
+//       unlocked, so a slow decoder does not block any delivering threads.
+// Note: if lua_state == NULL then the item will be cancelled, in this case the item
+//       must have been removed from any list, and the lock may be held.
+static int delivery_decode(pQueueItem pqi, lua_State *L, BOOL astable)
 {
 	int result = 0;
-	pglobalRecord g = pqi->utilid->pGlobals;
+	int base = 0;
+	BOOL cancelled = FALSE;
+	BOOL failed = FALSE;
+	pqueueRef udata = NULL;
+	pglobalRecord g = pqi->pGlobals;
+	decodeCall dc;
+
+	if (L != NULL)
+	{
+		base = lua_gettop(L);
+		dc.pqi = pqi;
+		dc.astable = astable;
+		dc.result = 0;
+		dc.udata = NULL;
+		lua_getfield(L, LUA_REGISTRYINDEX, DSS_DECODER_KEY);
+		lua_pushlightuserdata(L, &dc);
+		if (lua_pcall(L, 1, LUA_MULTRET, 0) != 0)
+		{
+			// the decoder failed; finish the call, and cancel the item below
+			failed = TRUE;
+			pqi->pDecode = NULL;
+			if (pqi->pBatch != NULL) delivery_freebatch(pqi);
+			dc.result = 0;
+		}
+		result = (dc.result < 1 ? 0 : lua_gettop(L) - base);
+		udata = (result > 0 ? dc.udata : NULL);
+	}
+	else
+	{
+		// cancelling, execute callback, set to NULL to indicate call is done
+		if (pqi->pBatchDecode != NULL)
+			delivery_decodebatch(pqi, NULL);
+		else if (pqi->pTicket == NULL || ticket_claim(pqi->pTicket))
+			pqi->pDecode(NULL, pqi->pData, pqi->utilid);
+		else
+			DSS_atomic_add(&(g->Stats.Cancelled), 1);	// the producer stopped waiting
+		pqi->pDecode = NULL;
+	}
+
+	if (L != NULL)
+	{
+		// remove from decoding list and store it in the userdata list, if required
+		DSS_mutex_lock(&(g->lock));
+		if (pqi == g->DecodingStart) g->DecodingStart = pqi->pNext;
+		if (pqi->pPrevious != NULL) pqi->pPrevious->pNext = pqi->pNext;
+		if (pqi->pNext != NULL) pqi->pNext->pPrevious = pqi->pPrevious;
+		pqi->pNext = NULL;
+		pqi->pPrevious = NULL;
+
+		if (failed)
+		{
+			// count it while the utility record is still guaranteed valid
+			if (pqi->cancelled)
+				DSS_atomic_add(&(g->Stats.Cancelled), 1);
+			else
+				DSS_STATS_INC(pqi->pUtil, Cancelled);
+			cancelled = (pqi->pReturn != NULL);	// let the utility release its resources
+		}
+		else if (udata != NULL)
+		{
+			if (pqi->cancelled)
+			{
+				// the utility was unregistered while decoding
+				cancelled = TRUE;
+				DSS_atomic_add(&(g->Stats.Cancelled), 1);	// utility record is gone, only the state counts
+			}
+			else
+			{
+				// store in userdata list, the producer may abandon it while Lua has it
+				if (pqi->pTicket != NULL) ticket_unclaim(pqi->pTicket);
+				DSS_STATS_INC(pqi->pUtil, Waiting);
+				udata->pqi = pqi;
+				pqi->udata = udata;	// set reference to userdata in queueitem
+				pqi->pNext = g->UserdataStart;
+				if (pqi->pNext != NULL) pqi->pNext->pPrevious = pqi;
+				g->UserdataStart = pqi;
+			}
+		}
+		DSS_mutex_unlock(&(g->lock));
+	}
+
+	if (result < 1 || L == NULL || cancelled)	// if lua_state == NULL then we're cancelling
+	{
+		// call with lua_State == NULL to have it cancelled
+		if (cancelled) pqi->pReturn(NULL, pqi->pData, pqi->utilid, FALSE);
+		// indicator transaction is complete, do NOT create the userdata and do not call return callback
+		pqi->pReturn = NULL;
+		delivery_complete(pqi, pqi->pData, (L == NULL || cancelled ? DSS_TICKET_CANCELLED : DSS_TICKET_COMPLETED));
+		if (L != NULL && !failed) lua_settop(L, base);	// drop anything left behind (keep an error)
+		pool_putitem(pqi->pGlobals, pqi); // No need to clear userdata, wasn't created yet (or already cleared) in this case
+		return (failed ? -1 : 0);
+	}
+    
+	if (udata == NULL)
+	{
+		// no return callback, so the item is complete; only the results remain
+		delivery_complete(pqi, pqi->pData, DSS_TICKET_COMPLETED);
+		pool_putitem(g, pqi);
+	}
+	return result;								// callback, cb arguments
+}
+
+// Detached decoder, arguments variant, see delivery_decode
+int delivery_decodeargs(pQueueItem pqi, lua_State *L)
+{
+	return delivery_decode(pqi, L, FALSE);
+}
+
+// Detached decoder
+// Same as delivery_decodeargs, but with the callback arguments in a table.
+// returns (on Lua stack, on top of what was there before):
+// 1st: lua callback function to handle the data
+// 2nd: table containing all callback arguments with;
+//    pos 1 : userdata waiting for the response (only if a 'return' call is still valid)
+//    pos 2+: any stuff left by decoder after the callback function (1st above)
+// returns 2, or 0 if the transaction was completed by the decoder (nothing 
+// added to the stack), or -1 with the error on the stack
+// NOTE: see delivery_decode
+int delivery_decodedetached(pQueueItem pqi, lua_State *L)
+{
+	return delivery_decode(pqi, L, TRUE);
+}
+
+// Cancels items detached from the queue (see delivery_detach) that will not
+// be decoded, because decoding an earlier one failed
+// @first; the first item, further ones follow through 'pNext'
+// @count; the number of items
+// NOTE: must be called WITHOUT holding the lock
+void delivery_canceldetached(pQueueItem first, int count)
+{
+	pglobalRecord g;
+	pQueueItem pqi = first;
+	pQueueItem next;
+	int i;
+
+	if (count < 1) return;
+	g = first->pGlobals;
+	for (i = 0; i < count; i++)
+	{
+		// remove it from the decoding list
+		DSS_mutex_lock(&(g->lock));
+		next = pqi->pNext;
+		if (pqi->cancelled)
+			DSS_atomic_add(&(g->Stats.Cancelled), 1);	// utility record is gone, only the state counts
+		else
+			DSS_STATS_INC(pqi->pUtil, Cancelled);
+		if (pqi == g->DecodingStart) g->DecodingStart = pqi->pNext;
+		if (pqi->pPrevious != NULL) pqi->pPrevious->pNext = pqi->pNext;
+		if (pqi->pNext != NULL) pqi->pNext->pPrevious = pqi->pPrevious;
+		pqi->pNext = NULL;
+		pqi->pPrevious = NULL;
+		DSS_mutex_unlock(&(g->lock));
+
+		// cancel it unlocked
+		delivery_decode(pqi, NULL, FALSE);
+		pqi = next;
+	}
+}
+
+// Take return
+// Removes the item from the userdata list, so its return step can be executed
+// without holding the lock (see delivery_return). The reference in the userdata
+// is cleared, so it cannot be returned twice.
+// NOTE: caller must hold the lock
+void delivery_takereturn(pQueueItem pqi)
+{
+	pglobalRecord g = pqi->pGlobals;
 
 	// Move it off the userdata list
 	if (pqi->pPrevious == NULL)
@@ -215,25 +1125,37 @@ int delivery_return(pQueueItem pqi, lua_State *L, BOOL garbage)
 	}
 	pqi->pNext = NULL;
 	pqi->pPrevious = NULL;
+	DSS_STATS_ADD(pqi->pUtil, Waiting, -1);
 
 	// Cleanup userdata
-	(*(pqi->udata)) = NULL;	// set reference in userdata to NULL, indicate its done
+	pqi->udata->pqi = NULL;	// set reference in userdata to NULL, indicate its done
+	pqi->udata = NULL;
+}
+
+// Return destructor
+// Execute the return callback, cleanup and finish process
+// The item must have been taken from the userdata list (see delivery_takereturn)
+// and the lock need not be held.
+//
+// Note: if lua_state == NULL then the item will be cancelled
+int delivery_return(pQueueItem pqi, lua_State *L, BOOL garbage)
+{
+	int result = 0;
+
 	if (L != NULL) lua_remove(L, 1);	// remove the userdata from the stack
 
 	// now execute callback, here the utility should release all resources
-	result = pqi->pReturn(L, pqi->pData, pqi->utilid, garbage);	
+	// (unless the producer stopped waiting, then its data is no longer valid)
+	if (pqi->pTicket == NULL || ticket_claim(pqi->pTicket))
+		result = pqi->pReturn(L, pqi->pData, pqi->utilid, garbage);	
 
 	// Cleanup queueitem
 	pqi->pReturn = NULL;
+	delivery_complete(pqi, pqi->pData, (L == NULL || garbage ? DSS_TICKET_CANCELLED : DSS_TICKET_COMPLETED));
 	pqi->pData = NULL;
-	if (pqi->pWaitHandle != NULL)
-	{
-		DSS_waithandle_signal(pqi->pWaitHandle);
-		pqi->pWaitHandle = NULL;
-	}
 
 	// let go of own resources
-	free(pqi);
+	pool_putitem(pqi->pGlobals, pqi);
 
 	return result;
 }
@@ -241,16 +1163,25 @@ int delivery_return(pQueueItem pqi, lua_State *L, BOOL garbage)
 // Cancel destructor
 // Removes the item from the queue or userdata list and destroys it
 // will call the appropriate callback to release client resources
+// NOTE: caller must hold the lock, items being decoded cannot be cancelled
+//       this way, set their 'cancelled' flag instead.
 void delivery_cancel(pQueueItem pqi)
 {
+	pglobalRecord g = pqi->pGlobals;
+
+	DSS_STATS_INC(pqi->pUtil, Cancelled);
 	if (pqi->udata != NULL)
 	{
 		// There is a userdata, so its on Lua side
+		delivery_takereturn(pqi);
 		delivery_return(pqi, NULL, FALSE);
 	}
 	else
 	{
-		// No userdata, so must be in queue
-		delivery_decode(pqi, NULL);
+		// No userdata, so must be in queue, remove it
+		delivery_unlink(g, pqi);
+		delivery_uncount(g, pqi, 1);
+
+		delivery_decodedetached(pqi, NULL);
 	}
 }
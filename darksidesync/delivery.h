@@ -24,11 +24,56 @@
 //		DSS_return_1v0_t pReturn;	// Pointer to the return function
 //	} QueueItem;
 
+// Results of reserving a spot in the queue
+#define DSS_LIMIT_NONE 0		// reserved
+#define DSS_LIMIT_UTIL 1		// utility queue limit reached
+#define DSS_LIMIT_STATE 2		// LuaState queue limit reached
+
 // Methods, see code for more detailed comments
-// Create a new item and store it
-pQueueItem delivery_new(putilRecord utilid, DSS_decoder_1v0_t pDecode, DSS_return_1v0_t pReturn, void* pData, int* err);
-// Execute the poll/decode step, and move to userdata
-int delivery_decode(pQueueItem pqi, lua_State *L);
+// Create a new item
+pQueueItem delivery_new(putilRecord util, int priority, DSS_decoder_1v0_t pDecode, DSS_return_1v0_t pReturn, void* pData, size_t payloadsize, pDSS_ticket ticket, int* err);
+// Reserve spots in the queue (lock-free)
+int delivery_reserve(putilRecord util, int count);
+// Undo a reservation
+void delivery_unreserve(putilRecord util, int count);
+// Store a new item in the inbox (lock-free)
+void delivery_enqueue(pQueueItem pqi);
+// Store a chain of new items in the inbox (lock-free)
+void delivery_enqueuemany(pQueueItem first, pQueueItem last);
+// Check whether an item with a coalescing key is queued
+BOOL delivery_haskey(putilRecord util, void* key);
+// Store a new item with a coalescing key, or replace a queued one with the same key
+BOOL delivery_enqueuekeyed(pQueueItem pqi);
+// Take the oldest item of a utility from the queue, to be cancelled
+pQueueItem delivery_dropoldest(pglobalRecord g, putilRecord util);
+// Release the spot of an item with an abandoned ticket
+void delivery_abandon(putilRecord util, pDSS_ticket ticket);
+// Release producers blocked on a full queue
+void delivery_wakeblocked(pglobalRecord g);
+// Check whether a new item requires a notification
+BOOL delivery_mustnotify(pglobalRecord g);
+// Re-arm coalesced notifications, after finding the queue empty
+void delivery_rearm(pglobalRecord g);
+// Send the notification for a new item
+void delivery_notify(pglobalRecord g, int* err);
+// Initialize the inbox of a global record
+void delivery_initinbox(pglobalRecord g);
+// Move items from the inbox into the queue
+void delivery_collect(pglobalRecord g);
+// Check whether the queue is empty
+BOOL delivery_isempty(pglobalRecord g);
+// Move items from the queue to the decoding list
+pQueueItem delivery_detach(pglobalRecord g, putilRecord util, int max, int* count);
+// Execute the poll/decode step for a detached item, and move to userdata
+int delivery_decodedetached(pQueueItem pqi, lua_State *L);
+// Same, leaving the callback arguments on the stack, instead of in a table
+int delivery_decodeargs(pQueueItem pqi, lua_State *L);
+// Cancel detached items that will not be decoded
+void delivery_canceldetached(pQueueItem first, int count);
+// Lua function decoding an item in protected mode (stored in the registry)
+int delivery_decodecall(lua_State *L);
+// Take an item from the userdata list
+void delivery_takereturn(pQueueItem pqi);
 // execute return step and destroy
 int delivery_return(pQueueItem pqi, lua_State *L, BOOL garbage);
 // cancel the item (either from queue or userdata)
@@ -15,8 +15,6 @@ local darksidesync = require("darksidesync")
 require("coxpcall")
 local skt, port
 
-local unpack = unpack or table.unpack  -- 5.1/5.2 compatibility
-
 ----------------------------------------------------------------------------------------
 -- creates and initializes the UDP socket to be listened on
 -- @return a luasocket.udp socket and the port number, or nil and an error message
@@ -59,24 +57,33 @@ local _ehandler = function(msg)
     print (msg)
 end
 local ehandler = _ehandler
+darksidesync.seterrorhandler(ehandler)
+
+-- maximum number of items to handle in a single call to dispatch()
+local DRAIN_BATCH = 100
+
+-- lets other coroutines run in between batches, if running in a copas coroutine
+local yield = function()
+    local copas = package.loaded.copas
+    if copas and coroutine.running() then copas.sleep(0) end
+end
 
 ----------------------------------------------------------------------------------------
--- reads incoming data on the socket, dismisses the data and calls poll()
--- any data returned will have a first argument being the number of items
--- remaining on the queue. And a second being a callback to be called with
--- the remaining arguments
+-- reads incoming data on the socket, dismisses the data and handles a batch of
+-- items by calling dispatch(). Any item with a callback will have it called with the
+-- accompanying arguments, using the error handler (see dss.seterrorhandler).
+-- If items remain, the next notification will call the handler again; another UDP
+-- packet is pending (mode "each"), or the file descriptor is still readable. Only
+-- coalesced UDP notifications are not sent again until the queue was found empty,
+-- so then it continues with the next batch, yielding in between when using copas.
 local sockethandler = function(skt)
     -- collect data from socket, can be dismissed, won't be used
     skt:receive(8192)   -- size not optional if using copas, add it to be sure
-    -- now call poll() to collect the actual data in a new table with values
-    local count, callback, args = darksidesync.poll() 
-    if count ~= -1 then
-        if type(callback) ~= "function" then
-            print (debug.traceback("error: the first argument returned should have been a Lua function!"))
-        else
-            -- now call the callback with the other arguments as parameters, in a protected (coxpcall) mode
-            xpcall(function() callback(unpack(args)) end, ehandler)
-        end
+    -- now call dispatch(), it runs the callbacks in protected mode
+    local ran, remaining = darksidesync.dispatch(DRAIN_BATCH)
+    while remaining ~= -1 and darksidesync.getfd() == -1 and darksidesync.getnotifymode() == "coalesced" do
+        yield()
+        ran, remaining = darksidesync.dispatch(DRAIN_BATCH)
     end
 end
 
@@ -91,6 +98,9 @@ local dss = {}
 -- listen on `localhost` and try to pick a port number from 50000 and 50200.
 -- After allocating the socket, the DarkSideSync (C-side) function `darksidesync.setport`
 -- will be called to instruct the synchronization mechanism to send notifications on this port.
+-- The notification mode is left unchanged, so by default a packet is sent for every item
+-- delivered. Use `darksidesync.setnotifymode("coalesced")` to get a single packet until the
+-- queue has been drained.
 -- @return Socket: Existing or newly created UDP socket
 -- @return Port: port number the socket is listening on
 -- @see gethandler
@@ -108,14 +118,45 @@ dss.getsocket = function()
     return skt, port
 end
 
+-----------------------------------------------------------------------------------------
+-- Returns a handle wrapping the DarkSideSync notification file descriptor (see
+-- `darksidesync.setfd`), as an alternative to the UDP socket. The handle has the `getfd` and
+-- `dirty` methods required by `socket.select`, and a `receive` method that does nothing, so it
+-- can be passed to the sockethandler (see `gethandler`) just like the UDP socket. For luv or
+-- epoll based loops, use `handle:getfd()` to get the actual descriptor. Notifications will be
+-- coalesced (see `darksidesync.setnotifymode`). Not available on Windows.
+-- @return handle, or `nil + error msg` if the file descriptor could not be created
+-- @see gethandler
+-- @see darksidesync.setfd
+-- @usage
+-- local hdl = assert(dss.getfdhandle())
+-- local hdlr = dss.gethandler()
+-- while true do
+--   local readable = socket.select({ hdl }, nil, 1)
+--   if readable[hdl] then hdlr(hdl) end
+-- end
+dss.getfdhandle = function()
+    local fd, err = darksidesync.setfd(true)
+    if not fd then return nil, err end
+    darksidesync.setnotifymode("coalesced")
+    return {
+        getfd = function() return darksidesync.getfd() end,
+        dirty = function() return false end,
+        receive = function() end,  -- nothing to read, the descriptor is cleared by polling
+    }
+end
+
 -----------------------------------------------------------------------------------------
 -- Returns the socket handler function. This socket handler function will do a single
--- read on the socket to empty the buffer, call `darksidesync.poll` for the asynchroneous
--- data received, and call the appropriate callback with the arguments. So whenever
+-- read on the socket to empty the buffer, and call `darksidesync.dispatch` to handle a
+-- batch of items, which calls the appropriate callbacks with the arguments. So whenever
 -- a UDP notification packet is received, the socket handler function should be called
--- to initiate the execution of the async callback.
+-- to initiate the execution of the async callbacks. Items left after the batch trigger
+-- another notification, except for coalesced UDP notifications; then the handler
+-- continues with the next batch, yielding in between (`copas.sleep(0)`) when running
+-- in a Copas coroutine.
 -- @return sockethandler function (the function returned requires a single argument; the socket to read from)
--- @see darksidesync.poll
+-- @see darksidesync.dispatch
 -- @usage
 -- copas.addserver(       -- assumes using the Copas scheduler
 --   dss.getsocket(), function(skt)
@@ -139,12 +180,13 @@ end
 -----------------------------------------------------------------------------------------
 -- Sets the error handler when calling the callback function returned from DarkSideSync.
 -- When the sockethandler function executes the callback, the function set though
--- `seterrorhandler()` will be used as the error function on the `coxpcall`.
+-- `seterrorhandler()` will be used as the error function (see `darksidesync.seterrorhandler`).
 -- The default errorhandler will print the error and a stack traceback.
 -- @param f the error handler function to be set (or `nil` to restore the default error handler)
 dss.seterrorhandler = function(f)
     assert(type(f) == "function", "The errorhandler must be a function.")
     ehandler = f or _ehandler
+    darksidesync.seterrorhandler(ehandler)
 end
 
 return dss
@@ -0,0 +1,188 @@
+#ifndef dss_event_c
+#define dss_event_c
+
+#include <string.h>
+#include "event.h"
+
+// Typed events are encoded in the inline payload buffer of a queue item (see 
+// 'reserve' in the API). The buffer starts with a header, followed by the 
+// values, each a tag byte and the value bytes (unaligned, so copied with
+// memcpy). Strings are stored as a size_t length and the bytes, nil (a NULL
+// string) has its own tag.
+#define EVENT_NIL '0'
+
+typedef struct eventHeader {
+	void* libid;		// libid of the utility, to find the Lua handler
+	int count;			// number of values
+	size_t size;		// size of the values
+} eventHeader;
+
+
+/*
+** ===============================================================
+** Typed event functions
+** ===============================================================
+*/
+// Returns the buffer size required for the values, or 0 if the format is invalid
+// NOTE: 'args' is consumed, pass a copy
+size_t event_size(const char* format, va_list args)
+{
+	size_t size = sizeof(eventHeader);
+	const char* s;
+
+	for (; *format != '\0'; format++)
+	{
+		switch (*format)
+		{
+			case DSS_EVENT_INTEGER:
+				(void)va_arg(args, long long);
+				size += 1 + sizeof(long long);
+				break;
+			case DSS_EVENT_NUMBER:
+				(void)va_arg(args, double);
+				size += 1 + sizeof(double);
+				break;
+			case DSS_EVENT_BOOLEAN:
+				(void)va_arg(args, int);
+				size += 2;
+				break;
+			case DSS_EVENT_STRING:
+				s = va_arg(args, const char*);
+				size += 1 + (s == NULL ? 0 : sizeof(size_t) + strlen(s));
+				break;
+			case DSS_EVENT_LSTRING:
+				(void)va_arg(args, const char*);
+				size += 1 + sizeof(size_t) + va_arg(args, size_t);
+				break;
+			default:
+				return 0;	// unknown tag
+		}
+	}
+	return size;
+}
+
+// Encodes the values into a buffer, which must have the size returned by event_size
+// NOTE: the format must have been validated by event_size
+void event_encode(void* buffer, void* libid, const char* format, va_list args)
+{
+	eventHeader* h = (eventHeader*)buffer;
+	char* p = (char*)buffer + sizeof(eventHeader);
+	long long i;
+	double n;
+	const char* s;
+	size_t len;
+
+	h->libid = libid;
+	h->count = (int)strlen(format);
+	for (; *format != '\0'; format++)
+	{
+		switch (*format)
+		{
+			case DSS_EVENT_INTEGER:
+				i = va_arg(args, long long);
+				*p++ = DSS_EVENT_INTEGER;
+				memcpy(p, &i, sizeof(i));
+				p += sizeof(i);
+				break;
+			case DSS_EVENT_NUMBER:
+				n = va_arg(args, double);
+				*p++ = DSS_EVENT_NUMBER;
+				memcpy(p, &n, sizeof(n));
+				p += sizeof(n);
+				break;
+			case DSS_EVENT_BOOLEAN:
+				*p++ = DSS_EVENT_BOOLEAN;
+				*p++ = (va_arg(args, int) != 0);
+				break;
+			case DSS_EVENT_STRING:
+			case DSS_EVENT_LSTRING:
+				s = va_arg(args, const char*);
+				if (*format == DSS_EVENT_LSTRING)
+					len = va_arg(args, size_t);
+				else
+					len = (s == NULL ? 0 : strlen(s));
+				if (s == NULL)
+				{
+					*p++ = EVENT_NIL;
+					break;
+				}
+				*p++ = DSS_EVENT_STRING;
+				memcpy(p, &len, sizeof(len));
+				p += sizeof(len);
+				memcpy(p, s, len);
+				p += len;
+				break;
+		}
+	}
+	h->size = p - ((char*)buffer + sizeof(eventHeader));
+}
+
+// Decoder for typed events (see DSS_decoder_1v0_t), pushes the Lua handler
+// registered for the utility and the values. If there is no handler (anymore)
+// the event is dropped.
+int event_decode(lua_State *L, void* pData, void* utilid)
+{
+	eventHeader* h = (eventHeader*)pData;
+	const char* p = (const char*)pData + sizeof(eventHeader);
+	const char* end = p + h->size;
+	long long i;
+	double n;
+	size_t len;
+	(void)utilid;
+
+	if (L == NULL) return 0;	// cancelled, nothing to release
+
+	// get the handler
+	lua_getfield(L, LUA_REGISTRYINDEX, DSS_HANDLERS_KEY);
+	if (!lua_istable(L, -1))
+	{
+		lua_pop(L, 1);
+		return 0;
+	}
+	lua_pushlightuserdata(L, h->libid);
+	lua_rawget(L, -2);
+	lua_remove(L, -2);
+	if (!lua_isfunction(L, -1))
+	{
+		lua_pop(L, 1);
+		return 0;
+	}
+
+	// push the values, if they don't fit on the stack the event is dropped
+	if (!lua_checkstack(L, h->count + 1))
+	{
+		lua_pop(L, 1);
+		return 0;
+	}
+	while (p < end)
+	{
+		switch (*p++)
+		{
+			case DSS_EVENT_INTEGER:
+				memcpy(&i, p, sizeof(i));
+				p += sizeof(i);
+				lua_pushinteger(L, (lua_Integer)i);
+				break;
+			case DSS_EVENT_NUMBER:
+				memcpy(&n, p, sizeof(n));
+				p += sizeof(n);
+				lua_pushnumber(L, n);
+				break;
+			case DSS_EVENT_BOOLEAN:
+				lua_pushboolean(L, *p++);
+				break;
+			case DSS_EVENT_STRING:
+				memcpy(&len, p, sizeof(len));
+				p += sizeof(len);
+				lua_pushlstring(L, p, len);
+				p += len;
+				break;
+			default:
+				lua_pushnil(L);
+				break;
+		}
+	}
+	return h->count + 1;
+}
+
+#endif  /* dss_event_c */
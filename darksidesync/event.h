@@ -0,0 +1,18 @@
+#ifndef dss_event_h
+#define dss_event_h
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <lua.h>
+#include "darksidesync_api.h"
+
+// Lua registry key for the table with Lua handlers for typed events, 
+// indexed by libid (see 'sethandler')
+#define DSS_HANDLERS_KEY "DSS.handlers"
+
+// Typed event operations
+size_t event_size(const char* format, va_list args);
+void event_encode(void* buffer, void* libid, const char* format, va_list args);
+int event_decode(lua_State *L, void* pData, void* utilid);
+
+#endif  /* dss_event_h */
@@ -0,0 +1,106 @@
+#ifndef dss_fdsignal_c
+#define dss_fdsignal_c
+
+#include <stdint.h>
+#include "fdsignal.h"
+
+
+/*
+** ===============================================================
+** File descriptor signal functions
+** ===============================================================
+*/
+// Create a new signal
+// return signal struct, failed if member; readfd == -1
+// Not supported on Windows, so it always fails there
+fdsignal_t fdsignal_new()
+{
+	fdsignal_t s;
+	s.readfd = -1;
+	s.writefd = -1;
+
+#ifndef WIN32
+	#ifdef __linux__
+		// try an eventfd first; a single counter, cleared by a single read
+		s.readfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		if (s.readfd != -1)
+		{
+			s.writefd = s.readfd;
+			return s;
+		}
+	#endif
+	{
+		// fall back to a pipe
+		int fds[2];
+		if (pipe(fds) != 0) return s;	// report failure
+
+		fcntl(fds[0], F_SETFL, fcntl(fds[0], F_GETFL) | O_NONBLOCK);
+		fcntl(fds[1], F_SETFL, fcntl(fds[1], F_GETFL) | O_NONBLOCK);
+		fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+		fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+		s.readfd = fds[0];
+		s.writefd = fds[1];
+	}
+#endif
+
+	return s;
+}
+
+// Close signal
+void fdsignal_close(fdsignal_t s)
+{
+#ifndef WIN32
+	if (s.readfd != -1) close(s.readfd);
+	if (s.writefd != -1 && s.writefd != s.readfd) close(s.writefd);
+#endif
+}
+
+// Signals, the read descriptor becomes readable
+// failure reported as 0
+int fdsignal_send(fdsignal_t s)
+{
+#ifndef WIN32
+	if (s.writefd != -1)
+	{
+		if (s.writefd == s.readfd)
+		{
+			// eventfd, add to the counter
+			uint64_t one = 1;
+			if (write(s.writefd, &one, sizeof(one)) == sizeof(one)) return 1;
+		}
+		else
+		{
+			// pipe, write a single byte
+			char one = 1;
+			if (write(s.writefd, &one, 1) == 1) return 1;
+		}
+		// a full pipe/counter is still signalled
+		if (errno == EAGAIN || errno == EWOULDBLOCK) return 1;
+	}
+#endif
+	return 0;	// report failure
+}
+
+// Clears all pending signals, the read descriptor will no longer be readable
+void fdsignal_clear(fdsignal_t s)
+{
+#ifndef WIN32
+	if (s.readfd != -1)
+	{
+		if (s.writefd == s.readfd)
+		{
+			// eventfd, a single read resets the counter
+			uint64_t count;
+			if (read(s.readfd, &count, sizeof(count))) {};
+		}
+		else
+		{
+			// pipe, read until empty
+			char buff[256];
+			while (read(s.readfd, buff, sizeof(buff)) == sizeof(buff)) {};
+		}
+	}
+#endif
+}
+
+#endif
@@ -0,0 +1,26 @@
+#ifndef dss_fdsignal_h
+#define dss_fdsignal_h
+
+#ifndef WIN32
+	#include <unistd.h>
+	#include <fcntl.h>
+	#include <errno.h>
+	#ifdef __linux__
+		#include <sys/eventfd.h>
+	#endif
+#endif
+
+// file descriptor signal structure
+// uses an eventfd where available, a pipe otherwise (not available on Windows)
+typedef struct fdsignal {
+	int readfd;		// descriptor to wait on, -1 if not available
+	int writefd;	// descriptor to signal, equal to readfd for an eventfd
+} fdsignal_t;
+
+// Signal operations
+fdsignal_t fdsignal_new();
+void fdsignal_close(fdsignal_t s);
+int fdsignal_send(fdsignal_t s);
+void fdsignal_clear(fdsignal_t s);
+
+#endif  /* dss_fdsignal_h */
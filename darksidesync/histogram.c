@@ -0,0 +1,118 @@
+#ifndef dss_histogram_c
+#define dss_histogram_c
+
+#include "histogram.h"
+
+
+/*
+** ===============================================================
+** Histogram functions
+** ===============================================================
+*/
+// Returns the current time of the monotonic clock, in microseconds
+DSS_time_t histogram_now()
+{
+#ifdef WIN32
+	static LARGE_INTEGER freq = { 0 };
+	LARGE_INTEGER now;
+	if (freq.QuadPart == 0) QueryPerformanceFrequency(&freq);	// never changes, a race is harmless
+	QueryPerformanceCounter(&now);
+	return (DSS_time_t)(now.QuadPart / freq.QuadPart) * 1000000 + 
+		(DSS_time_t)(now.QuadPart % freq.QuadPart) * 1000000 / freq.QuadPart;
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (DSS_time_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#endif
+}
+
+// Returns the bucket index for a value
+static int histogram_index(DSS_time_t value)
+{
+	int group = 0;
+	DSS_time_t v = value;
+
+	if (value < HISTOGRAM_SUBBUCKETS) return (value < 0 ? 0 : (int)value);
+	// group 1 starts at HISTOGRAM_SUBBUCKETS, every next group doubles
+	while (v >= (HISTOGRAM_SUBBUCKETS << 1))
+	{
+		v = v >> 1;
+		group++;
+	}
+	group++;
+	if (group >= HISTOGRAM_GROUPS) return HISTOGRAM_BUCKETS - 1;
+	// 'v' now holds the top HISTOGRAM_SUBBITS + 1 bits of the value
+	return group * HISTOGRAM_SUBBUCKETS + (int)v - HISTOGRAM_SUBBUCKETS;
+}
+
+// Returns the highest value counted in a bucket
+// NOTE: the top groups exceed 32 bits, so not a 'long' (32 bits on Windows)
+static DSS_time_t histogram_value(int index)
+{
+	int group = index / HISTOGRAM_SUBBUCKETS;
+	DSS_time_t sub = index % HISTOGRAM_SUBBUCKETS;
+
+	if (group == 0) return sub;
+	return ((sub + HISTOGRAM_SUBBUCKETS + 1) << (group - 1)) - 1;
+}
+
+// Clears all values
+void histogram_reset(histogram_t* h)
+{
+	int i;
+	for (i = 0; i < HISTOGRAM_BUCKETS; i++) DSS_atomic_swap(&(h->Buckets[i]), 0);
+	DSS_atomic_swap(&(h->Max), 0);
+	DSS_atomic_swap(&(h->Count), 0);
+}
+
+// Records a value, lock-free
+void histogram_record(histogram_t* h, DSS_time_t value)
+{
+	if (value < 0) value = 0;	// clock is monotonic, but be safe
+	DSS_atomic_add(&(h->Buckets[histogram_index(value)]), 1);
+	DSS_atomic_add(&(h->Count), 1);
+	DSS_atomic_max(&(h->Max), (value > 0x7FFFFFFF ? 0x7FFFFFFF : (long)value));
+}
+
+// Adds the values of 'src' to 'dst'
+// NOTE: 'dst' must not be in use by other threads
+void histogram_merge(histogram_t* dst, histogram_t* src)
+{
+	int i;
+	long max = DSS_atomic_get(&(src->Max));
+
+	for (i = 0; i < HISTOGRAM_BUCKETS; i++) dst->Buckets[i] += DSS_atomic_get(&(src->Buckets[i]));
+	dst->Count += DSS_atomic_get(&(src->Count));
+	if (max > dst->Max) dst->Max = max;
+}
+
+// Returns the value below which a fraction 'p' (0 to 1) of the values is, 
+// as the upper bound of the bucket it falls in (never beyond the max).
+// returns; the value, or 0 if there are no values
+DSS_time_t histogram_percentile(histogram_t* h, double p)
+{
+	long count = 0;
+	DSS_time_t max = DSS_atomic_get(&(h->Max));
+	long total = 0;
+	long target;
+	DSS_time_t value;
+	int i;
+
+	// count the buckets, as Count might be updated concurrently
+	for (i = 0; i < HISTOGRAM_BUCKETS; i++) total += DSS_atomic_get(&(h->Buckets[i]));
+	if (total == 0) return 0;
+	target = (long)(p * total + 0.5);
+	if (target < 1) target = 1;
+	if (target > total) target = total;
+
+	for (i = 0; i < HISTOGRAM_BUCKETS; i++)
+	{
+		count += DSS_atomic_get(&(h->Buckets[i]));
+		if (count >= target) break;
+	}
+	if (i == HISTOGRAM_BUCKETS) i = HISTOGRAM_BUCKETS - 1;
+	value = histogram_value(i);
+	return (value > max ? max : value);
+}
+
+#endif  /* dss_histogram_c */
@@ -0,0 +1,38 @@
+#ifndef dss_histogram_h
+#define dss_histogram_h
+
+#ifdef WIN32
+	#include <windows.h>
+#else
+	#include <time.h>
+#endif
+#include "locking.h"
+
+// Timestamps from a monotonic clock, in microseconds
+typedef long long DSS_time_t;
+
+// Log-linear histogram of durations in microseconds. Values below
+// HISTOGRAM_SUBBUCKETS get a bucket each, above that every power of 2 is
+// split in HISTOGRAM_SUBBUCKETS linear buckets, so the relative error is
+// below 1/HISTOGRAM_SUBBUCKETS. Values beyond the last group (about 35 
+// minutes) are counted in the last bucket. Fixed size, no allocations.
+#define HISTOGRAM_SUBBITS 4
+#define HISTOGRAM_SUBBUCKETS (1 << HISTOGRAM_SUBBITS)
+#define HISTOGRAM_GROUPS 28
+#define HISTOGRAM_BUCKETS (HISTOGRAM_GROUPS * HISTOGRAM_SUBBUCKETS)
+
+// histogram structure, updated lock-free
+typedef struct histogram {
+	DSS_atomic_t Count;						// number of values recorded
+	DSS_atomic_t Max;						// highest value recorded
+	DSS_atomic_t Buckets[HISTOGRAM_BUCKETS];	// number of values per bucket
+} histogram_t;
+
+// Histogram operations
+DSS_time_t histogram_now();
+void histogram_reset(histogram_t* h);
+void histogram_record(histogram_t* h, DSS_time_t value);
+void histogram_merge(histogram_t* dst, histogram_t* src);
+DSS_time_t histogram_percentile(histogram_t* h, double p);
+
+#endif  /* dss_histogram_h */
@@ -62,4 +62,179 @@ void DSS_mutex_unlock(DSS_mutex_t* m)
 #endif
 }
 
+
+/*
+** ===============================================================
+** Read/write locking functions
+** ===============================================================
+*/
+// NOTE: read/write locks are NOT recursive
+
+// Initializes the lock, returns 0 upon success, 1 otherwise
+int DSS_rwlock_init(DSS_rwlock_t* l)
+{
+#ifdef WIN32
+	InitializeSRWLock(l);
+	return 0;
+#else
+	return pthread_rwlock_init(l, NULL);	// return 0 upon success
+#endif
+}
+
+// Destroy lock
+void DSS_rwlock_destroy(DSS_rwlock_t* l)
+{
+#ifdef WIN32
+	// nothing to do, SRW locks need no cleanup
+#else
+	pthread_rwlock_destroy(l);
+#endif
+}
+
+// Locks for shared (read) access
+void DSS_rwlock_readlock(DSS_rwlock_t* l)
+{
+#ifdef WIN32
+	AcquireSRWLockShared(l);
+#else
+	pthread_rwlock_rdlock(l);
+#endif
+}
+
+// Unlocks shared (read) access
+void DSS_rwlock_readunlock(DSS_rwlock_t* l)
+{
+#ifdef WIN32
+	ReleaseSRWLockShared(l);
+#else
+	pthread_rwlock_unlock(l);
+#endif
+}
+
+// Locks for exclusive (write) access
+void DSS_rwlock_writelock(DSS_rwlock_t* l)
+{
+#ifdef WIN32
+	AcquireSRWLockExclusive(l);
+#else
+	pthread_rwlock_wrlock(l);
+#endif
+}
+
+// Unlocks exclusive (write) access
+void DSS_rwlock_writeunlock(DSS_rwlock_t* l)
+{
+#ifdef WIN32
+	ReleaseSRWLockExclusive(l);
+#else
+	pthread_rwlock_unlock(l);
+#endif
+}
+
+
+/*
+** ===============================================================
+** Atomic operations
+** ===============================================================
+*/
+// All operations are full memory barriers
+
+// Adds value, returns the new value
+long DSS_atomic_add(DSS_atomic_t* a, long value)
+{
+#ifdef WIN32
+	return InterlockedExchangeAdd(a, value) + value;
+#else
+	return __atomic_add_fetch(a, value, __ATOMIC_SEQ_CST);
+#endif
+}
+
+// Reads value
+long DSS_atomic_get(DSS_atomic_t* a)
+{
+#ifdef WIN32
+	return InterlockedCompareExchange(a, 0, 0);
+#else
+	return __atomic_load_n(a, __ATOMIC_SEQ_CST);
+#endif
+}
+
+// Stores value, returns the previous value
+long DSS_atomic_swap(DSS_atomic_t* a, long value)
+{
+#ifdef WIN32
+	return InterlockedExchange(a, value);
+#else
+	return __atomic_exchange_n(a, value, __ATOMIC_SEQ_CST);
+#endif
+}
+
+// Stores value if the current value equals 'expected', returns the previous value
+long DSS_atomic_cas(DSS_atomic_t* a, long expected, long value)
+{
+#ifdef WIN32
+	return InterlockedCompareExchange(a, value, expected);
+#else
+	return __sync_val_compare_and_swap(a, expected, value);
+#endif
+}
+
+// Raises the value to at least 'value', returns the resulting value
+long DSS_atomic_max(DSS_atomic_t* a, long value)
+{
+	long current = DSS_atomic_get(a);
+
+	while (current < value)
+	{
+#ifdef WIN32
+		long previous = InterlockedCompareExchange(a, value, current);
+#else
+		long previous = __sync_val_compare_and_swap(a, current, value);
+#endif
+		if (previous == current) return value;	// we've set it
+		current = previous;						// changed meanwhile, retry
+	}
+	return current;
+}
+
+// Reads a pointer
+void* DSS_atomic_getptr(void* volatile* p)
+{
+#ifdef WIN32
+	return InterlockedCompareExchangePointer(p, NULL, NULL);
+#else
+	return __atomic_load_n(p, __ATOMIC_SEQ_CST);
+#endif
+}
+
+// Stores a pointer
+void DSS_atomic_setptr(void* volatile* p, void* value)
+{
+#ifdef WIN32
+	InterlockedExchangePointer(p, value);
+#else
+	__atomic_store_n(p, value, __ATOMIC_SEQ_CST);
+#endif
+}
+
+// Stores a pointer, returns the previous value
+void* DSS_atomic_swapptr(void* volatile* p, void* value)
+{
+#ifdef WIN32
+	return InterlockedExchangePointer(p, value);
+#else
+	return __atomic_exchange_n(p, value, __ATOMIC_SEQ_CST);
+#endif
+}
+
+// Gives up the remainder of the timeslice
+void DSS_yield()
+{
+#ifdef WIN32
+	SwitchToThread();
+#else
+	sched_yield();
+#endif
+}
+
 #endif
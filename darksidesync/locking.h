@@ -4,14 +4,38 @@
 #ifdef WIN32
 	#include <windows.h>
 	#define DSS_mutex_t HANDLE
+	#define DSS_rwlock_t SRWLOCK
 #else  // Unix
 	#include <pthread.h>
+	#include <sched.h>
 	#define DSS_mutex_t pthread_mutex_t
+	#define DSS_rwlock_t pthread_rwlock_t
 #endif
 
+// integer type for atomic operations
+typedef long volatile DSS_atomic_t;
+
 int DSS_mutex_init(DSS_mutex_t* m);
 void DSS_mutex_destroy(DSS_mutex_t* m);
 void DSS_mutex_lock(DSS_mutex_t* m);
 void DSS_mutex_unlock(DSS_mutex_t* m);
 
+int DSS_rwlock_init(DSS_rwlock_t* l);
+void DSS_rwlock_destroy(DSS_rwlock_t* l);
+void DSS_rwlock_readlock(DSS_rwlock_t* l);     // shared access
+void DSS_rwlock_readunlock(DSS_rwlock_t* l);
+void DSS_rwlock_writelock(DSS_rwlock_t* l);    // exclusive access
+void DSS_rwlock_writeunlock(DSS_rwlock_t* l);
+
+long DSS_atomic_add(DSS_atomic_t* a, long value);       // returns the new value
+long DSS_atomic_get(DSS_atomic_t* a);
+long DSS_atomic_swap(DSS_atomic_t* a, long value);      // returns the previous value
+long DSS_atomic_cas(DSS_atomic_t* a, long expected, long value); // returns the previous value
+long DSS_atomic_max(DSS_atomic_t* a, long value);       // returns the resulting value
+void* DSS_atomic_getptr(void* volatile* p);
+void DSS_atomic_setptr(void* volatile* p, void* value);
+void* DSS_atomic_swapptr(void* volatile* p, void* value);  // returns the previous value
+
+void DSS_yield();                               // give up the remainder of the timeslice
+
 #endif  /* dss_locking_h */
@@ -0,0 +1,131 @@
+#ifndef dss_pool_c
+#define dss_pool_c
+
+#include "pool.h"
+#include <stdlib.h>
+
+// Pool of recycled queue items, one per LuaState. Items are taken by the
+// producers (delivery_new) and returned by the consumer once they are done.
+// The pool has its own lock, so producers do not contend on the state lock.
+
+// Initialize the pool and preallocate 'size' items
+// returns 0 on success (an allocation failure while preallocating is not an error)
+int pool_init(pglobalRecord g, int size)
+{
+	g->PoolStart = NULL;
+	g->PoolCount = 0;
+	g->PoolSize = 0;
+	g->PoolHits = 0;
+	g->PoolMisses = 0;
+	if (DSS_mutex_init(&(g->PoolLock)) != 0) return 1;
+	pool_setsize(g, size);
+	return 0;
+}
+
+// Release all items in the pool, and the pool lock
+// NOTE: no more items may be returned after this call
+void pool_destroy(pglobalRecord g)
+{
+	pQueueItem pqi;
+	DSS_mutex_lock(&(g->PoolLock));
+	while (g->PoolStart != NULL)
+	{
+		pqi = g->PoolStart;
+		g->PoolStart = pqi->pNext;
+		free(pqi);
+	}
+	g->PoolCount = 0;
+	DSS_mutex_unlock(&(g->PoolLock));
+	DSS_mutex_destroy(&(g->PoolLock));
+}
+
+// Allocates a new item, with room for an inline payload
+static pQueueItem pool_newitem(size_t payloadsize)
+{
+	pQueueItem pqi = (pQueueItem)malloc(DSS_PAYLOAD_OFFSET + payloadsize);
+	if (pqi != NULL) pqi->PayloadSize = payloadsize;
+	return pqi;
+}
+
+// Gets an item, from the pool if available, allocates a new one otherwise
+// @payloadsize; required capacity of the inline payload buffer
+// returns; the item, or NULL if out of memory
+pQueueItem pool_getitem(pglobalRecord g, size_t payloadsize)
+{
+	pQueueItem pqi;
+
+	if (payloadsize > DSS_POOL_PAYLOADSIZE)
+	{
+		// too big for the pooled items, allocate a dedicated one
+		DSS_atomic_add(&(g->PoolMisses), 1);
+		return pool_newitem(payloadsize);
+	}
+
+	DSS_mutex_lock(&(g->PoolLock));
+	pqi = g->PoolStart;
+	if (pqi != NULL)
+	{
+		g->PoolStart = pqi->pNext;
+		g->PoolCount = g->PoolCount - 1;
+	}
+	DSS_mutex_unlock(&(g->PoolLock));
+
+	if (pqi != NULL)
+	{
+		DSS_atomic_add(&(g->PoolHits), 1);
+		return pqi;
+	}
+	DSS_atomic_add(&(g->PoolMisses), 1);
+	return pool_newitem(DSS_POOL_PAYLOADSIZE);
+}
+
+// Returns an item to the pool, it is freed if the pool is full (or if
+// it was allocated for a large payload)
+void pool_putitem(pglobalRecord g, pQueueItem pqi)
+{
+	if (pqi->PayloadSize != DSS_POOL_PAYLOADSIZE)
+	{
+		free(pqi);
+		return;
+	}
+
+	DSS_mutex_lock(&(g->PoolLock));
+	if (g->PoolCount < g->PoolSize)
+	{
+		pqi->pNext = g->PoolStart;
+		g->PoolStart = pqi;
+		g->PoolCount = g->PoolCount + 1;
+		pqi = NULL;
+	}
+	DSS_mutex_unlock(&(g->PoolLock));
+	if (pqi != NULL) free(pqi);
+}
+
+// Sets the number of free items the pool keeps. Allocates items
+// up to the new size, or frees the excess items.
+void pool_setsize(pglobalRecord g, int size)
+{
+	pQueueItem pqi;
+	if (size < 0) size = 0;
+
+	DSS_mutex_lock(&(g->PoolLock));
+	g->PoolSize = size;
+	while (g->PoolCount > size)
+	{
+		pqi = g->PoolStart;
+		g->PoolStart = pqi->pNext;
+		g->PoolCount = g->PoolCount - 1;
+		free(pqi);
+	}
+	while (g->PoolCount < size)
+	{
+		pqi = pool_newitem(DSS_POOL_PAYLOADSIZE);
+		if (pqi == NULL) break;		// will be allocated on demand then
+		pqi->pNext = g->PoolStart;
+		g->PoolStart = pqi;
+		g->PoolCount = g->PoolCount + 1;
+	}
+	DSS_mutex_unlock(&(g->PoolLock));
+}
+
+#endif  /* dss_pool_c */
@@ -0,0 +1,25 @@
+#ifndef dss_pool_h
+#define dss_pool_h
+
+#include "darksidesync.h"
+
+// Default number of free queue items kept in the pool of a LuaState
+// (also the number preallocated at startup)
+#define DSS_POOL_DEFAULTSIZE 64
+// Inline payload capacity of the items in the pool, items for larger
+// payloads are allocated on demand, and freed when done
+#define DSS_POOL_PAYLOADSIZE 128
+
+// Methods, see code for more detailed comments
+// Initialize the pool of a global record and preallocate its items
+int pool_init(pglobalRecord g, int size);
+// Release all items in the pool
+void pool_destroy(pglobalRecord g);
+// Get an item from the pool, or allocate one
+pQueueItem pool_getitem(pglobalRecord g, size_t payloadsize);
+// Return an item to the pool, or free it
+void pool_putitem(pglobalRecord g, pQueueItem pqi);
+// Change the number of free items kept
+void pool_setsize(pglobalRecord g, int size);
+
+#endif /* dss_pool_h */
@@ -0,0 +1,76 @@
+-- DSS tests; batch delivery
+-- run with the test host; ./dss_testhost batch_test.lua
+
+local dss = require("darksidesync")
+local SUCCESS, ITEM_DROPPED, QUEUE_FULL = -100, -98, -109
+dsstest.register()
+local got = {}
+dsstest.setcallback(function(value) got[#got+1] = value end)
+
+-- Deliver a batch
+-- Expected; all items queued in order, each decoded as usual
+assert(dsstest.batch(10, 5) == SUCCESS, "expected success")
+assert(dss.queuesize() == 5, "expected 5 queued items")
+assert(dss.dispatch() == 5, "expected 5 callbacks")
+assert(table.concat(got, ",") == "10,11,12,13,14", "unexpected values; "..table.concat(got, ","))
+print ("Ok\n")
+
+-- Batch and queue limits
+--   1) reject; a batch that does not fit is rejected as a whole
+--   2) dropnewest; the entire batch is cancelled
+--   3) dropoldest; older items make room for the batch
+got = {}
+dss.setlimit(4, "reject")
+assert(dsstest.batch(20, 3) == SUCCESS, "expected success")
+assert(dsstest.batch(30, 3) == QUEUE_FULL, "expected the batch to be rejected")
+assert(dsstest.batch(30, 5) == QUEUE_FULL, "expected a batch larger than the limit to be rejected")
+assert(dss.queuesize() == 3, "expected 3 queued items")
+dss.setlimit(4, "dropnewest")
+local cancelled = dsstest.cancelled()
+assert(dsstest.batch(40, 2) == ITEM_DROPPED, "expected the batch to be dropped")
+assert(dsstest.cancelled() == cancelled + 2, "expected both items to be cancelled")
+assert(dss.queuesize() == 3, "expected 3 queued items")
+dss.setlimit(4, "dropoldest")
+assert(dsstest.batch(50, 3) == ITEM_DROPPED, "expected older items to be dropped")
+assert(dss.queuesize() == 4, "expected 4 queued items")
+dss.dispatch()
+assert(table.concat(got, ",") == "22,50,51,52", "unexpected values; "..table.concat(got, ","))
+dss.setlimit(0)
+print ("Ok\n")
+
+-- Batch decoder
+--   1) set a batch decoder
+--   2) deliver a batch and a single item
+-- Expected; a single callback with all values, counting as one for 'dispatch'
+local batches = {}
+assert(dsstest.setbatchdecoder(function(list) batches[#batches+1] = table.concat(list, ",") end) == SUCCESS, "expected success")
+assert(dsstest.batch(1, 5) == SUCCESS, "expected success")
+assert(dsstest.deliver(6) == SUCCESS, "expected success")
+assert(dss.dispatch() == 1, "expected 1 callback")
+assert(#batches == 1 and batches[1] == "1,2,3,4,5,6", "unexpected batch; "..tostring(batches[1]))
+print ("Ok\n")
+
+-- Batch decoder and 'pollmany' limits, a batch counts as a single item
+batches = {}
+dsstest.batch(1, 3)
+local count, items = dss.pollmany(1)
+assert(count == 0 and #items == 2, "expected a single batch collected")
+items[1](unpack(items[2]))
+assert(batches[1] == "1,2,3", "unexpected batch; "..tostring(batches[1]))
+print ("Ok\n")
+
+-- Remove the batch decoder
+-- Expected; items are decoded one by one again
+got = {}
+assert(dsstest.setbatchdecoder(nil) == SUCCESS, "expected success")
+dsstest.batch(1, 3)
+assert(dss.dispatch() == 3, "expected 3 callbacks")
+assert(table.concat(got, ",") == "1,2,3", "unexpected values; "..table.concat(got, ","))
+print ("Ok\n")
+
+-- Batch still queued when the Lua state is closed
+-- Expected; cancelled (checked by the leak/sanitizer builds)
+dsstest.batch(1, 3)
+print ("Ok\n")
+
+print ("All tests passed!")
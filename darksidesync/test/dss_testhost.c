@@ -0,0 +1,503 @@
+// Test host for the scripted tests (the *_test.lua files in this directory).
+// It embeds Lua with darksidesync, and a background library ('dsstest') that
+// delivers test values through the DSS API, either from the Lua thread itself
+// or from producer threads. The Lua callback gets the values, and if a result
+// is expected, the `waitingthread_callback` as first argument.
+//
+// Build (Linux, against Lua 5.1, adjust LUAINC to where its headers are installed);
+//   LUAINC=/usr/include/lua5.1
+//   SRC="../darksidesync.c ../delivery.c ../locking.c ../udpsocket.c ../waithandle.c"
+//   SRC="$SRC ../fdsignal.c ../utiltable.c ../pool.c ../histogram.c ../event.c ../ticket.c"
+//   gcc -O2 -D_GNU_SOURCE -I.. -I$LUAINC -o dss_testhost dss_testhost.c $SRC -llua5.1 -lpthread -ldl
+//   for f in *_test.lua; do ./dss_testhost $f || break; done
+// Each script runs in a fresh Lua state, the host exits with 1 on the first
+// script that fails.
+//
+// The 'dsstest' library (a global in each Lua state);
+//   register()                 registers the library with DSS, returns its libid
+//   setcallback(f)             sets the Lua callback for the delivered values
+//   deliver(v [, prio [, key]])  delivers value 'v' (with a priority 0-2, and a
+//                              coalescing key), returns the DSS result code
+//   batch(first, count)        delivers a batch of values first..first+count-1,
+//                              returns the DSS result code
+//   setbatchdecoder(f)         decodes the values as a batch, calling f(list),
+//                              or stops batching if 'f' is nil. Returns the DSS result code
+//   async(v [, wantreturn])    delivers asynchronously, returns the ticket (or nil) and result code
+//   waitticket(t, timeout)     returns the ticket state
+//   releaseticket(t)           releases the ticket
+//   tickets()                  number of completed and cancelled tickets
+//   start(slot, v [, timeout]) starts a producer thread (slot 1-16), that delivers
+//                              value 'v'. With a timeout (ms, < 0 for none) it expects
+//                              a result from Lua, else it only delivers (possibly
+//                              blocked by the queue limit)
+//   join(slot)                 waits for the producer thread, returns the DSS result
+//                              code, and the result from Lua (or nil)
+//   cancelled()                number of values cancelled (decoded without a lua_State)
+//   sleep(seconds)
+//   newstate()                 creates another Lua state (in the same OS thread),
+//                              returns an object with methods 'run(code, ...)' (runs
+//                              the code in that state, returns its results of simple
+//                              types) and 'close()'
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <lua.h>
+#include <lauxlib.h>
+#include <lualib.h>
+#include "darksidesync_api.h"
+
+extern int luaopen_darksidesync(lua_State *L);
+
+#define TEST_SLOTS 16
+#define TEST_UTILID "dsstest.utilid"
+#define TEST_CALLBACK "dsstest.callback"
+#define TEST_BATCHCALLBACK "dsstest.batchcallback"
+#define TEST_STATE "dsstest.state"
+
+static void* libid = &libid;			// ID of the test library
+static pDSS_api_1v2_t api = NULL;
+static long cancelled = 0;				// values cancelled
+static long tickets[3];					// tickets completed, by DSS_TICKET_xxx state
+
+// a value delivered
+typedef struct testdata {
+	int value;
+	int result;		// result from Lua
+	int owned;		// if set, the item owns the data, the decoder releases it
+} testdata;
+
+// producer thread
+typedef struct testslot {
+	pthread_t thread;
+	int running;
+	void* utilid;
+	int wantresult;	// if set, deliver with 'delivertimeout', expecting a result
+	int timeout;
+	int code;		// DSS result code
+	testdata data;
+} testslot;
+
+static testslot slots[TEST_SLOTS];
+
+/*
+** ===============================================================
+** Test utility
+** ===============================================================
+*/
+static void cancel(void* id)
+{
+	api->unreg(id);
+}
+
+static int decode(lua_State *L, void* pData, void* id)
+{
+	testdata* d = (testdata*)pData;
+	int value = d->value;
+	(void)id;
+	if (d->owned) free(d);
+	if (L == NULL)
+	{
+		__sync_fetch_and_add(&cancelled, 1);
+		return 0;
+	}
+	lua_getfield(L, LUA_REGISTRYINDEX, TEST_CALLBACK);
+	lua_pushinteger(L, value);
+	return 2;
+}
+
+static int result(lua_State *L, void* pData, void* id, int garbage)
+{
+	testdata* d = (testdata*)pData;
+	(void)id;
+	if (L != NULL && !garbage && lua_gettop(L) >= 1)
+		d->result = (int)lua_tointeger(L, 1);
+	else
+		d->result = -1;
+	return 0;
+}
+
+static int batchdecode(lua_State *L, void** pData, int count, void* id)
+{
+	int i;
+	(void)id;
+	lua_getfield(L, LUA_REGISTRYINDEX, TEST_BATCHCALLBACK);
+	lua_createtable(L, count, 0);
+	for (i = 0; i < count; i++)
+	{
+		lua_pushinteger(L, ((testdata*)pData[i])->value);
+		lua_rawseti(L, -2, i + 1);
+		free(pData[i]);
+	}
+	return 2;
+}
+
+static void complete(void* ticket, void* pData, void* id, int state)
+{
+	(void)ticket;
+	(void)id;
+	__sync_fetch_and_add(&tickets[state], 1);
+	free(pData);
+}
+
+static testdata* newdata(int value, int owned)
+{
+	testdata* d = (testdata*)malloc(sizeof(testdata));
+	if (d == NULL) return NULL;
+	d->value = value;
+	d->result = 0;
+	d->owned = owned;
+	return d;
+}
+
+static void* producer(void* arg)
+{
+	testslot* s = (testslot*)arg;
+	testdata* d;
+
+	if (s->wantresult)
+		s->code = api->delivertimeout(s->utilid, DSS_PRIORITY_DEFAULT, decode, result, &s->data, s->timeout);
+	else if (NULL == (d = newdata(s->data.value, 1)))
+		s->code = DSS_ERR_OUT_OF_MEMORY;
+	else if ((s->code = api->deliver(s->utilid, decode, NULL, d)) < DSS_SUCCESS)
+		free(d);
+	return NULL;
+}
+
+/*
+** ===============================================================
+** Lua side
+** ===============================================================
+*/
+static void* getutilid(lua_State *L)
+{
+	void* id;
+	lua_getfield(L, LUA_REGISTRYINDEX, TEST_UTILID);
+	id = lua_touserdata(L, -1);
+	lua_pop(L, 1);
+	if (id == NULL) luaL_error(L, "dsstest is not registered");
+	return id;
+}
+
+static int L_register(lua_State *L)
+{
+	int err;
+	void* id;
+
+	lua_getfield(L, LUA_REGISTRYINDEX, DSS_REGISTRY_NAME);
+	if (!lua_istable(L, -1)) return luaL_error(L, "darksidesync is not loaded");
+	lua_getfield(L, -1, DSS_API_1v2_KEY);
+	api = (pDSS_api_1v2_t)lua_touserdata(L, -1);
+	lua_pop(L, 2);
+	if (api == NULL) return luaL_error(L, "darksidesync API 1.2 not found");
+
+	id = api->reg(L, libid, cancel, &err);
+	if (id == NULL) return luaL_error(L, "registering failed: %d", err);
+	lua_pushlightuserdata(L, id);
+	lua_setfield(L, LUA_REGISTRYINDEX, TEST_UTILID);
+	lua_pushlightuserdata(L, libid);
+	return 1;
+}
+
+static int L_setcallback(lua_State *L)
+{
+	luaL_checktype(L, 1, LUA_TFUNCTION);
+	lua_settop(L, 1);
+	lua_setfield(L, LUA_REGISTRYINDEX, TEST_CALLBACK);
+	return 0;
+}
+
+static int L_deliver(lua_State *L)
+{
+	void* id = getutilid(L);
+	int value = luaL_checkint(L, 1);
+	int priority = luaL_optint(L, 2, DSS_PRIORITY_DEFAULT);
+	void* key = (void*)(intptr_t)luaL_optint(L, 3, 0);
+	testdata* d = newdata(value, 1);
+	int r;
+
+	if (d == NULL) return luaL_error(L, "out of memory");
+	if (key == NULL)
+		r = api->deliverprio(id, priority, decode, NULL, d);
+	else
+		r = api->deliverkeyed(id, priority, key, decode, NULL, d);
+	if (r < DSS_SUCCESS && r != DSS_ERR_ITEM_DROPPED) free(d);	// on 'dropped' the item itself is cancelled
+	lua_pushinteger(L, r);
+	return 1;
+}
+
+static int L_batch(lua_State *L)
+{
+	void* id = getutilid(L);
+	int first = luaL_checkint(L, 1);
+	int count = luaL_checkint(L, 2);
+	DSS_batchitem_1v2_t* items;
+	int i, r;
+
+	luaL_argcheck(L, count > 0, 2, "count must be positive");
+	items = (DSS_batchitem_1v2_t*)lua_newuserdata(L, count * sizeof(DSS_batchitem_1v2_t));
+	for (i = 0; i < count; i++)
+	{
+		items[i].pDecode = decode;
+		items[i].pData = newdata(first + i, 1);
+	}
+	r = api->deliverbatch(id, DSS_PRIORITY_DEFAULT, items, count);
+	if (r < DSS_SUCCESS && r != DSS_ERR_ITEM_DROPPED)
+		for (i = 0; i < count; i++) free(items[i].pData);
+	lua_pushinteger(L, r);
+	return 1;
+}
+
+static int L_setbatchdecoder(lua_State *L)
+{
+	void* id = getutilid(L);
+	lua_settop(L, 1);
+	lua_pushvalue(L, 1);
+	lua_setfield(L, LUA_REGISTRYINDEX, TEST_BATCHCALLBACK);
+	lua_pushinteger(L, api->setbatchdecoder(id, decode, lua_isnil(L, 1) ? NULL : batchdecode));
+	return 1;
+}
+
+static int L_async(lua_State *L)
+{
+	void* id = getutilid(L);
+	testdata* d = newdata(luaL_checkint(L, 1), 0);	// released by 'complete'
+	void* t;
+	int err;
+
+	if (d == NULL) return luaL_error(L, "out of memory");
+	t = api->deliverasync(id, DSS_PRIORITY_DEFAULT, decode, (lua_toboolean(L, 2) ? result : NULL), complete, d, &err);
+	if (t == NULL)
+	{
+		free(d);
+		lua_pushnil(L);
+	}
+	else
+		lua_pushlightuserdata(L, t);
+	lua_pushinteger(L, err);
+	return 2;
+}
+
+static int L_waitticket(lua_State *L)
+{
+	luaL_checktype(L, 1, LUA_TLIGHTUSERDATA);
+	lua_pushinteger(L, api->waitticket(lua_touserdata(L, 1), luaL_checkint(L, 2)));
+	return 1;
+}
+
+static int L_releaseticket(lua_State *L)
+{
+	luaL_checktype(L, 1, LUA_TLIGHTUSERDATA);
+	api->releaseticket(lua_touserdata(L, 1));
+	return 0;
+}
+
+static int L_tickets(lua_State *L)
+{
+	lua_pushinteger(L, tickets[DSS_TICKET_COMPLETED]);
+	lua_pushinteger(L, tickets[DSS_TICKET_CANCELLED]);
+	return 2;
+}
+
+static testslot* checkslot(lua_State *L, int idx)
+{
+	int slot = luaL_checkint(L, idx);
+	luaL_argcheck(L, slot >= 1 && slot <= TEST_SLOTS, idx, "invalid slot");
+	return &slots[slot - 1];
+}
+
+static int L_start(lua_State *L)
+{
+	testslot* s = checkslot(L, 1);
+
+	if (s->running) return luaL_error(L, "slot is in use");
+	s->utilid = getutilid(L);
+	s->wantresult = !lua_isnoneornil(L, 3);
+	s->timeout = (s->wantresult ? luaL_checkint(L, 3) : -1);
+	s->code = 0;
+	s->data.value = luaL_checkint(L, 2);
+	s->data.result = 0;
+	s->data.owned = 0;
+	if (pthread_create(&s->thread, NULL, producer, s) != 0) return luaL_error(L, "failed to start thread");
+	s->running = 1;
+	return 0;
+}
+
+static int L_join(lua_State *L)
+{
+	testslot* s = checkslot(L, 1);
+
+	if (!s->running) return luaL_error(L, "slot is not in use");
+	pthread_join(s->thread, NULL);
+	s->running = 0;
+	lua_pushinteger(L, s->code);
+	if (s->wantresult && s->code >= DSS_SUCCESS)
+		lua_pushinteger(L, s->data.result);
+	else
+		lua_pushnil(L);
+	return 2;
+}
+
+static int L_cancelled(lua_State *L)
+{
+	lua_pushinteger(L, cancelled);
+	return 1;
+}
+
+static int L_sleep(lua_State *L)
+{
+	usleep((useconds_t)(luaL_checknumber(L, 1) * 1000000));
+	return 0;
+}
+
+static lua_State* newstate();
+
+static lua_State** checkstate(lua_State *L)
+{
+	lua_State** S = (lua_State**)luaL_checkudata(L, 1, TEST_STATE);
+	if (*S == NULL) luaL_error(L, "Lua state is closed");
+	return S;
+}
+
+static int L_newstate(lua_State *L)
+{
+	lua_State** S = (lua_State**)lua_newuserdata(L, sizeof(lua_State*));
+	*S = newstate();
+	if (*S == NULL) return luaL_error(L, "failed to create Lua state");
+	luaL_getmetatable(L, TEST_STATE);
+	lua_setmetatable(L, -2);
+	return 1;
+}
+
+// runs a chunk in another state, arguments and results are copied (simple types only)
+static int L_run(lua_State *L)
+{
+	lua_State* S = *checkstate(L);
+	const char* code = luaL_checkstring(L, 2);
+	int n = lua_gettop(L);
+	int i, base;
+
+	base = lua_gettop(S);
+	if (luaL_loadstring(S, code) != 0) goto failed;
+	for (i = 3; i <= n; i++)
+	{
+		switch (lua_type(L, i)) {
+			case LUA_TNUMBER: lua_pushnumber(S, lua_tonumber(L, i)); break;
+			case LUA_TBOOLEAN: lua_pushboolean(S, lua_toboolean(L, i)); break;
+			case LUA_TSTRING: lua_pushstring(S, lua_tostring(L, i)); break;
+			case LUA_TLIGHTUSERDATA: lua_pushlightuserdata(S, lua_touserdata(L, i)); break;
+			default: lua_pushnil(S);
+		}
+	}
+	if (lua_pcall(S, n - 2, LUA_MULTRET, 0) != 0) goto failed;
+
+	n = lua_gettop(S) - base;
+	luaL_checkstack(L, n, "too many results");
+	for (i = base + 1; i <= base + n; i++)
+	{
+		switch (lua_type(S, i)) {
+			case LUA_TNUMBER: lua_pushnumber(L, lua_tonumber(S, i)); break;
+			case LUA_TBOOLEAN: lua_pushboolean(L, lua_toboolean(S, i)); break;
+			case LUA_TSTRING: lua_pushstring(L, lua_tostring(S, i)); break;
+			case LUA_TLIGHTUSERDATA: lua_pushlightuserdata(L, lua_touserdata(S, i)); break;
+			default: lua_pushnil(L);
+		}
+	}
+	lua_settop(S, base);
+	return n;
+
+failed:
+	lua_pushstring(L, lua_tostring(S, -1));
+	lua_settop(S, base);
+	return lua_error(L);
+}
+
+static int L_close(lua_State *L)
+{
+	lua_State** S = (lua_State**)luaL_checkudata(L, 1, TEST_STATE);
+	if (*S != NULL) lua_close(*S);
+	*S = NULL;
+	return 0;
+}
+
+static const struct luaL_Reg dsstest[] = {
+	{"register",L_register},
+	{"setcallback",L_setcallback},
+	{"deliver",L_deliver},
+	{"batch",L_batch},
+	{"setbatchdecoder",L_setbatchdecoder},
+	{"async",L_async},
+	{"waitticket",L_waitticket},
+	{"releaseticket",L_releaseticket},
+	{"tickets",L_tickets},
+	{"start",L_start},
+	{"join",L_join},
+	{"cancelled",L_cancelled},
+	{"sleep",L_sleep},
+	{"newstate",L_newstate},
+	{NULL,NULL}
+};
+
+static const struct luaL_Reg statemethods[] = {
+	{"run",L_run},
+	{"close",L_close},
+	{"__gc",L_close},
+	{NULL,NULL}
+};
+
+// creates a Lua state, with darksidesync available through 'require', and
+// the 'dsstest' library
+static lua_State* newstate()
+{
+	lua_State *L = luaL_newstate();
+	if (L == NULL) return NULL;
+	luaL_openlibs(L);
+	lua_getglobal(L, "package");
+	lua_getfield(L, -1, "preload");
+	lua_pushcfunction(L, luaopen_darksidesync);
+	lua_setfield(L, -2, "darksidesync");
+	lua_pop(L, 2);
+	luaL_newmetatable(L, TEST_STATE);
+	lua_pushvalue(L, -1);
+	lua_setfield(L, -2, "__index");
+	luaL_register(L, NULL, statemethods);
+	lua_pop(L, 1);
+	luaL_register(L, "dsstest", dsstest);
+	lua_pop(L, 1);
+	return L;
+}
+
+int main(int argc, char** argv)
+{
+	lua_State *L;
+	int i;
+
+	if (argc < 2)
+	{
+		fprintf(stderr, "usage: %s <script.lua> [...]\n", argv[0]);
+		return 2;
+	}
+	for (i = 1; i < argc; i++)
+	{
+		printf("Running %s\n", argv[i]);
+		cancelled = 0;
+		memset(tickets, 0, sizeof(tickets));
+		L = newstate();
+		if (L == NULL)
+		{
+			fprintf(stderr, "failed to create Lua state\n");
+			return 1;
+		}
+		if (luaL_dofile(L, argv[i]) != 0)
+		{
+			fprintf(stderr, "%s: FAILED; %s\n", argv[i], lua_tostring(L, -1));
+			lua_close(L);
+			return 1;
+		}
+		lua_close(L);
+	}
+	return 0;
+}
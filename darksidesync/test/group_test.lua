@@ -0,0 +1,90 @@
+-- DSS tests; shared consumer groups
+-- run with the test host; ./dss_testhost group_test.lua
+-- The members are Lua states in the same OS thread, see 'newstate'.
+
+local dss = require("darksidesync")
+local SUCCESS = -100
+local got = {}
+
+-- Joining a group
+-- Expected; 1, joining another (or the same) group fails
+assert(dss.join("workers") == 1, "expected to join the group")
+local result, err = dss.join("others")
+assert(result == nil and type(err) == "string", "expected nil + error msg")
+local libid = dsstest.register()
+dsstest.setcallback(function(value) got[#got+1] = value end)
+print ("Ok\n")
+
+-- A second member
+local worker = dsstest.newstate()
+worker:run([[
+  dss = require("darksidesync")
+  assert(dss.join("workers") == 1, "expected to join the group")
+  dsstest.register()
+  got = {}
+  dsstest.setcallback(function(a, b)
+    if b then a(b * 2) else got[#got+1] = a end
+  end)
+]])
+
+-- Items are taken by whichever member polls
+--   1) deliver from the first member, poll from the second
+--   2) deliver from the second member, poll from the first
+-- Expected; the items are shared
+assert(dsstest.deliver(1) == SUCCESS and dsstest.deliver(2) == SUCCESS, "expected success")
+assert(worker:run("return dss.dispatch()") == 2, "expected the worker to handle 2 items")
+assert(worker:run("return table.concat(got, ',')") == "1,2", "unexpected values in the worker")
+assert(dss.dispatch() == 0, "expected nothing left for the first member")
+assert(worker:run("return dsstest.deliver(3)") == SUCCESS, "expected success")
+assert(dss.dispatch() == 1, "expected the first member to handle 1 item")
+assert(table.concat(got, ",") == "3", "unexpected values; "..table.concat(got, ","))
+print ("Ok\n")
+
+-- The waitingthread_callback is handled by the member that polled the item
+-- Expected; the result of the worker
+dsstest.start(1, 21, 5000)
+assert(worker:run("local n repeat n = dss.dispatch() until n > 0 return n") == 1, "expected the worker to handle 1 item")
+local code, answer = dsstest.join(1)
+assert(code == SUCCESS and answer == 42, "expected the result of the worker")
+print ("Ok\n")
+
+-- Limits and statistics per member, through the libid
+-- Expected; the limit of the instance of the member applies
+assert(dss.setlimit(1, "reject", libid) == 1, "expected success")
+assert(dsstest.deliver(4) == SUCCESS, "expected success")
+assert(dsstest.deliver(5) ~= SUCCESS, "expected the item to be rejected")
+assert(worker:run("return dsstest.deliver(6)") == SUCCESS, "expected the worker instance to have no limit")
+assert(dss.stats().utilities[libid].delivered == 4, "expected 4 items delivered by the first member")
+assert(worker:run("return dss.dispatch()") == 2, "expected the worker to handle 2 items")
+dss.setlimit(0, "reject", libid)
+print ("Ok\n")
+
+-- A member leaving
+--   1) deliver from the worker, close it
+-- Expected; its queued items are cancelled, the group remains
+local cancelled = dsstest.cancelled()
+assert(worker:run("return dsstest.deliver(7)") == SUCCESS, "expected success")
+worker:close()
+assert(dsstest.cancelled() == cancelled + 1, "expected the item of the worker to be cancelled")
+assert(dss.dispatch() == 0, "expected nothing to handle")
+got = {}
+assert(dsstest.deliver(8) == SUCCESS, "expected success")
+assert(dss.dispatch() == 1 and got[1] == 8, "expected the group to remain")
+print ("Ok\n")
+
+-- Rejoining after the worker left
+-- Expected; a new member gets the items
+worker = dsstest.newstate()
+worker:run([[
+  dss = require("darksidesync")
+  dss.join("workers")
+  dsstest.register()
+  got = 0
+  dsstest.setcallback(function(value) got = got + 1 end)
+]])
+dsstest.deliver(9)
+assert(worker:run("dss.dispatch() return got") == 1, "expected the new worker to handle the item")
+worker:close()
+print ("Ok\n")
+
+print ("All tests passed!")
@@ -0,0 +1,59 @@
+-- DSS tests; keyed coalescing
+-- run with the test host; ./dss_testhost keyed_test.lua
+
+local dss = require("darksidesync")
+local SUCCESS, QUEUE_FULL = -100, -109
+local NORMAL = 1
+local libid = dsstest.register()
+local got = {}
+dsstest.setcallback(function(value) got[#got+1] = value end)
+
+-- Items with the same key replace each other
+--   1) deliver keys 1, 2, 1, an item without key, 1, 3
+-- Expected; one item per key, at the position of the first, with the latest value
+assert(dsstest.deliver(10, NORMAL, 1) == SUCCESS, "expected success")
+assert(dsstest.deliver(20, NORMAL, 2) == SUCCESS, "expected success")
+assert(dsstest.deliver(11, NORMAL, 1) == SUCCESS, "expected success")
+assert(dsstest.deliver(99) == SUCCESS, "expected success")
+assert(dsstest.deliver(12, NORMAL, 1) == SUCCESS, "expected success")
+assert(dsstest.deliver(30, NORMAL, 3) == SUCCESS, "expected success")
+assert(dss.queuesize() == 4, "expected 4 queued items")
+assert(dsstest.cancelled() == 2, "expected the 2 replaced items to be cancelled")
+dss.dispatch()
+assert(table.concat(got, ",") == "12,20,99,30", "unexpected order; "..table.concat(got, ","))
+print ("Ok\n")
+
+-- After polling the key is free again
+-- Expected; only the latest value is delivered
+got = {}
+dsstest.deliver(13, NORMAL, 1)
+dsstest.deliver(14, NORMAL, 1)
+dss.dispatch()
+assert(table.concat(got, ",") == "14", "expected only the latest value")
+assert(dss.stats().cancelled == 3, "expected 3 cancelled items in the stats")
+print ("Ok\n")
+
+-- Replacing items at the queue limit
+--   1) fill the queue to its limit, with keyed items
+--   2) replace one
+--   3) deliver another key
+-- Expected; the replacement is accepted, the new key is rejected
+got = {}
+dss.setlimit(2, "reject", libid)
+assert(dsstest.deliver(1, NORMAL, 1) == SUCCESS, "expected success")
+assert(dsstest.deliver(2, NORMAL, 2) == SUCCESS, "expected success")
+assert(dsstest.deliver(3, NORMAL, 1) == SUCCESS, "expected the replacement to be accepted")
+assert(dsstest.deliver(4, NORMAL, 3) == QUEUE_FULL, "expected a new key to be rejected")
+assert(dss.queuesize() == 2, "expected 2 queued items")
+dss.dispatch()
+assert(table.concat(got, ",") == "3,2", "unexpected values; "..table.concat(got, ","))
+dss.setlimit(0, "reject", libid)
+print ("Ok\n")
+
+-- Keyed items still queued when the Lua state is closed
+-- Expected; cancelled (checked by the leak/sanitizer builds)
+dsstest.deliver(1, NORMAL, 5)
+dsstest.deliver(2, NORMAL, 5)
+print ("Ok\n")
+
+print ("All tests passed!")
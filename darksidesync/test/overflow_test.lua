@@ -0,0 +1,87 @@
+-- DSS tests; queue limits and overflow policies
+-- run with the test host; ./dss_testhost overflow_test.lua
+
+local dss = require("darksidesync")
+local SUCCESS, ITEM_DROPPED, CONGESTED, QUEUE_FULL = -100, -98, -97, -109
+local libid = dsstest.register()
+local got = {}
+dsstest.setcallback(function(value) got[#got+1] = value end)
+
+-- Defaults
+-- Expected; unlimited, with the 'reject' policy
+local max, policy = dss.getlimit()
+assert(max == 0 and policy == "reject", "expected no limit, and 'reject'")
+print ("Ok\n")
+
+-- Policy 'reject'
+-- Expected; the item over the limit is not queued
+dss.setlimit(3)
+for i = 1, 3 do assert(dsstest.deliver(i) == SUCCESS, "expected success") end
+assert(dsstest.deliver(4) == QUEUE_FULL, "expected the item to be rejected")
+assert(dss.queuesize() == 3, "expected 3 queued items")
+print ("Ok\n")
+
+-- Policy 'dropnewest'
+-- Expected; the new item is cancelled
+dss.setlimit(3, "dropnewest")
+local cancelled = dsstest.cancelled()
+assert(dsstest.deliver(5) == ITEM_DROPPED, "expected the item to be dropped")
+assert(dsstest.cancelled() == cancelled + 1, "expected the new item to be cancelled")
+assert(dss.queuesize() == 3, "expected 3 queued items")
+print ("Ok\n")
+
+-- Policy 'dropoldest'
+-- Expected; the oldest item is cancelled to make room
+dss.setlimit(3, "dropoldest")
+assert(dsstest.deliver(6) == ITEM_DROPPED, "expected an item to be dropped")
+assert(dss.queuesize() == 3, "expected 3 queued items")
+dss.dispatch()
+assert(table.concat(got, ",") == "2,3,6", "unexpected values; "..table.concat(got, ","))
+print ("Ok\n")
+
+-- Limit per library
+-- Expected; the limit of the library applies, next to the one of the Lua state
+got = {}
+dss.setlimit(0)
+assert(dss.setlimit(2, "reject", libid) == 1, "expected success")
+max, policy = dss.getlimit(libid)
+assert(max == 2 and policy == "reject", "expected the limit of the library")
+assert(not pcall(dss.setlimit, 2, "reject", {}), "expected an error on an invalid libid")
+assert(dsstest.deliver(1) == SUCCESS and dsstest.deliver(2) == SUCCESS, "expected success")
+assert(dsstest.deliver(3) == QUEUE_FULL, "expected the item to be rejected")
+dss.dispatch()
+dss.setlimit(0, "reject", libid)
+print ("Ok\n")
+
+-- Watermarks
+-- Expected; congested when reaching the high watermark, until below the low watermark
+dss.setwatermarks(3, 1)
+assert(dsstest.deliver(1) == SUCCESS and dsstest.deliver(2) == SUCCESS, "expected success")
+assert(dsstest.deliver(3) == CONGESTED, "expected the queue to be congested")
+assert(select(3, dss.getwatermarks()) == true, "expected the queue to be congested")
+dss.poll()
+assert(select(3, dss.getwatermarks()) == true, "expected the queue to remain congested")
+dss.poll()
+dss.poll()
+assert(select(3, dss.getwatermarks()) == false, "expected the queue to be no longer congested")
+dss.setwatermarks(0)
+print ("Ok\n")
+
+-- Policy 'block'
+--   1) fill the queue to its limit
+--   2) deliver from producer threads
+--   3) poll
+-- Expected; the producers are blocked until there is room
+got = {}
+dss.setlimit(1, "block")
+assert(dsstest.deliver(1) == SUCCESS, "expected success")
+dsstest.start(1, 2)
+dsstest.start(2, 3)
+dsstest.sleep(0.1)
+assert(dss.queuesize() == 1, "expected the producers to be blocked")
+while #got < 3 do dss.dispatch() end
+assert(dsstest.join(1) == SUCCESS and dsstest.join(2) == SUCCESS, "expected success")
+assert(dss.queuesize() == 0, "expected an empty queue")
+print ("Ok\n")
+
+print ("All tests passed!")
@@ -0,0 +1,76 @@
+-- DSS tests; priorities
+-- run with the test host; ./dss_testhost priority_test.lua
+
+local dss = require("darksidesync")
+local SUCCESS, INVALID_PRIORITY = -100, -110
+local HIGH, NORMAL, LOW = 0, 1, 2
+local libid = dsstest.register()
+local got = {}
+dsstest.setcallback(function(value) got[#got+1] = value end)
+
+-- Items are polled by priority
+-- Expected; high before normal before low, in order of delivery within a level
+assert(dss.getpriority(libid) == "normal", "expected 'normal' as default priority")
+dsstest.deliver(1, LOW)
+dsstest.deliver(2, NORMAL)
+dsstest.deliver(3, HIGH)
+dsstest.deliver(4)
+dsstest.deliver(5, HIGH)
+dss.dispatch()
+assert(table.concat(got, ",") == "3,5,2,4,1", "unexpected order; "..table.concat(got, ","))
+print ("Ok\n")
+
+-- Invalid priorities
+-- Expected; error
+assert(dsstest.deliver(1, 3) == INVALID_PRIORITY, "expected an invalid priority")
+assert(dsstest.deliver(1, -2) == INVALID_PRIORITY, "expected an invalid priority")
+assert(dss.queuesize() == 0, "expected an empty queue")
+print ("Ok\n")
+
+-- Default priority of a library
+-- Expected; items without priority get the default set from Lua
+got = {}
+assert(dss.setpriority("high", libid) == 1, "expected success")
+assert(dss.getpriority(libid) == "high", "expected 'high'")
+dsstest.deliver(1, NORMAL)
+dsstest.deliver(2)
+dss.dispatch()
+assert(table.concat(got, ",") == "2,1", "unexpected order; "..table.concat(got, ","))
+dss.setpriority("normal", libid)
+assert(not pcall(dss.setpriority, "urgent", libid), "expected an error on an invalid priority")
+print ("Ok\n")
+
+-- Aging; a low priority item behind a flood of high priority items
+-- Expected; it is not starved
+got = {}
+dsstest.deliver(999, LOW)
+for i = 1, 100 do dsstest.deliver(i, HIGH) end
+dss.dispatch()
+local pos
+for i, v in ipairs(got) do if v == 999 then pos = i end end
+print("low priority item handled at position", pos)
+assert(pos ~= nil and pos <= 9, "expected the low priority item to be aged")
+print ("Ok\n")
+
+-- 'pollmany' honours the priorities
+got = {}
+dsstest.deliver(1, LOW)
+dsstest.deliver(2, HIGH)
+local count, items = dss.pollmany()
+assert(count == 0 and #items == 4, "expected 2 items collected")
+for i = 1, #items, 2 do items[i](unpack(items[i+1])) end
+assert(table.concat(got, ",") == "2,1", "unexpected order; "..table.concat(got, ","))
+print ("Ok\n")
+
+-- Policy 'dropoldest' drops the lowest priority first
+got = {}
+dss.setlimit(2, "dropoldest")
+dsstest.deliver(1, HIGH)
+dsstest.deliver(2, LOW)
+dsstest.deliver(3, NORMAL)
+dss.dispatch()
+assert(table.concat(got, ",") == "1,3", "unexpected values; "..table.concat(got, ","))
+dss.setlimit(0)
+print ("Ok\n")
+
+print ("All tests passed!")
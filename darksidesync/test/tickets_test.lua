@@ -0,0 +1,99 @@
+-- DSS tests; tickets (asynchronous deliveries) and timeouts
+-- run with the test host; ./dss_testhost tickets_test.lua
+
+local dss = require("darksidesync")
+local SUCCESS, TIMEOUT = -100, -112
+local PENDING, COMPLETED, CANCELLED = 0, 1, 2
+dsstest.register()
+
+-- Asynchronous delivery expecting a result
+--   1) deliver, the ticket is pending
+--   2) poll, the ticket remains pending until the result is returned
+--   3) return the result
+-- Expected; the ticket completes
+dsstest.setcallback(function(wcb, value) wcb(value * 2) end)
+local ticket, err = dsstest.async(21, true)
+assert(ticket ~= nil and err == SUCCESS, "expected a ticket")
+assert(dsstest.waitticket(ticket, 0) == PENDING, "expected the ticket to be pending")
+assert(dsstest.waitticket(ticket, 20) == PENDING, "expected the wait to time out, ticket still pending")
+local count, callback, args = dss.poll()
+assert(count == 0, "expected the queue to be empty after polling")
+assert(dsstest.waitticket(ticket, 0) == PENDING, "expected the ticket to be pending until the result is returned")
+callback(unpack(args))
+assert(dsstest.waitticket(ticket, -1) == COMPLETED, "expected the ticket to be completed")
+dsstest.releaseticket(ticket)
+assert(dsstest.tickets() == 1, "expected 1 completed ticket")
+print ("Ok\n")
+
+-- Asynchronous delivery without a result, ticket released before completion
+--   1) deliver, release the ticket
+--   2) poll
+-- Expected; the completion function is still called
+dsstest.setcallback(function(value) end)
+ticket = dsstest.async(5, false)
+dsstest.releaseticket(ticket)
+assert(dss.dispatch() == 1, "expected 1 callback")
+assert(dsstest.tickets() == 2, "expected 2 completed tickets")
+print ("Ok\n")
+
+-- Ticket of an item for which the waitingthread_callback is garbage collected
+-- Expected; the ticket is cancelled
+dsstest.setcallback(function(wcb, value) end)
+ticket = dsstest.async(6, true)
+assert(dss.dispatch() == 1, "expected 1 callback")
+collectgarbage()
+collectgarbage()
+assert(dsstest.waitticket(ticket, 1000) == CANCELLED, "expected the ticket to be cancelled")
+dsstest.releaseticket(ticket)
+local completed, cancelled = dsstest.tickets()
+assert(completed == 2 and cancelled == 1, "expected 2 completed and 1 cancelled ticket")
+print ("Ok\n")
+
+-- Delivery with a timeout, answered in time
+-- Expected; success and the result
+local called = 0
+dsstest.setcallback(function(wcb, value) called = called + 1; wcb(value * 2) end)
+dsstest.start(1, 10, 2000)
+repeat count = dss.dispatch() until count > 0
+local code, result = dsstest.join(1)
+assert(code == SUCCESS, "expected success, got "..tostring(code))
+assert(result == 20, "expected the result to be 20")
+print ("Ok\n")
+
+-- Delivery with a timeout, not polled in time
+--   1) deliver, do not poll
+--   2) poll after the timeout
+-- Expected; timeout error, the item is dropped without calling the callback
+called = 0
+dsstest.start(1, 11, 20)
+code, result = dsstest.join(1)
+assert(code == TIMEOUT, "expected a timeout, got "..tostring(code))
+assert(result == nil, "expected no result")
+assert(dss.dispatch() == 0, "expected the timed out item to be dropped")
+assert(called == 0, "expected the callback not to be called")
+assert(dss.queuesize() == 0, "expected an empty queue")
+print ("Ok\n")
+
+-- Delivery with a timeout, polled in time but answered too late
+--   1) deliver and poll, keep the waitingthread_callback
+--   2) call it after the timeout
+-- Expected; timeout error, the late answer is discarded
+local keep
+dsstest.setcallback(function(wcb, value) keep = wcb end)
+dsstest.start(1, 12, 20)
+repeat count = dss.dispatch() until count > 0
+code, result = dsstest.join(1)
+assert(code == TIMEOUT, "expected a timeout, got "..tostring(code))
+assert(keep ~= nil, "expected a waitingthread_callback")
+keep(24)
+keep = nil
+collectgarbage()
+print ("Ok\n")
+
+-- Pending ticket when the Lua state is closed
+-- Expected; the item is cancelled (checked by the leak/sanitizer builds)
+ticket = dsstest.async(7, true)
+dsstest.releaseticket(ticket)
+print ("Ok\n")
+
+print ("All tests passed!")
@@ -0,0 +1,96 @@
+#ifndef dss_ticket_c
+#define dss_ticket_c
+
+#include <stdlib.h>
+#include "ticket.h"
+
+// Creates a new pending ticket, with a reference for the owner and one for
+// the queue item. Returns NULL upon failure.
+// NOTE: the waithandle is a dedicated one, not the cached one of the thread,
+//       the ticket may be waited on from any thread, and may outlive the wait.
+pDSS_ticket ticket_new(DSS_complete_1v1_t pComplete)
+{
+	pDSS_ticket t = (pDSS_ticket)malloc(sizeof(DSS_ticket_t));
+	if (t == NULL) return NULL;
+	t->pWaitHandle = DSS_waithandle_create();
+	if (t->pWaitHandle == NULL)
+	{
+		free(t);
+		return NULL;
+	}
+	t->State = DSS_TICKET_PENDING;
+	t->Refs = 2;
+	t->Queued = 1;
+	t->pComplete = pComplete;
+	return t;
+}
+
+// Claims a pending ticket, before calling the decoder or return function
+// returns 0 if the ticket was abandoned, the functions must not be called
+int ticket_claim(pDSS_ticket t)
+{
+	return (DSS_atomic_cas(&(t->State), DSS_TICKET_PENDING, DSS_TICKET_BUSY) == DSS_TICKET_PENDING);
+}
+
+// Releases the claim, while the item waits for Lua
+void ticket_unclaim(pDSS_ticket t)
+{
+	DSS_atomic_swap(&(t->State), DSS_TICKET_PENDING);
+}
+
+// Completes a claimed (or abandoned) ticket, calls the completion function 
+// and wakes a waiting thread. Drops the reference of the queue item, so it 
+// must be called exactly once per ticket.
+// @state; DSS_TICKET_COMPLETED or DSS_TICKET_CANCELLED
+void ticket_complete(pDSS_ticket t, void* pData, void* utilid, int state)
+{
+	if (DSS_atomic_get(&(t->State)) != DSS_TICKET_ABANDONED)
+	{
+		// call it first, a thread seeing the final state can rely on it being done
+		if (t->pComplete != NULL) t->pComplete(t, pData, utilid, state);
+		DSS_atomic_swap(&(t->State), state);
+		DSS_waithandle_signal(t->pWaitHandle);
+	}
+	ticket_release(t);
+}
+
+// Waits for the ticket to complete
+// @timeout; milliseconds, 0 to check only, < 0 to wait until completed
+// returns the state of the ticket, DSS_TICKET_PENDING while claimed
+int ticket_wait(pDSS_ticket t, int timeout)
+{
+	int state = DSS_atomic_get(&(t->State));
+	if ((state != DSS_TICKET_PENDING && state != DSS_TICKET_BUSY) || timeout == 0) 
+		return (state == DSS_TICKET_BUSY ? DSS_TICKET_PENDING : state);
+	// the state is set before signalling, so it is final once passed
+	if (DSS_waithandle_timedwait(t->pWaitHandle, timeout)) return DSS_atomic_get(&(t->State));
+	return DSS_TICKET_PENDING;
+}
+
+// Abandons a pending ticket, waits for a running decoder or return function
+// to finish first. Only the owner may abandon its ticket.
+// returns 1 if abandoned, 0 if the ticket completed meanwhile
+int ticket_abandon(pDSS_ticket t)
+{
+	long state;
+	while (1)
+	{
+		state = DSS_atomic_cas(&(t->State), DSS_TICKET_PENDING, DSS_TICKET_ABANDONED);
+		if (state == DSS_TICKET_PENDING) return 1;
+		if (state != DSS_TICKET_BUSY) return 0;
+		DSS_yield();	// claimed, the C functions called are short
+	}
+}
+
+// Drops a reference, destroys the ticket with the last one
+void ticket_release(pDSS_ticket t)
+{
+	if (t == NULL) return;
+	if (DSS_atomic_add(&(t->Refs), -1) == 0)
+	{
+		DSS_waithandle_delete(t->pWaitHandle);
+		free(t);
+	}
+}
+
+#endif
@@ -0,0 +1,36 @@
+#ifndef dss_ticket_h
+#define dss_ticket_h
+
+#include "darksidesync_api.h"
+#include "locking.h"
+#include "waithandle.h"
+
+// Ticket of an asynchronous delivery (see 'deliverasync' in the API). It is
+// referenced by the producer that owns it, and by the queue item until the
+// item is done. The last one to let go destroys it.
+// A producer may abandon a pending ticket (when it stops waiting), after which
+// DSS will no longer touch the 'pData' of the item. To make that safe, DSS
+// claims the ticket while calling the decoder or return function.
+
+// Internal ticket states, next to the DSS_TICKET_xxx states of the API
+#define DSS_TICKET_BUSY 3			// claimed; DSS is calling the decoder or return function
+#define DSS_TICKET_ABANDONED 4		// the producer stopped waiting, 'pData' is no longer valid
+typedef struct DSS_ticket *pDSS_ticket;
+typedef struct DSS_ticket {
+	DSS_atomic_t State;				// DSS_TICKET_xxx
+	DSS_atomic_t Refs;				// number of references (owner and item)
+	DSS_atomic_t Queued;			// 1 while the item counts against the queue limits (see delivery_abandon)
+	pDSS_waithandle pWaitHandle;	// signalled upon completion, for 'waitticket'
+	DSS_complete_1v1_t pComplete;	// completion function, or NULL
+} DSS_ticket_t;
+
+// Ticket operations
+pDSS_ticket ticket_new(DSS_complete_1v1_t pComplete);
+int ticket_claim(pDSS_ticket t);
+void ticket_unclaim(pDSS_ticket t);
+void ticket_complete(pDSS_ticket t, void* pData, void* utilid, int state);
+int ticket_wait(pDSS_ticket t, int timeout);
+int ticket_abandon(pDSS_ticket t);
+void ticket_release(pDSS_ticket t);
+
+#endif  /* dss_ticket_h */
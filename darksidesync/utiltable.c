@@ -0,0 +1,114 @@
+#ifndef dss_utiltable_c
+#define dss_utiltable_c
+
+#include "utiltable.h"
+#include <stdlib.h>
+
+// a slot in the handle table
+typedef struct utilSlot {
+		putilRecord util;			// the record in this slot, NULL if the slot is free
+		size_t generation;			// incremented each time the slot is released
+		int nextFree;				// next free slot, -1 if none
+	} utilSlot;
+
+static utilSlot* UtilSlots = NULL;			// handle table, indexed by slot
+static int UtilSlotCount = 0;				// number of slots allocated
+static int UtilFreeSlot = -1;				// first free slot, -1 if none
+static putilRecord UtilHash[DSS_UTILHASH_SIZE];	// hash index by (LuaState, libid)
+
+// Hash bucket for a LuaState/libid combination
+static int utiltable_bucket(pglobalRecord g, void* libid)
+{
+	size_t h = ((size_t)g >> 4) * 31 + ((size_t)libid >> 3);
+	return (int)((h ^ (h >> 8)) % DSS_UTILHASH_SIZE);
+}
+
+// Adds a utility record to the table, stores its ID in 'util->utilid'
+// returns; the new ID, or NULL if out of memory (or slots)
+// NOTE: caller must hold the utillock exclusively
+void* utiltable_add(putilRecord util)
+{
+	int slot, bucket;
+
+	if (UtilFreeSlot == -1)
+	{
+		// no free slots, double the table
+		int i;
+		int newcount = (UtilSlotCount == 0 ? 16 : UtilSlotCount * 2);
+		utilSlot* newslots;
+		if (newcount > DSS_UTILID_MAXSLOTS) newcount = DSS_UTILID_MAXSLOTS;
+		if (newcount <= UtilSlotCount) return NULL;		// all slots in use
+		newslots = (utilSlot*)realloc(UtilSlots, newcount * sizeof(utilSlot));
+		if (newslots == NULL) return NULL;
+		for (i = UtilSlotCount; i < newcount; i++)
+		{
+			newslots[i].util = NULL;
+			newslots[i].generation = 1;
+			newslots[i].nextFree = (i + 1 < newcount ? i + 1 : -1);
+		}
+		UtilFreeSlot = UtilSlotCount;
+		UtilSlots = newslots;
+		UtilSlotCount = newcount;
+	}
+
+	// take the first free slot
+	slot = UtilFreeSlot;
+	UtilFreeSlot = UtilSlots[slot].nextFree;
+	UtilSlots[slot].util = util;
+	util->utilid = (void*)((UtilSlots[slot].generation << DSS_UTILID_SLOTBITS) | (size_t)(slot + 1));
+
+	// add to the hash index
+	bucket = utiltable_bucket(util->pGlobals, util->libid);
+	util->pHashNext = UtilHash[bucket];
+	UtilHash[bucket] = util;
+
+	return util->utilid;
+}
+
+// Removes a utility record from the table, its ID will no longer be valid
+// NOTE: caller must hold the utillock exclusively
+void utiltable_remove(putilRecord util)
+{
+	int slot = (int)(((size_t)util->utilid & DSS_UTILID_MAXSLOTS) - 1);
+	putilRecord* link = &UtilHash[utiltable_bucket(util->pGlobals, util->libid)];
+
+	// remove from the hash index
+	while (*link != NULL && *link != util) link = &((*link)->pHashNext);
+	if (*link != NULL) *link = util->pHashNext;
+
+	// release the slot, with a new generation
+	UtilSlots[slot].util = NULL;
+	UtilSlots[slot].generation = (UtilSlots[slot].generation + 1) & ((size_t)-1 >> DSS_UTILID_SLOTBITS);
+	if (UtilSlots[slot].generation == 0) UtilSlots[slot].generation = 1;
+	UtilSlots[slot].nextFree = UtilFreeSlot;
+	UtilFreeSlot = slot;
+}
+
+// Gets the utility record for an ID (validates the ID)
+// returns; the record, or NULL if the ID is invalid or stale
+// NOTE: caller must hold the utillock (shared)
+putilRecord utiltable_get(void* utilid)
+{
+	size_t id = (size_t)utilid;
+	int slot = (int)((id & DSS_UTILID_MAXSLOTS) - 1);
+	putilRecord util;
+
+	if (slot < 0 || slot >= UtilSlotCount) return NULL;
+	util = UtilSlots[slot].util;
+	if (util == NULL || util->utilid != utilid) return NULL;	// free slot, or another generation
+	return util;
+}
+
+// Finds the utility record for a LuaState and libid
+// @g; the record holding the queue of the utility, the LuaState or its group
+// @owner; the LuaState that registered it (the same as 'g', unless a group)
+// returns; the record, or NULL if not registered
+// NOTE: caller must hold the utillock (shared)
+putilRecord utiltable_find(pglobalRecord g, pglobalRecord owner, void* libid)
+{
+	putilRecord util = UtilHash[utiltable_bucket(g, libid)];
+	while (util != NULL && (util->pGlobals != g || util->pOwner != owner || util->libid != libid)) util = util->pHashNext;
+	return util;
+}
+
+#endif  /* dss_utiltable_c */
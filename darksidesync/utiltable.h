@@ -0,0 +1,26 @@
+#ifndef dss_utiltable_h
+#define dss_utiltable_h
+
+#include "darksidesync.h"
+
+// Utility IDs handed out to the utilities are handles, not pointers. A handle
+// consists of a slot index (+1, so a handle is never NULL) in the lower bits, 
+// and the generation of the slot in the upper bits. The generation is 
+// incremented whenever a slot is released, so stale IDs are rejected.
+#define DSS_UTILID_SLOTBITS 16
+#define DSS_UTILID_MAXSLOTS ((1 << DSS_UTILID_SLOTBITS) - 1)
+// Number of buckets in the (LuaState, libid) hash index
+#define DSS_UTILHASH_SIZE 256
+
+// Methods, see code for more detailed comments
+// NOTE: caller must hold the utillock, exclusive for add/remove, shared for the others
+// Store a new utility record and assign its ID
+void* utiltable_add(putilRecord util);
+// Release the ID of a utility record
+void utiltable_remove(putilRecord util);
+// Get the utility record for an ID
+putilRecord utiltable_get(void* utilid);
+// Find the utility record for a LuaState (or group) and libid
+putilRecord utiltable_find(pglobalRecord g, pglobalRecord owner, void* libid);
+
+#endif /* dss_utiltable_h */
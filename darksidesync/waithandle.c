@@ -2,9 +2,36 @@
 #define dss_waithandle_c
 
 #include <stdlib.h>
+#include <errno.h>
 #include <lua.h>
 #include <lauxlib.h>
 #include "waithandle.h"
+#include "locking.h"
+#ifndef WIN32
+	#include <dlfcn.h>
+#endif
+
+// thread local storage slot for the cached waithandle of each thread
+#ifdef WIN32
+	static DWORD whcache = FLS_OUT_OF_INDEXES;
+#else
+	static pthread_key_t whcache;
+#endif
+static DSS_atomic_t whcachehits = 0;
+static DSS_atomic_t whcachemisses = 0;
+
+#ifdef DSS_FUTEX
+	#define DSS_futex_wait(addr, val) syscall(SYS_futex, (addr), FUTEX_WAIT_PRIVATE, (val), NULL, NULL, 0)
+	#define DSS_futex_timedwait(addr, val, ts) syscall(SYS_futex, (addr), FUTEX_WAIT_PRIVATE, (val), (ts), NULL, 0)
+	#define DSS_futex_wake(addr) syscall(SYS_futex, (addr), FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0)
+	#if defined(__i386__) || defined(__x86_64__)
+		#define DSS_cpu_relax() __asm__ __volatile__ ("pause")
+	#elif defined(__aarch64__)
+		#define DSS_cpu_relax() __asm__ __volatile__ ("yield")
+	#else
+		#define DSS_cpu_relax() do {} while (0)
+	#endif
+#endif
 
 /*
 ** ===============================================================
@@ -28,6 +55,10 @@ pDSS_waithandle DSS_waithandle_create()
 		free(wh);
 		return NULL;
 	}
+#elif defined(DSS_FUTEX)
+	wh->state = 0;
+	// spinning is useless on a single cpu, the signalling thread cannot run meanwhile
+	if (sysconf(_SC_NPROCESSORS_ONLN) > 1) wh->spin = DSS_WAITHANDLE_SPIN_MIN; else wh->spin = 0;
 #else
 	int rt = sem_init(&(wh->semaphore), 0, 0);
 	if (rt != 0 ) {
@@ -53,6 +84,8 @@ void DSS_waithandle_reset(pDSS_waithandle wh)
 		ReleaseSemaphore(wh->semaphore,1, NULL);
 		// now wait 1, effectively reducing to 0 and hence closing
 		WaitForSingleObject(wh->semaphore, INFINITE);
+#elif defined(DSS_FUTEX)
+		__atomic_store_n(&(wh->state), 0, __ATOMIC_SEQ_CST);	// nobody waits while resetting
 #else
 		while (sem_trywait(&(wh->semaphore)) == 0);  // wait (and reduce) until error (value = 0 and blocking)
 #endif
@@ -69,6 +102,9 @@ void DSS_waithandle_signal(pDSS_waithandle wh)
 	if (wh != NULL) {
 #ifdef WIN32
 		ReleaseSemaphore(wh->semaphore, 1, NULL);
+#elif defined(DSS_FUTEX)
+		// only make the syscall if the waiting thread went to sleep
+		if (__atomic_exchange_n(&(wh->state), 1, __ATOMIC_SEQ_CST) == 2) DSS_futex_wake(&(wh->state));
 #else
 		sem_post(&(wh->semaphore));
 #endif
@@ -85,12 +121,111 @@ void DSS_waithandle_wait(pDSS_waithandle wh)
 	if (wh != NULL) {
 #ifdef WIN32
 		WaitForSingleObject(wh->semaphore, INFINITE);
+#elif defined(DSS_FUTEX)
+		int expected;
+		int i;
+
+		// spin first, a fast responding Lua side saves a sleep/wake cycle
+		for (i = 0; i < wh->spin; i++)
+		{
+			expected = 1;
+			if (__atomic_load_n(&(wh->state), __ATOMIC_RELAXED) == 1 &&
+				__atomic_compare_exchange_n(&(wh->state), &expected, 0, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+			{
+				// got it while spinning, allow longer spins next time
+				if (wh->spin < DSS_WAITHANDLE_SPIN_MAX) wh->spin = wh->spin * 2;
+				return;
+			}
+			DSS_cpu_relax();
+		}
+		// spinning was useless this time, spin less next time
+		if (wh->spin > DSS_WAITHANDLE_SPIN_MIN) wh->spin = wh->spin / 2;
+
+		while (1)
+		{
+			expected = 1;
+			if (__atomic_compare_exchange_n(&(wh->state), &expected, 0, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) return;
+			// announce we're going to sleep (0 -> 2), the signalling thread will wake us
+			expected = 0;
+			__atomic_compare_exchange_n(&(wh->state), &expected, 2, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+			if (expected != 1) DSS_futex_wait(&(wh->state), 2);	// returns immediately if no longer 2
+		}
 #else
 		sem_wait(&(wh->semaphore));
 #endif
 	}
 }
 
+/*
+** ===============================================================
+**  Waits for the waithandle to be signalled, with a timeout
+** ===============================================================
+*/
+// @timeout; maximum time to wait in milliseconds, < 0 to wait forever
+// returns 1 if the handle was signalled (and passed), 0 upon timeout
+int DSS_waithandle_timedwait(pDSS_waithandle wh, int timeout)
+{
+	if (wh == NULL) return 1;
+	if (timeout < 0)
+	{
+		DSS_waithandle_wait(wh);
+		return 1;
+	}
+	{
+#ifdef WIN32
+		return (WaitForSingleObject(wh->semaphore, (DWORD)timeout) == WAIT_OBJECT_0);
+#elif defined(DSS_FUTEX)
+		int expected;
+		struct timespec now, end, left;
+
+		// no spinning; a timed wait is not on the fast path
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		end.tv_sec += timeout / 1000;
+		end.tv_nsec += (timeout % 1000) * 1000000L;
+		if (end.tv_nsec >= 1000000000L)
+		{
+			end.tv_sec += 1;
+			end.tv_nsec -= 1000000000L;
+		}
+		while (1)
+		{
+			expected = 1;
+			if (__atomic_compare_exchange_n(&(wh->state), &expected, 0, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) return 1;
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			left.tv_sec = end.tv_sec - now.tv_sec;
+			left.tv_nsec = end.tv_nsec - now.tv_nsec;
+			if (left.tv_nsec < 0)
+			{
+				left.tv_sec -= 1;
+				left.tv_nsec += 1000000000L;
+			}
+			// NOTE: the state may be left at 2, a later signal will just make a useless wake call
+			if (left.tv_sec < 0) return 0;
+			// announce we're going to sleep (0 -> 2), the signalling thread will wake us
+			expected = 0;
+			__atomic_compare_exchange_n(&(wh->state), &expected, 2, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+			if (expected != 1) DSS_futex_timedwait(&(wh->state), 2, &left);	// returns immediately if no longer 2
+		}
+#else
+		struct timespec end;
+
+		clock_gettime(CLOCK_REALTIME, &end);
+		end.tv_sec += timeout / 1000;
+		end.tv_nsec += (timeout % 1000) * 1000000L;
+		if (end.tv_nsec >= 1000000000L)
+		{
+			end.tv_sec += 1;
+			end.tv_nsec -= 1000000000L;
+		}
+		while (sem_timedwait(&(wh->semaphore), &end) != 0)
+		{
+			if (errno != EINTR) return 0;
+		}
+		return 1;
+#endif
+	}
+}
+
 /*
 ** ===============================================================
 **  Destroys the waithandle, releases resources
@@ -103,6 +238,9 @@ void DSS_waithandle_delete(pDSS_waithandle wh)
 		// release before destroying
 		ReleaseSemaphore(wh->semaphore, 1, NULL);
 		CloseHandle(wh->semaphore);
+#elif defined(DSS_FUTEX)
+		// release before destroying
+		DSS_waithandle_signal(wh);
 #else
 		// release before destroying
 		sem_post(&(wh->semaphore));
@@ -113,4 +251,100 @@ void DSS_waithandle_delete(pDSS_waithandle wh)
 	}
 }
 
+/*
+** ===============================================================
+**  Per thread waithandle cache
+** ===============================================================
+*/
+// Destroys the cached handle when a thread exits
+#ifdef WIN32
+static VOID WINAPI DSS_waithandle_cachedestroy(PVOID wh)
+#else
+static void DSS_waithandle_cachedestroy(void* wh)
+#endif
+{
+	DSS_waithandle_delete((pDSS_waithandle)wh);
+}
+
+// Pins the module in memory, the destructor of the cache must remain available
+// for threads exiting after the last LuaState closed (and Lua unloaded the module). 
+// NOTE: for the same reason the thread local storage slot is never released
+static void DSS_waithandle_pinmodule()
+{
+#ifdef WIN32
+	HMODULE module;
+	GetModuleHandleEx(GET_MODULE_HANDLE_EX_FLAG_FROM_ADDRESS | GET_MODULE_HANDLE_EX_FLAG_PIN,
+		(LPCTSTR)&DSS_waithandle_cachedestroy, &module);
+#else
+	Dl_info info;
+	// dlopen-ing ourselves again (without loading) adds the 'no delete' flag
+	if (dladdr((void*)&DSS_waithandle_cachedestroy, &info) != 0 && info.dli_fname != NULL)
+		dlopen(info.dli_fname, RTLD_LAZY | RTLD_NOLOAD | RTLD_NODELETE);
+#endif
+}
+
+// Initializes the cache, must be called once before using the cache
+// Returns 0 upon success
+int DSS_waithandle_initcache()
+{
+	DSS_waithandle_pinmodule();
+#ifdef WIN32
+	whcache = FlsAlloc(&DSS_waithandle_cachedestroy);
+	return (whcache == FLS_OUT_OF_INDEXES);
+#else
+	return pthread_key_create(&whcache, &DSS_waithandle_cachedestroy);
+#endif
+}
+
+// Gets the cached waithandle of the calling thread (it is removed from the 
+// cache until released), or creates a new one if there is none.
+// Returns NULL upon failure
+pDSS_waithandle DSS_waithandle_acquire()
+{
+	pDSS_waithandle wh;
+#ifdef WIN32
+	wh = (pDSS_waithandle)FlsGetValue(whcache);
+	if (wh != NULL) FlsSetValue(whcache, NULL);
+#else
+	wh = (pDSS_waithandle)pthread_getspecific(whcache);
+	if (wh != NULL) pthread_setspecific(whcache, NULL);
+#endif
+	if (wh != NULL)
+	{
+		DSS_atomic_add(&whcachehits, 1);
+		return wh;
+	}
+	DSS_atomic_add(&whcachemisses, 1);
+	return DSS_waithandle_create();
+}
+
+// Returns a waithandle to the cache of the calling thread, or destroys it
+// if the thread already has one cached.
+// NOTE: the handle must be in 'reset' state, eg. it was waited upon after signalling
+void DSS_waithandle_release(pDSS_waithandle wh)
+{
+	if (wh == NULL) return;
+#ifdef WIN32
+	if (FlsGetValue(whcache) == NULL)
+	{
+		FlsSetValue(whcache, wh);
+		return;
+	}
+#else
+	if (pthread_getspecific(whcache) == NULL)
+	{
+		pthread_setspecific(whcache, wh);
+		return;
+	}
+#endif
+	DSS_waithandle_delete(wh);
+}
+
+// Returns the counts of handles acquired from the cache (hits) and created (misses)
+void DSS_waithandle_cachestats(long* hits, long* misses)
+{
+	*hits = DSS_atomic_get(&whcachehits);
+	*misses = DSS_atomic_get(&whcachemisses);
+}
+
 #endif
@@ -1,17 +1,36 @@
 #ifndef dss_waithandle_h
 #define dss_waithandle_h
 
+// On Linux a futex based implementation is used, that spins for a while before
+// going to sleep. Define DSS_NO_FUTEX to use the portable semaphore instead.
+#if defined(__linux__) && !defined(DSS_NO_FUTEX)
+	#define DSS_FUTEX
+#endif
+
 #ifdef WIN32
 	#include <Windows.h>
+#elif defined(DSS_FUTEX)
+	#include <unistd.h>
+	#include <sys/syscall.h>
+	#include <linux/futex.h>
+	#include <time.h>
 #else
 	#include <semaphore.h>
+	#include <time.h>
 #endif
 
+// Spin limits for the futex implementation (number of checks before sleeping)
+#define DSS_WAITHANDLE_SPIN_MIN 16
+#define DSS_WAITHANDLE_SPIN_MAX 4096
+
 // waithandle structure
 typedef struct DSS_waithandle *pDSS_waithandle;
 typedef struct DSS_waithandle {
 	#ifdef WIN32
 		HANDLE semaphore;	
+	#elif defined(DSS_FUTEX)
+		int volatile state;	// 0 = reset, 1 = signalled, 2 = reset and a thread is sleeping on it
+		int spin;			// adaptive spin count, only used by the waiting thread (0 = never spin)
 	#else  // Unix
 		sem_t semaphore;
 	#endif
@@ -23,6 +42,14 @@ pDSS_waithandle DSS_waithandle_create();        // creates a new waithandle, ini
 void DSS_waithandle_reset(pDSS_waithandle wh);  // resets status to blocking (closes the gate)
 void DSS_waithandle_signal(pDSS_waithandle wh); // sets status to signalled (opens the gate)
 void DSS_waithandle_wait(pDSS_waithandle wh);   // blocks thread until handle gets signalled
+int DSS_waithandle_timedwait(pDSS_waithandle wh, int timeout); // same, for at most timeout ms (< 0 is forever), 0 upon timeout
 void DSS_waithandle_delete(pDSS_waithandle wh); // destroys the waithandle
 
+// Per thread cache; a thread blocks on a single waithandle at a time, so one cached
+// handle per thread suffices to never create/destroy a waithandle in steady state
+int DSS_waithandle_initcache();                   // initializes the cache (call once), 0 upon success
+pDSS_waithandle DSS_waithandle_acquire();         // gets the cached handle of the thread, or creates one
+void DSS_waithandle_release(pDSS_waithandle wh);  // returns a (reset) handle to the cache of the thread
+void DSS_waithandle_cachestats(long* hits, long* misses); // counts of acquired handles from/not from cache
+
 #endif  /* dss_waithandle_h */